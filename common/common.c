@@ -32,9 +32,12 @@
 #if HAVE_MALLOC_H
 #include <malloc.h>
 #endif
-#if HAVE_THP
+#if HAVE_THP || HAVE_MMAP
 #include <sys/mman.h>
 #endif
+#if HAVE_MMAP
+#include <sys/stat.h>
+#endif
 
 const int x264_bit_depth = BIT_DEPTH;
 
@@ -139,11 +142,13 @@ void x264_param_default( x264_param_t *param )
     param->rc.i_aq_mode = X264_AQ_VARIANCE;
     param->rc.f_aq_strength = 1.0;
     param->rc.i_lookahead = 40;
+    param->rc.i_lookahead_downscale = 2;
 
     param->rc.b_stat_write = 0;
     param->rc.psz_stat_out = "x264_2pass.log";
     param->rc.b_stat_read = 0;
     param->rc.psz_stat_in = "x264_2pass.log";
+    param->rc.i_stat_format = X264_STATS_FORMAT_TEXT;
     param->rc.f_qcompress = 0.6;
     param->rc.f_qblur = 0.5;
     param->rc.f_complexity_blur = 20;
@@ -1017,6 +1022,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->i_log_level = atoi(value);
     OPT("dump-yuv")
         p->psz_dump_yuv = strdup(value);
+    OPT("profile-stages")
+        p->b_profile_stages = atobool(value);
     OPT2("analyse", "partitions")
     {
         p->analyse.inter = 0;
@@ -1043,6 +1050,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         b_error |= parse_enum( value, x264_motion_est_names, &p->analyse.i_me_method );
     OPT2("merange", "me-range")
         p->analyse.i_me_range = atoi(value);
+    OPT("me-guide")
+        p->analyse.i_me_guide_range = atoi(value);
     OPT2("mvrange", "mv-range")
         p->analyse.i_mv_range = atoi(value);
     OPT2("mvrange-thread", "mv-range-thread")
@@ -1102,6 +1111,13 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->rc.f_rf_constant_max = atof(value);
     OPT("rc-lookahead")
         p->rc.i_lookahead = atoi(value);
+    OPT("lookahead-downscale")
+    {
+        if( !strcmp(value, "auto") )
+            p->rc.i_lookahead_downscale = 0;
+        else
+            p->rc.i_lookahead_downscale = atoi(value);
+    }
     OPT2("qpmin", "qp-min")
         p->rc.i_qp_min = atoi(value);
     OPT2("qpmax", "qp-max")
@@ -1116,6 +1132,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->rc.i_vbv_buffer_size = atoi(value);
     OPT("vbv-init")
         p->rc.f_vbv_buffer_init = atof(value);
+    OPT("vbv-rows")
+        p->rc.b_vbv_rows = atobool(value);
     OPT2("ipratio", "ip-factor")
         p->rc.f_ip_factor = atof(value);
     OPT2("pbratio", "pb-factor")
@@ -1135,6 +1153,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->rc.psz_stat_in = strdup(value);
         p->rc.psz_stat_out = strdup(value);
     }
+    OPT("stats-format")
+        b_error |= parse_enum( value, x264_stats_format_names, &p->rc.i_stat_format );
     OPT("qcomp")
         p->rc.f_qcompress = atof(value);
     OPT("mbtree")
@@ -1152,6 +1172,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->analyse.b_psnr = atobool(value);
     OPT("ssim")
         p->analyse.b_ssim = atobool(value);
+    OPT("metric-maps")
+        p->analyse.b_metric_maps = atobool(value);
     OPT("aud")
         p->b_aud = atobool(value);
     OPT("sps-id")
@@ -1162,6 +1184,8 @@ int x264_param_parse( x264_param_t *p, const char *name, const char *value )
         p->b_repeat_headers = atobool(value);
     OPT("annexb")
         p->b_annexb = atobool(value);
+    OPT("single-nal")
+        p->b_single_nal = atobool(value);
     OPT("force-cfr")
         p->b_vfr_input = !atobool(value);
     OPT("nal-hrd")
@@ -1453,6 +1477,66 @@ error:
     return NULL;
 }
 
+/****************************************************************************
+ * x264_map_file:
+ ****************************************************************************/
+void *x264_map_file( const char *filename, size_t *size, int *b_mapped )
+{
+    int b_error = 0;
+    size_t i_size;
+    uint8_t *buf;
+    FILE *fh = x264_fopen( filename, "rb" );
+    if( !fh )
+        return NULL;
+    *b_mapped = 0;
+#if HAVE_MMAP
+    struct stat st;
+    if( !fstat( fileno( fh ), &st ) && S_ISREG( st.st_mode ) && st.st_size > 0 )
+    {
+        buf = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno( fh ), 0 );
+        if( buf != MAP_FAILED )
+        {
+            fclose( fh );
+            *size = st.st_size;
+            *b_mapped = 1;
+            return buf;
+        }
+    }
+#endif
+    /* fall back to reading the whole file */
+    b_error |= fseek( fh, 0, SEEK_END ) < 0;
+    b_error |= ( i_size = ftell( fh ) ) <= 0;
+    b_error |= fseek( fh, 0, SEEK_SET ) < 0;
+    if( b_error )
+        goto error;
+    buf = x264_malloc( i_size );
+    if( !buf )
+        goto error;
+    if( fread( buf, 1, i_size, fh ) != i_size )
+    {
+        x264_free( buf );
+        goto error;
+    }
+    fclose( fh );
+    *size = i_size;
+    return buf;
+error:
+    fclose( fh );
+    return NULL;
+}
+
+void x264_unmap_file( void *buf, size_t size, int b_mapped )
+{
+#if HAVE_MMAP
+    if( b_mapped )
+    {
+        munmap( buf, size );
+        return;
+    }
+#endif
+    x264_free( buf );
+}
+
 /****************************************************************************
  * x264_param2string:
  ****************************************************************************/
@@ -1489,6 +1573,8 @@ char *x264_param2string( x264_param_t *p, int b_res )
         s += sprintf( s, " psy_rd=%.2f:%.2f", p->analyse.f_psy_rd, p->analyse.f_psy_trellis );
     s += sprintf( s, " mixed_ref=%d", p->analyse.b_mixed_references );
     s += sprintf( s, " me_range=%d", p->analyse.i_me_range );
+    if( p->analyse.i_me_guide_range )
+        s += sprintf( s, " me_guide=%d", p->analyse.i_me_guide_range );
     s += sprintf( s, " chroma_me=%d", p->analyse.b_chroma_me );
     s += sprintf( s, " trellis=%d", p->analyse.i_trellis );
     s += sprintf( s, " 8x8dct=%d", p->analyse.b_transform_8x8 );
@@ -1533,6 +1619,8 @@ char *x264_param2string( x264_param_t *p, int b_res )
         s += sprintf( s, " keyint=%d", p->i_keyint_max );
     s += sprintf( s, " keyint_min=%d scenecut=%d intra_refresh=%d",
                   p->i_keyint_min, p->i_scenecut_threshold, p->b_intra_refresh );
+    if( p->rc.i_lookahead_downscale != 2 )
+        s += sprintf( s, " lookahead_downscale=%d", p->rc.i_lookahead_downscale );
 
     if( p->rc.b_mb_tree || p->rc.i_vbv_buffer_size )
         s += sprintf( s, " rc_lookahead=%d", p->rc.i_lookahead );
@@ -1558,6 +1646,8 @@ char *x264_param2string( x264_param_t *p, int b_res )
                           p->rc.i_vbv_max_bitrate, p->rc.i_vbv_buffer_size );
             if( p->rc.i_rc_method == X264_RC_CRF )
                 s += sprintf( s, " crf_max=%.1f", p->rc.f_rf_constant_max );
+            if( p->rc.b_vbv_rows )
+                s += sprintf( s, " vbv_rows=1" );
         }
     }
     else if( p->rc.i_rc_method == X264_RC_CQP )
@@ -274,9 +274,15 @@ void  x264_free( void * );
 
 /* x264_slurp_file: malloc space for the whole file and read it */
 char *x264_slurp_file( const char *filename );
+/* x264_map_file: map a whole file read-only, or read it into memory where mapping isn't available.
+ * release it with x264_unmap_file */
+void *x264_map_file( const char *filename, size_t *size, int *b_mapped );
+void  x264_unmap_file( void *buf, size_t size, int b_mapped );
 
 /* mdate: return the current date in microsecond */
 int64_t x264_mdate( void );
+/* nanotime: return a monotonic time in nanoseconds, for measuring intervals */
+int64_t x264_nanotime( void );
 
 /* x264_param2string: return a (malloced) string containing most of
  * the encoding options */
@@ -425,6 +431,9 @@ static const uint8_t structure_to_start_code[] =
     [MPEG2_COPYRIGHT_EXT]      = MPEG2_EXT_START_CODE,
 };
 
+/* slices use their row number as the start code */
+#define MPEG2_START_CODE( type ) ((type) > 0 && (type) < MPEG2_SEQ_HEADER ? (type) : structure_to_start_code[type])
+
 enum mpeg2_extension_id_e
 {
     MPEG2_SEQ_EXT_ID          = 1,
@@ -513,6 +522,23 @@ typedef struct x264_lookahead_t
     x264_sync_frame_list_t        ofbuf;
 } x264_lookahead_t;
 
+/* Pictures passed with b_row_input, read into their frames as x264_encoder_input_rows signals lines */
+typedef struct x264_row_input_t
+{
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t  cv;
+    int                  b_whole_picture; /* encoding can't start before the picture is complete */
+    int                  b_row_aq;        /* AQ offsets are computed as rows are read */
+    /* signalled by x264_encoder_input_rows */
+    int                  i_pictures;      /* number of complete pictures */
+    int                  i_lines;         /* lines of the picture after those */
+    /* picture being read */
+    int                  i_picture;       /* number of pictures read before it */
+    int                  i_lines_read;
+    x264_frame_t         *frame;          /* NULL once it has been read completely */
+    x264_picture_t       pic;
+} x264_row_input_t;
+
 typedef struct x264_ratecontrol_t   x264_ratecontrol_t;
 
 typedef struct x264_left_table_t
@@ -548,8 +574,8 @@ typedef struct
     int i_direct_score[2];
     /* Metrics */
     int64_t i_ssd[3];
-    double f_ssim;
-    int i_ssim_cnt;
+    double f_ssim[3];
+    int i_ssim_cnt[3];
 } x264_frame_stat_t;
 
 struct x264_t
@@ -567,6 +593,7 @@ struct x264_t
     int             i_threadslice_pass; /* which pass of encoding we are on */
     x264_threadpool_t *threadpool;
     x264_threadpool_t *lookaheadpool;
+    x264_threadpool_t *metricpool; /* measures psnr/ssim of finished rows, off the frame threads */
     x264_pthread_mutex_t mutex;
     x264_pthread_cond_t cv;
 
@@ -683,6 +710,7 @@ struct x264_t
         int64_t i_largest_pts;
         int64_t i_second_largest_pts;
         int b_have_lowres;  /* Whether 1/2 resolution luma planes are being used */
+        int i_lowres_level; /* Level of the lowres pyramid the lookahead analyses: 0 = 1/2, 1 = 1/4, 2 = 1/8 resolution */
         int b_have_sub8x8_esa;
     } frames;
 
@@ -741,6 +769,7 @@ struct x264_t
 
         /* Search parameters */
         int     i_me_method;
+        int     i_me_range;
         int     i_subpel_refine;
         int     b_chroma_me;
         int     b_trellis;
@@ -990,6 +1019,8 @@ struct x264_t
         double  f_psnr_mean_u[3];
         double  f_psnr_mean_v[3];
         double  f_ssim_mean_y[3];
+        double  f_ssim_mean_u[3];
+        double  f_ssim_mean_v[3];
         double  f_frame_duration[3];
         /* */
         int64_t i_mb_count[3][19];
@@ -1022,11 +1053,37 @@ struct x264_t
     /* Buffers that are allocated per-thread even in sliced threads. */
     void *scratch_buffer; /* for any temporary storage that doesn't want repeated malloc */
     void *scratch_buffer2; /* if the first one's already in use */
+    uint16_t *propagate_accum[2]; /* lookahead workers: MB-tree propagation targets for list0/1, summed by the caller */
     pixel *intra_border_backup[5][3]; /* bottom pixels of the previous mb row, used for intra prediction after the framebuffer has been deblocked */
     /* Deblock strength values are stored for each 4x4 partition. In MBAFF
      * there are four extra values that need to be stored, located in [4][i]. */
     uint8_t (*deblock_strength[2])[2][8][4];
 
+    /* Quality metrics of the current frame, measured by a metricpool job when b_active,
+     * otherwise inline by x264_fdec_filter_row into stat.frame. */
+    struct
+    {
+        int     b_active;
+        int64_t i_ssd[3];
+        double  f_ssim[3];
+        int     i_ssim_cnt[3];
+        void    *buf_ssim;      /* row sums for x264_pixel_ssim_wxh */
+        pixel   *buf_chroma;    /* fenc and fdec chroma rows, deinterleaved for ssim */
+        int     i_chroma_stride;
+        float   *psnr_map;      /* per-MB luma psnr and ssim, if analyse.b_metric_maps */
+        float   *ssim_map;
+    } metrics;
+
+    /* Time spent in each stage by this context, if b_profile_stages. Not synchronized between threads. */
+    x264_stage_stats_t stage_stats[X264_STAGE_MAX];
+    /* Time blocked at each wait site, and time spent doing work, by this context.  The calling thread
+     * only writes X264_WAIT_FRAME and X264_WAIT_LOOKAHEAD, which worker threads never touch, and
+     * X264_WAIT_INPUT, which workers only write for row input read while the calling thread waits. */
+    x264_wait_stats_t wait_stats[X264_WAIT_MAX];
+    int64_t i_busy_time;
+    int64_t i_wall_start; /* thread[0] only */
+    int64_t i_wall_end;
+
     /* CPU functions dependents */
     x264_predict_t      predict_16x16[4+3];
     x264_predict8x8_t   predict_8x8[9+3];
@@ -1049,6 +1106,7 @@ struct x264_t
     x264_bitstream_function_t bsf;
 
     x264_lookahead_t *lookahead;
+    x264_row_input_t *row_input;
 
 #if HAVE_OPENCL
     x264_opencl_t opencl;
@@ -1058,6 +1116,35 @@ struct x264_t
 // included at the end because it needs x264_t
 #include "macroblock.h"
 
+/* Stage timing: start returns 0 when profiling is disabled, so end is a no-op. */
+static ALWAYS_INLINE int64_t x264_stage_start( x264_t *h )
+{
+    return h->param.b_profile_stages ? x264_nanotime() : 0;
+}
+
+static ALWAYS_INLINE void x264_stage_end( x264_t *h, int stage, int64_t start )
+{
+    if( start )
+    {
+        int64_t time = x264_nanotime() - start;
+        uint32_t bucket = X264_MIN( time, 1<<30 ) >> 7;
+        x264_stage_stats_t *s = &h->stage_stats[stage];
+        s->i_calls++;
+        s->i_time += time;
+        s->i_hist[bucket ? 31 - x264_clz( bucket ) : 0]++;
+    }
+}
+
+/* Wait accounting: time is the nanoseconds blocked, 0 if the wait returned immediately. */
+static ALWAYS_INLINE void x264_wait_account( x264_t *h, int site, int64_t time )
+{
+    if( time )
+    {
+        h->wait_stats[site].i_waits++;
+        h->wait_stats[site].i_time += time;
+    }
+}
+
 static int ALWAYS_INLINE x264_predictor_roundclip( int16_t (*dst)[2], int16_t (*mvc)[2], int i_mvc, int16_t mv_limit[2][2], uint32_t pmv )
 {
     int cnt = 0;
@@ -124,6 +124,13 @@ static x264_frame_t *x264_frame_new( x264_t *h, int b_fdec )
     frame->i_width_lowres = frame->i_width[0]/2;
     frame->i_lines_lowres = frame->i_lines[0]/2;
     frame->i_stride_lowres = align_stride( frame->i_width_lowres + 2*PADH, align, disalign<<1 );
+    /* Round the coarse levels up to whole 8x8 blocks, each one covering a square of macroblocks. */
+    for( int i = 0; i < h->frames.i_lowres_level; i++ )
+    {
+        frame->i_width_coarse[i] = ((h->mb.i_mb_width  + (2<<i) - 1) >> (i+1)) * 8;
+        frame->i_lines_coarse[i] = ((h->mb.i_mb_height + (2<<i) - 1) >> (i+1)) * 8;
+        frame->i_stride_coarse[i] = align_stride( frame->i_width_coarse[i] + 2*PADH, align, disalign<<1 );
+    }
 
     for( int i = 0; i < h->param.i_bframe + 2; i++ )
         for( int j = 0; j < h->param.i_bframe + 2; j++ )
@@ -213,6 +220,11 @@ static x264_frame_t *x264_frame_new( x264_t *h, int b_fdec )
         {
             int luma_plane_size = align_plane_size( frame->i_stride_lowres * (frame->i_lines[0]/2 + 2*PADV), disalign );
             PREALLOC( frame->buffer_lowres[0], pixel_buffers * luma_plane_size * sizeof(pixel) );
+            for( int i = 0; i < h->frames.i_lowres_level; i++ )
+            {
+                int coarse_plane_size = align_plane_size( frame->i_stride_coarse[i] * (frame->i_lines_coarse[i] + 2*PADV), disalign );
+                PREALLOC( frame->buffer_coarse[i], pixel_buffers * coarse_plane_size * sizeof(pixel) );
+            }
 
             for( int j = 0; j <= !!h->param.i_bframe; j++ )
                 for( int i = 0; i <= h->param.i_bframe; i++ )
@@ -280,6 +292,12 @@ static x264_frame_t *x264_frame_new( x264_t *h, int b_fdec )
             int luma_plane_size = align_plane_size( frame->i_stride_lowres * (frame->i_lines[0]/2 + 2*PADV), disalign );
             for( int i = 0; i < pixel_buffers; i++ )
                 frame->lowres[i] = frame->buffer_lowres[0] + (frame->i_stride_lowres * PADV + PADH) + i * luma_plane_size;
+            for( int j = 0; j < h->frames.i_lowres_level; j++ )
+            {
+                int coarse_plane_size = align_plane_size( frame->i_stride_coarse[j] * (frame->i_lines_coarse[j] + 2*PADV), disalign );
+                for( int i = 0; i < pixel_buffers; i++ )
+                    frame->coarse[j][i] = frame->buffer_coarse[j] + (frame->i_stride_coarse[j] * PADV + PADH) + i * coarse_plane_size;
+            }
 
             for( int j = 0; j <= !!h->param.i_bframe; j++ )
                 for( int i = 0; i <= h->param.i_bframe; i++ )
@@ -400,16 +418,27 @@ int x264_frame_copy_picture( x264_t *h, x264_frame_t *dst, x264_picture_t *src )
     dst->b_tff            = src->b_tff;
     dst->b_rff            = src->b_rff;
 
+    /* With row input, the encoder reads the lines as the application signals them. */
+    return x264_frame_copy_picture_lines( h, dst, src, 0, h->param.b_row_input ? 0 : h->param.i_height );
+}
+
+/* Copy lines [i_start, i_end) of the picture.  Both have to be even with subsampled chroma,
+ * except for an i_end at the bottom of the picture. */
+int x264_frame_copy_picture_lines( x264_t *h, x264_frame_t *dst, x264_picture_t *src, int i_start, int i_end )
+{
+    int i_csp = src->img.i_csp & X264_CSP_MASK;
+    int i_lines = i_end - i_start;
     uint8_t *pix[3];
     int stride[3];
     if( i_csp == X264_CSP_V210 )
     {
          stride[0] = src->img.i_stride[0];
-         pix[0] = src->img.plane[0];
+         pix[0] = src->img.plane[0] + i_start * stride[0];
 
-         h->mc.plane_copy_deinterleave_v210( dst->plane[0], dst->i_stride[0],
-                                             dst->plane[1], dst->i_stride[1],
-                                             (uint32_t *)pix[0], stride[0]/sizeof(uint32_t), h->param.i_width, h->param.i_height );
+         if( i_lines > 0 )
+             h->mc.plane_copy_deinterleave_v210( dst->plane[0] + i_start * dst->i_stride[0], dst->i_stride[0],
+                                                 dst->plane[1] + i_start * dst->i_stride[1], dst->i_stride[1],
+                                                 (uint32_t *)pix[0], stride[0]/sizeof(uint32_t), h->param.i_width, i_lines );
     }
     else if( i_csp >= X264_CSP_BGR )
     {
@@ -420,42 +449,53 @@ int x264_frame_copy_picture( x264_t *h, x264_frame_t *dst, x264_picture_t *src )
              pix[0] += (h->param.i_height-1) * stride[0];
              stride[0] = -stride[0];
          }
+         pix[0] += i_start * stride[0];
          int b = i_csp==X264_CSP_RGB;
-         h->mc.plane_copy_deinterleave_rgb( dst->plane[1+b], dst->i_stride[1+b],
-                                            dst->plane[0], dst->i_stride[0],
-                                            dst->plane[2-b], dst->i_stride[2-b],
-                                            (pixel*)pix[0], stride[0]/sizeof(pixel), i_csp==X264_CSP_BGRA ? 4 : 3, h->param.i_width, h->param.i_height );
+         if( i_lines > 0 )
+             h->mc.plane_copy_deinterleave_rgb( dst->plane[1+b] + i_start * dst->i_stride[1+b], dst->i_stride[1+b],
+                                                dst->plane[0] + i_start * dst->i_stride[0], dst->i_stride[0],
+                                                dst->plane[2-b] + i_start * dst->i_stride[2-b], dst->i_stride[2-b],
+                                                (pixel*)pix[0], stride[0]/sizeof(pixel), i_csp==X264_CSP_BGRA ? 4 : 3, h->param.i_width, i_lines );
     }
     else
     {
         int v_shift = CHROMA_V_SHIFT;
+        int c_start = i_start >> v_shift;
+        int c_lines = (i_end >> v_shift) - c_start;
+        /* Validate all the planes before copying any lines */
         get_plane_ptr( h, src, &pix[0], &stride[0], 0, 0, 0 );
-        h->mc.plane_copy( dst->plane[0], dst->i_stride[0], (pixel*)pix[0],
-                          stride[0]/sizeof(pixel), h->param.i_width, h->param.i_height );
         if( i_csp == X264_CSP_NV12 || i_csp == X264_CSP_NV16 )
-        {
             get_plane_ptr( h, src, &pix[1], &stride[1], 1, 0, v_shift );
-            h->mc.plane_copy( dst->plane[1], dst->i_stride[1], (pixel*)pix[1],
-                              stride[1]/sizeof(pixel), h->param.i_width, h->param.i_height>>v_shift );
-        }
         else if( i_csp == X264_CSP_I420 || i_csp == X264_CSP_I422 || i_csp == X264_CSP_YV12 || i_csp == X264_CSP_YV16 )
         {
             int uv_swap = i_csp == X264_CSP_YV12 || i_csp == X264_CSP_YV16;
             get_plane_ptr( h, src, &pix[1], &stride[1], uv_swap ? 2 : 1, 1, v_shift );
             get_plane_ptr( h, src, &pix[2], &stride[2], uv_swap ? 1 : 2, 1, v_shift );
-            h->mc.plane_copy_interleave( dst->plane[1], dst->i_stride[1],
-                                         (pixel*)pix[1], stride[1]/sizeof(pixel),
-                                         (pixel*)pix[2], stride[2]/sizeof(pixel),
-                                         h->param.i_width>>1, h->param.i_height>>v_shift );
         }
         else //if( i_csp == X264_CSP_I444 || i_csp == X264_CSP_YV24 )
         {
             get_plane_ptr( h, src, &pix[1], &stride[1], i_csp==X264_CSP_I444 ? 1 : 2, 0, 0 );
             get_plane_ptr( h, src, &pix[2], &stride[2], i_csp==X264_CSP_I444 ? 2 : 1, 0, 0 );
-            h->mc.plane_copy( dst->plane[1], dst->i_stride[1], (pixel*)pix[1],
-                              stride[1]/sizeof(pixel), h->param.i_width, h->param.i_height );
-            h->mc.plane_copy( dst->plane[2], dst->i_stride[2], (pixel*)pix[2],
-                              stride[2]/sizeof(pixel), h->param.i_width, h->param.i_height );
+        }
+        if( i_lines <= 0 )
+            return 0;
+
+        h->mc.plane_copy( dst->plane[0] + i_start * dst->i_stride[0], dst->i_stride[0], (pixel*)(pix[0] + i_start * stride[0]),
+                          stride[0]/sizeof(pixel), h->param.i_width, i_lines );
+        if( i_csp == X264_CSP_NV12 || i_csp == X264_CSP_NV16 )
+            h->mc.plane_copy( dst->plane[1] + c_start * dst->i_stride[1], dst->i_stride[1], (pixel*)(pix[1] + c_start * stride[1]),
+                              stride[1]/sizeof(pixel), h->param.i_width, c_lines );
+        else if( i_csp == X264_CSP_I420 || i_csp == X264_CSP_I422 || i_csp == X264_CSP_YV12 || i_csp == X264_CSP_YV16 )
+            h->mc.plane_copy_interleave( dst->plane[1] + c_start * dst->i_stride[1], dst->i_stride[1],
+                                         (pixel*)(pix[1] + c_start * stride[1]), stride[1]/sizeof(pixel),
+                                         (pixel*)(pix[2] + c_start * stride[2]), stride[2]/sizeof(pixel),
+                                         h->param.i_width>>1, c_lines );
+        else
+        {
+            h->mc.plane_copy( dst->plane[1] + i_start * dst->i_stride[1], dst->i_stride[1], (pixel*)(pix[1] + i_start * stride[1]),
+                              stride[1]/sizeof(pixel), h->param.i_width, i_lines );
+            h->mc.plane_copy( dst->plane[2] + i_start * dst->i_stride[2], dst->i_stride[2], (pixel*)(pix[2] + i_start * stride[2]),
+                              stride[2]/sizeof(pixel), h->param.i_width, i_lines );
         }
     }
     return 0;
@@ -613,6 +653,14 @@ void x264_frame_expand_border_lowres( x264_t *h, x264_frame_t *frame )
         plane_expand_border( frame->lowres[i], frame->i_stride_lowres, frame->i_width_lowres, frame->i_lines_lowres, PADH, PADV, 1, 1, 0 );
 }
 
+void x264_frame_expand_border_coarse( x264_t *h, x264_frame_t *frame, int level )
+{
+    int pixel_buffers = MPEG2 ? 1 : 4;
+    for( int i = 0; i < pixel_buffers; i++ )
+        plane_expand_border( frame->coarse[level][i], frame->i_stride_coarse[level], frame->i_width_coarse[level],
+                             frame->i_lines_coarse[level], PADH, PADV, 1, 1, 0 );
+}
+
 void x264_frame_expand_border_chroma( x264_t *h, x264_frame_t *frame, int plane )
 {
     int v_shift = CHROMA_V_SHIFT;
@@ -620,7 +668,9 @@ void x264_frame_expand_border_chroma( x264_t *h, x264_frame_t *frame, int plane
                          PADH, PADV>>v_shift, 1, 1, CHROMA_H_SHIFT );
 }
 
-void x264_frame_expand_border_mod16( x264_t *h, x264_frame_t *frame )
+/* Pad lines [i_start, i_end) of the picture to a multiple of 16 wide, and the picture to
+ * a multiple of 16 high once i_end reaches its bottom. */
+void x264_frame_expand_border_mod16( x264_t *h, x264_frame_t *frame, int i_start, int i_end )
 {
     for( int i = 0; i < frame->i_plane; i++ )
     {
@@ -631,9 +681,11 @@ void x264_frame_expand_border_mod16( x264_t *h, x264_frame_t *frame )
         int i_padx = (h->mb.i_mb_width * 16 - h->param.i_width);
         int i_pady = (h->mb.i_mb_height * 16 - h->param.i_height) >> v_shift;
 
+        if( i_end < h->param.i_height )
+            i_pady = 0;
         if( i_padx )
         {
-            for( int y = 0; y < i_height; y++ )
+            for( int y = i_start >> v_shift; y < i_end >> v_shift; y++ )
                 pixel_memset( &frame->plane[i][y*frame->i_stride[i] + i_width],
                               &frame->plane[i][y*frame->i_stride[i] + i_width - 1-h_shift],
                               i_padx>>h_shift, sizeof(pixel)<<h_shift );
@@ -671,12 +723,19 @@ void x264_frame_cond_broadcast( x264_frame_t *frame, int i_lines_completed )
     x264_pthread_mutex_unlock( &frame->mutex );
 }
 
-void x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed )
+/* The wait functions return the time spent blocked, 0 if the condition was already met. */
+int64_t x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed )
 {
+    int64_t start = 0;
     x264_pthread_mutex_lock( &frame->mutex );
-    while( frame->i_lines_completed < i_lines_completed )
-        x264_pthread_cond_wait( &frame->cv, &frame->mutex );
+    if( frame->i_lines_completed < i_lines_completed )
+    {
+        start = x264_nanotime();
+        while( frame->i_lines_completed < i_lines_completed )
+            x264_pthread_cond_wait( &frame->cv, &frame->mutex );
+    }
     x264_pthread_mutex_unlock( &frame->mutex );
+    return start ? x264_nanotime() - start : 0;
 }
 
 void x264_threadslice_cond_broadcast( x264_t *h, int pass )
@@ -688,12 +747,18 @@ void x264_threadslice_cond_broadcast( x264_t *h, int pass )
     x264_pthread_mutex_unlock( &h->mutex );
 }
 
-void x264_threadslice_cond_wait( x264_t *h, int pass )
+int64_t x264_threadslice_cond_wait( x264_t *h, int pass )
 {
+    int64_t start = 0;
     x264_pthread_mutex_lock( &h->mutex );
-    while( h->i_threadslice_pass < pass )
-        x264_pthread_cond_wait( &h->cv, &h->mutex );
+    if( h->i_threadslice_pass < pass )
+    {
+        start = x264_nanotime();
+        while( h->i_threadslice_pass < pass )
+            x264_pthread_cond_wait( &h->cv, &h->mutex );
+    }
     x264_pthread_mutex_unlock( &h->mutex );
+    return start ? x264_nanotime() - start : 0;
 }
 
 int x264_frame_new_slice( x264_t *h, x264_frame_t *frame )
@@ -781,6 +846,23 @@ x264_frame_t *x264_frame_pop_unused( x264_t *h, int b_fdec )
     return frame;
 }
 
+/* Forget what the lookahead learnt about an unused frame in the previous stream,
+ * so that it is analysed like a new frame in the next one. */
+void x264_frame_reset_lookahead( x264_t *h, x264_frame_t *frame )
+{
+    frame->i_coded_fields_lookahead =
+    frame->i_cpb_delay_lookahead = -1;
+    memset( frame->i_planned_type, X264_TYPE_AUTO, sizeof(frame->i_planned_type) );
+    memset( frame->i_planned_satd, 0, sizeof(frame->i_planned_satd) );
+    memset( frame->f_planned_cpb_duration, 0, sizeof(frame->f_planned_cpb_duration) );
+    if( !h->frames.b_have_lowres )
+        return;
+    for( int j = 0; j <= !!h->param.i_bframe; j++ )
+        for( int i = 0; i <= h->param.i_bframe; i++ )
+            memset( frame->lowres_mvs[j][i], 0, 2*h->mb.i_mb_count*sizeof(int16_t) );
+    memset( frame->i_intra_cost, -1, (h->mb.i_mb_count+3) * sizeof(uint16_t) );
+}
+
 void x264_frame_push_blank_unused( x264_t *h, x264_frame_t *frame )
 {
     assert( frame->i_reference_count > 0 );
@@ -48,6 +48,7 @@ typedef struct x264_frame
     int64_t i_cpb_duration;
     int64_t i_cpb_delay; /* in SPS time_scale units (i.e 2 * timebase units) */
     int64_t i_dpb_output_delay;
+    int64_t i_input_time; /* x264_nanotime() when the frame was passed to x264_encoder_encode */
     x264_param_t *param;
 
     int     i_frame;     /* Presentation frame number */
@@ -80,11 +81,15 @@ typedef struct x264_frame
     int     i_stride_lowres;
     int     i_width_lowres;
     int     i_lines_lowres;
+    int     i_stride_coarse[2];
+    int     i_width_coarse[2];
+    int     i_lines_coarse[2];
     pixel *plane[3];
     pixel *plane_fld[3];
     pixel *filtered[3][4]; /* plane[0], H, V, HV */
     pixel *filtered_fld[3][4];
     pixel *lowres[4]; /* half-size copy of input frame: Orig, H, V, HV */
+    pixel *coarse[2][4]; /* quarter- and eighth-size copies, built from lowres up to the level the lookahead analyses */
     uint16_t *integral;
 
     /* for unrestricted mv we allocate more data than needed
@@ -92,6 +97,7 @@ typedef struct x264_frame
     pixel *buffer[4];
     pixel *buffer_fld[4];
     pixel *buffer_lowres[4];
+    pixel *buffer_coarse[2];
 
     x264_weight_t weight[X264_REF_MAX][3]; /* [ref_index][plane] */
     pixel *weighted[X264_REF_MAX]; /* plane[0] weighted of the reference frames */
@@ -122,7 +128,11 @@ typedef struct x264_frame
     int16_t inv_ref_poc[2]; // inverse values of ref0 poc to avoid divisions in temporal MV prediction
 
     /* for adaptive B-frame decision.
-     * contains the SATD cost of the lowres frame encoded in various modes
+     * contains the SATD cost of the lowres frame encoded in various modes,
+     * indexed by [b-p0][p1-b]; -1 if not computed yet.
+     * Lookahead frames are consecutive, so the distances identify the references: the costs,
+     * like lowres_mvs, stay valid from x264_frame_init_lowres until the frame leaves the
+     * lookahead, and are reused by every slicetype decision whose window contains the frame.
      * FIXME: how big an array do we need? */
     int     i_cost_est[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2];
     int     i_cost_est_aq[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2];
@@ -136,6 +146,7 @@ typedef struct x264_frame
     float   *f_qp_offset;
     float   *f_qp_offset_aq;
     int     b_intra_calculated;
+    x264_t  *lowres_h; /* context building the lowres planes on the lookahead pool, NULL once they are done */
     uint16_t *i_intra_cost;
     uint16_t *i_propagate_cost;
     uint16_t *i_inv_qscale_factor;
@@ -225,12 +236,14 @@ typedef struct
 void          x264_frame_delete( x264_frame_t *frame );
 
 int           x264_frame_copy_picture( x264_t *h, x264_frame_t *dst, x264_picture_t *src );
+int           x264_frame_copy_picture_lines( x264_t *h, x264_frame_t *dst, x264_picture_t *src, int i_start, int i_end );
 
 void          x264_frame_expand_border( x264_t *h, x264_frame_t *frame, int mb_y );
 void          x264_frame_expand_border_filtered( x264_t *h, x264_frame_t *frame, int mb_y, int b_end );
 void          x264_frame_expand_border_lowres( x264_t *h, x264_frame_t *frame );
+void          x264_frame_expand_border_coarse( x264_t *h, x264_frame_t *frame, int level );
 void          x264_frame_expand_border_chroma( x264_t *h, x264_frame_t *frame, int plane );
-void          x264_frame_expand_border_mod16( x264_t *h, x264_frame_t *frame );
+void          x264_frame_expand_border_mod16( x264_t *h, x264_frame_t *frame, int i_start, int i_end );
 void          x264_expand_border_mbpair( x264_t *h, int mb_x, int mb_y );
 
 void          x264_frame_deblock_row( x264_t *h, int mb_y );
@@ -242,11 +255,11 @@ void          x264_frame_init_lowres( x264_t *h, x264_frame_t *frame );
 void          x264_deblock_init( int cpu, x264_deblock_function_t *pf, int b_mbaff );
 
 void          x264_frame_cond_broadcast( x264_frame_t *frame, int i_lines_completed );
-void          x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed );
+int64_t       x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed );
 int           x264_frame_new_slice( x264_t *h, x264_frame_t *frame );
 
 void          x264_threadslice_cond_broadcast( x264_t *h, int pass );
-void          x264_threadslice_cond_wait( x264_t *h, int pass );
+int64_t       x264_threadslice_cond_wait( x264_t *h, int pass );
 
 void          x264_frame_push( x264_frame_t **list, x264_frame_t *frame );
 x264_frame_t *x264_frame_pop( x264_frame_t **list );
@@ -258,6 +271,7 @@ x264_frame_t *x264_frame_pop_blank_unused( x264_t *h );
 void x264_weight_scale_plane( x264_t *h, pixel *dst, intptr_t i_dst_stride, pixel *src, intptr_t i_src_stride,
                               int i_width, int i_height, x264_weight_t *w );
 x264_frame_t *x264_frame_pop_unused( x264_t *h, int b_fdec );
+void          x264_frame_reset_lookahead( x264_t *h, x264_frame_t *frame );
 void          x264_frame_delete_list( x264_frame_t **list );
 
 int           x264_sync_frame_list_init( x264_sync_frame_list_t *slist, int nelem );
@@ -377,6 +377,24 @@ int x264_macroblock_thread_allocate( x264_t *h, int b_lookahead )
                 CHECKED_MALLOC( h->deblock_strength[i], sizeof(**h->deblock_strength) * h->mb.i_mb_width );
             h->deblock_strength[1] = h->deblock_strength[i];
         }
+
+        if( h->param.analyse.b_ssim )
+        {
+            CHECKED_MALLOC( h->metrics.buf_ssim, 8 * (h->param.i_width/4+3) * sizeof(int) );
+            if( !CHROMA444 )
+            {
+                /* 4 planes of the tallest chunk measured at once: an mbaff pair plus the ssim overlap */
+                h->metrics.i_chroma_stride = ALIGN( (h->param.i_width>>1) + 16, 64 );
+                CHECKED_MALLOCZERO( h->metrics.buf_chroma, 4 * 48 * h->metrics.i_chroma_stride * sizeof(pixel) );
+            }
+        }
+        if( h->param.analyse.b_metric_maps )
+        {
+            if( h->param.analyse.b_psnr )
+                CHECKED_MALLOC( h->metrics.psnr_map, h->mb.i_mb_count * sizeof(float) );
+            if( h->param.analyse.b_ssim )
+                CHECKED_MALLOC( h->metrics.ssim_map, h->mb.i_mb_count * sizeof(float) );
+        }
     }
 
     /* Allocate scratch buffer */
@@ -384,11 +402,10 @@ int x264_macroblock_thread_allocate( x264_t *h, int b_lookahead )
     if( !b_lookahead )
     {
         int buf_hpel = (h->thread[0]->fdec->i_width[0]+48+32) * sizeof(int16_t);
-        int buf_ssim = h->param.analyse.b_ssim * 8 * (h->param.i_width/4+3) * sizeof(int);
         int me_range = X264_MIN(h->param.analyse.i_me_range, h->param.analyse.i_mv_range);
         int buf_tesa = (h->param.analyse.i_me_method >= X264_ME_ESA) *
             ((me_range*2+24) * sizeof(int16_t) + (me_range+4) * (me_range+1) * 4 * sizeof(mvsad_t));
-        scratch_size = X264_MAX3( buf_hpel, buf_ssim, buf_tesa );
+        scratch_size = X264_MAX( buf_hpel, buf_tesa );
     }
     int buf_mbtree = h->param.rc.b_mb_tree * ((h->mb.i_mb_width+7)&~7) * sizeof(int16_t);
     scratch_size = X264_MAX( scratch_size, buf_mbtree );
@@ -417,11 +434,49 @@ void x264_macroblock_thread_free( x264_t *h, int b_lookahead )
         for( int i = 0; i < (PARAM_INTERLACED ? 5 : 2); i++ )
             for( int j = 0; j < (CHROMA444 ? 3 : 2); j++ )
                 x264_free( h->intra_border_backup[i][j] - 16 );
+        x264_free( h->metrics.buf_ssim );
+        x264_free( h->metrics.buf_chroma );
+        x264_free( h->metrics.psnr_map );
+        x264_free( h->metrics.ssim_map );
     }
     x264_free( h->scratch_buffer );
     x264_free( h->scratch_buffer2 );
 }
 
+/* The lookahead worker contexts are bare copies of the main context; whole-frame lookahead
+ * jobs additionally need their own scratch space and weighted lowres plane. */
+int x264_macroblock_lookahead_thread_allocate( x264_t *h )
+{
+    if( x264_macroblock_thread_allocate( h, 1 ) < 0 )
+        return -1;
+    h->mb.p_weight_buf[0] = NULL;
+    if( h->param.analyse.i_weighted_pred )
+    {
+        int i_padv = PADV << PARAM_INTERLACED;
+        int luma_plane_size = h->thread[0]->fdec->i_stride_lowres * (h->mb.i_mb_height*8+2*i_padv);
+        CHECKED_MALLOC( h->mb.p_weight_buf[0], luma_plane_size * sizeof(pixel) );
+    }
+    /* MB-tree propagation needs the stride, normally set by x264_macroblock_cache_allocate */
+    h->mb.i_mb_stride = h->mb.i_mb_width;
+    for( int i = 0; i < 2; i++ )
+    {
+        h->propagate_accum[i] = NULL;
+        if( h->param.rc.b_mb_tree )
+            CHECKED_MALLOC( h->propagate_accum[i], h->mb.i_mb_count * sizeof(uint16_t) );
+    }
+    return 0;
+fail:
+    return -1;
+}
+
+void x264_macroblock_lookahead_thread_free( x264_t *h )
+{
+    x264_macroblock_thread_free( h, 1 );
+    x264_free( h->mb.p_weight_buf[0] );
+    x264_free( h->propagate_accum[0] );
+    x264_free( h->propagate_accum[1] );
+}
+
 void x264_macroblock_slice_init( x264_t *h )
 {
     h->mb.mv[0] = h->fdec->mv[0];
@@ -503,6 +558,12 @@ void x264_macroblock_slice_init( x264_t *h )
 void x264_macroblock_thread_init( x264_t *h )
 {
     h->mb.i_me_method = h->param.analyse.i_me_method;
+    h->mb.i_me_range = h->param.analyse.i_me_range;
+    /* The lookahead mvs of the nearest references are candidates for every reference,
+     * so a small search around the best predictor can follow large motion. */
+    if( h->param.analyse.i_me_guide_range && h->sh.i_type != SLICE_TYPE_I && x264_mb_lowres_mvs( h, 0, 0 ) &&
+        (h->sh.i_type != SLICE_TYPE_B || x264_mb_lowres_mvs( h, 1, 0 )) )
+        h->mb.i_me_range = h->param.analyse.i_me_guide_range;
     h->mb.i_subpel_refine = h->param.analyse.i_subpel_refine;
     if( h->sh.i_type == SLICE_TYPE_B && (h->mb.i_subpel_refine == 6 || h->mb.i_subpel_refine == 8) )
         h->mb.i_subpel_refine--;
@@ -305,6 +305,8 @@ void x264_macroblock_cache_free( x264_t *h );
 /* Per-thread allocation: is allocated per-thread even in sliced-threads mode. */
 int  x264_macroblock_thread_allocate( x264_t *h, int b_lookahead );
 void x264_macroblock_thread_free( x264_t *h, int b_lookahead );
+int  x264_macroblock_lookahead_thread_allocate( x264_t *h );
+void x264_macroblock_lookahead_thread_free( x264_t *h );
 
 void x264_macroblock_slice_init( x264_t *h );
 void x264_macroblock_thread_init( x264_t *h );
@@ -343,6 +345,10 @@ void x264_mb_predict_mv( x264_t *h, int i_list, int idx, int i_width, int16_t mv
  *      if b_changed != NULL, set it to whether refs or mvs differ from
  *      before this functioncall. */
 int x264_mb_predict_mv_direct16x16( x264_t *h, int *b_changed );
+/* x264_mb_lowres_mvs:
+ *      return the lookahead's lowres mvs from the current frame to a reference,
+ *      or NULL if the lookahead didn't search that pair of frames. */
+int16_t (*x264_mb_lowres_mvs( x264_t *h, int i_list, int i_ref ))[2];
 /* x264_mb_predict_mv_ref16x16:
  *      set mvc with D_16x16 prediction.
  *      uses all neighbors, even those that didn't end up using this ref.
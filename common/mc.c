@@ -596,6 +596,17 @@ void x264_frame_init_lowres( x264_t *h, x264_frame_t *frame )
                                   i_stride, frame->i_stride_lowres, frame->i_width_lowres, frame->i_lines_lowres );
     x264_frame_expand_border_lowres( h, frame );
 
+    /* Each coarser level is downscaled from the previous one, whose border has been expanded
+     * to cover the rounding of the coarse planes up to whole blocks. */
+    for( int i = 0; i < h->frames.i_lowres_level; i++ )
+    {
+        pixel *src0 = i ? frame->coarse[i-1][0] : frame->lowres[0];
+        int src_stride = i ? frame->i_stride_coarse[i-1] : frame->i_stride_lowres;
+        h->mc.frame_init_lowres_core( src0, frame->coarse[i][0], frame->coarse[i][1], frame->coarse[i][2], frame->coarse[i][3],
+                                      src_stride, frame->i_stride_coarse[i], frame->i_width_coarse[i], frame->i_lines_coarse[i] );
+        x264_frame_expand_border_coarse( h, frame, i );
+    }
+
     memset( frame->i_cost_est, -1, sizeof(frame->i_cost_est) );
 
     for( int y = 0; y < h->param.i_bframe + 2; y++ )
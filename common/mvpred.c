@@ -533,6 +533,19 @@ int x264_mb_predict_mv_direct16x16( x264_t *h, int *b_changed )
     return b_available;
 }
 
+int16_t (*x264_mb_lowres_mvs( x264_t *h, int i_list, int i_ref ))[2]
+{
+    if( !h->frames.b_have_lowres )
+        return NULL;
+    x264_frame_t *ref = h->fref[i_list][i_ref];
+    int idx = i_list ? ref->i_frame - h->fenc->i_frame - 1
+                     : h->fenc->i_frame - ref->i_frame - 1;
+    if( idx < 0 || idx > h->param.i_bframe )
+        return NULL;
+    int16_t (*lowres_mv)[2] = h->fenc->lowres_mvs[i_list][idx];
+    return lowres_mv[0][0] != 0x7fff ? lowres_mv : NULL;
+}
+
 /* This just improves encoder performance, it's not part of the spec */
 void x264_mb_predict_mv_ref16x16( x264_t *h, int i_list, int i_ref, int16_t mvc[9][2], int *i_mvc )
 {
@@ -562,18 +575,22 @@ void x264_mb_predict_mv_ref16x16( x264_t *h, int i_list, int i_ref, int16_t mvc[
         SET_MVP( h->mb.cache.mv[i_list][x264_scan8[12]] );
     }
 
-    if( i_ref == 0 && h->frames.b_have_lowres )
+    if( i_ref == 0 || (h->param.analyse.i_me_guide_range && !PLANE_MBAFF) )
     {
-        int idx = i_list ? h->fref[1][0]->i_frame-h->fenc->i_frame-1
-                         : h->fenc->i_frame-h->fref[0][0]->i_frame-1;
-        if( idx <= h->param.i_bframe )
+        int16_t (*lowres_mv)[2] = x264_mb_lowres_mvs( h, i_list, i_ref );
+        if( lowres_mv )
         {
-            int16_t (*lowres_mv)[2] = h->fenc->lowres_mvs[i_list][idx];
-            if( lowres_mv[0][0] != 0x7fff )
-            {
-                M32( mvc[i] ) = (M32( lowres_mv[h->mb.i_mb_xy] )*2)&0xfffeffff;
-                i++;
-            }
+            M32( mvc[i] ) = (M32( lowres_mv[h->mb.i_mb_xy] )*2)&0xfffeffff;
+            i++;
+        }
+        else if( i_ref && (lowres_mv = x264_mb_lowres_mvs( h, i_list, 0 )) )
+        {
+            /* The lookahead didn't search this reference: scale the mv of the nearest one. */
+            int dist  = abs( h->fref[i_list][i_ref]->i_frame - h->fenc->i_frame );
+            int dist0 = abs( h->fref[i_list][0]->i_frame - h->fenc->i_frame );
+            mvc[i][0] = lowres_mv[h->mb.i_mb_xy][0] * dist / dist0 * 2;
+            mvc[i][1] = lowres_mv[h->mb.i_mb_xy][1] * dist / dist0 * 2;
+            i++;
         }
     }
 
@@ -58,6 +58,24 @@ int64_t x264_mdate( void )
 #endif
 }
 
+int64_t x264_nanotime( void )
+{
+#if HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif SYS_WINDOWS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if( !freq.QuadPart )
+        QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &count );
+    return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    return x264_mdate() * 1000;
+#endif
+}
+
 #if HAVE_WIN32THREAD || PTW32_STATIC_LIB
 /* state of the threading library being initialized */
 static volatile LONG x264_threading_is_init = 0;
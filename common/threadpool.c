@@ -116,9 +116,11 @@ void x264_threadpool_run( x264_threadpool_t *pool, void *(*func)(void *), void *
     x264_sync_frame_list_push( &pool->run, (void*)job );
 }
 
-void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg )
+/* If time is non-NULL, the time spent blocked is added to it. */
+void *x264_threadpool_wait_timed( x264_threadpool_t *pool, void *arg, int64_t *time )
 {
     x264_threadpool_job_t *job = NULL;
+    int64_t start = 0;
 
     x264_pthread_mutex_lock( &pool->done.mutex );
     while( !job )
@@ -133,15 +135,26 @@ void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg )
             }
         }
         if( !job )
+        {
+            if( time && !start )
+                start = x264_nanotime();
             x264_pthread_cond_wait( &pool->done.cv_fill, &pool->done.mutex );
+        }
     }
     x264_pthread_mutex_unlock( &pool->done.mutex );
+    if( start )
+        *time += x264_nanotime() - start;
 
     void *ret = job->ret;
     x264_sync_frame_list_push( &pool->uninit, (void*)job );
     return ret;
 }
 
+void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg )
+{
+    return x264_threadpool_wait_timed( pool, arg, NULL );
+}
+
 static void x264_threadpool_list_delete( x264_sync_frame_list_t *slist )
 {
     for( int i = 0; slist->list[i]; i++ )
@@ -33,11 +33,13 @@ int   x264_threadpool_init( x264_threadpool_t **p_pool, int threads,
                             void (*init_func)(void *), void *init_arg );
 void  x264_threadpool_run( x264_threadpool_t *pool, void *(*func)(void *), void *arg );
 void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg );
+void *x264_threadpool_wait_timed( x264_threadpool_t *pool, void *arg, int64_t *time );
 void  x264_threadpool_delete( x264_threadpool_t *pool );
 #else
 #define x264_threadpool_init(p,t,f,a) -1
 #define x264_threadpool_run(p,f,a)
 #define x264_threadpool_wait(p,a)     NULL
+#define x264_threadpool_wait_timed(p,a,t) NULL
 #define x264_threadpool_delete(p)
 #endif
 
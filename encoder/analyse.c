@@ -572,7 +572,7 @@ static void x264_mb_analyse_init( x264_t *h, x264_mb_analysis_t *a, int qp )
                 for( int i = (h->sh.i_type == SLICE_TYPE_B); i >= 0; i-- )
                     for( int j = 0; j < h->i_ref[i]; j++ )
                     {
-                        x264_frame_cond_wait( h->fref[i][j]->orig, thresh );
+                        x264_wait_account( h, X264_WAIT_REFERENCE, x264_frame_cond_wait( h->fref[i][j]->orig, thresh ) );
                         thread_mvy_range = X264_MIN( thread_mvy_range, h->fref[i][j]->orig->i_lines_completed - pix_y );
                     }
 
@@ -2472,6 +2472,8 @@ static void x264_mb_analyse_inter_b16x8_mpeg2( x264_t *h, x264_mb_analysis_t *a
                     + REF_COST( 1, a->l1.me16x8[0].i_ref ) + REF_COST( 0, a->l1.me16x8[1].i_ref );
     for( int idx_16x8 = 0; idx_16x8 < 2; idx_16x8++ )
     {
+        /* get_ref returns the reference itself, with its stride, for fullpel mvs */
+        stride0 = stride1 = 16;
         src0 = h->mc.get_ref( pix0, &stride0,
                               h->mb.pic.p_fref[0][a->l0.me16x8[idx_16x8].i_ref], h->mb.pic.i_stride[0],
                               a->l0.me16x8[idx_16x8].mv[0], a->l0.me16x8[idx_16x8].mv[1], 16, 8, x264_weight_none );
@@ -39,6 +39,7 @@ void x264_slicetype_analyse( x264_t *h, int intra_minigop );
 int x264_weighted_reference_duplicate( x264_t *h, int i_ref, const x264_weight_t *w );
 
 int  x264_lookahead_init( x264_t *h, int i_slicetype_length );
+int  x264_lookahead_reset( x264_t *h );
 int  x264_lookahead_is_empty( x264_t *h );
 void x264_lookahead_put_frame( x264_t *h, x264_frame_t *frame );
 void x264_lookahead_get_frames( x264_t *h );
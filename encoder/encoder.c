@@ -37,6 +37,11 @@
 
 #define bs_write_ue bs_write_ue_big
 
+/* MPEG-2 has no emulation prevention, so start codes are written straight into the bitstream
+ * and the NAL units are returned from there without a copy.  This needs every NAL unit of the
+ * frame to be in one bitstream (not sliced threads), and nalu_process expects them without. */
+#define STARTCODE_INPLACE (MPEG2 && !h->param.b_sliced_threads && !h->param.nalu_process)
+
 static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
                                    x264_nal_t **pp_nal, int *pi_nal,
                                    x264_picture_t *pic_out );
@@ -69,8 +74,11 @@ static int x264_threadpool_wait_all( x264_t *h )
     for( int i = 0; i < h->param.i_threads; i++ )
         if( h->thread[i]->b_thread_active )
         {
+            int64_t time = 0;
             h->thread[i]->b_thread_active = 0;
-            if( (intptr_t)x264_threadpool_wait( h->threadpool, h->thread[i] ) < 0 )
+            intptr_t ret = (intptr_t)x264_threadpool_wait_timed( h->threadpool, h->thread[i], &time );
+            x264_wait_account( h, X264_WAIT_FRAME, time );
+            if( ret < 0 )
                 return -1;
         }
     return 0;
@@ -399,7 +407,8 @@ static int x264_bitstream_check_buffer( x264_t *h )
 static int x264_bitstream_check_buffer_filler( x264_t *h, int filler )
 {
     filler += 32; // add padding for safety
-    return x264_bitstream_check_buffer_internal( h, filler, 0, -1 );
+    /* In-place NAL units still point into the bitstream. */
+    return x264_bitstream_check_buffer_internal( h, filler, 0, STARTCODE_INPLACE ? h->out.i_nal-1 : -1 );
 }
 
 #if HAVE_THREAD
@@ -408,6 +417,11 @@ static void x264_encoder_thread_init( x264_t *h )
     if( h->param.i_sync_lookahead )
         x264_lower_thread_priority( 10 );
 }
+
+static void x264_metrics_thread_init( x264_t *h )
+{
+    x264_lower_thread_priority( 10 );
+}
 #endif
 
 /****************************************************************************
@@ -594,6 +608,15 @@ static int x264_validate_parameters( x264_t *h, int b_open )
     h->i_thread_frames = h->param.b_sliced_threads ? 1 : h->param.i_threads;
     if( h->i_thread_frames > 1 )
         h->param.nalu_process = NULL;
+#if !HAVE_THREAD
+    if( h->param.b_row_input )
+    {
+        x264_log( h, X264_LOG_WARNING, "row input requires thread support, pictures must be complete\n" );
+        h->param.b_row_input = 0;
+    }
+#endif
+    if( h->param.nalu_process )
+        h->param.b_single_nal = 0;
 
     if( h->param.b_opencl )
     {
@@ -936,6 +959,17 @@ static int x264_validate_parameters( x264_t *h, int b_open )
         x264_log( h, X264_LOG_WARNING, "VBV maxrate specified, but no bufsize, ignored\n" );
         h->param.rc.i_vbv_max_bitrate = 0;
     }
+    if( h->param.rc.b_vbv_rows && !h->param.rc.i_vbv_buffer_size )
+    {
+        x264_log( h, X264_LOG_WARNING, "vbv-rows requires VBV, ignored\n" );
+        h->param.rc.b_vbv_rows = 0;
+    }
+    /* The rows of a frame can only be paced once the previous frame is finished */
+    if( h->param.rc.b_vbv_rows && h->i_thread_frames > 1 )
+    {
+        x264_log( h, X264_LOG_WARNING, "vbv-rows is not supported with frame threads, ignored\n" );
+        h->param.rc.b_vbv_rows = 0;
+    }
 
     h->param.i_slice_max_size = X264_MAX( h->param.i_slice_max_size, 0 );
     h->param.i_slice_max_mbs = X264_MAX( h->param.i_slice_max_mbs, 0 );
@@ -1041,6 +1075,24 @@ static int x264_validate_parameters( x264_t *h, int b_open )
         float bufsize = maxrate ? (float)h->param.rc.i_vbv_buffer_size / maxrate : 0;
         h->param.rc.i_lookahead = X264_MIN( h->param.rc.i_lookahead, X264_MAX( h->param.i_keyint_max, bufsize*fps ) );
     }
+    if( !h->param.rc.i_lookahead_downscale )
+    {
+        /* Analyse no more than a 1080p source does at half resolution. */
+        int64_t pixels = (int64_t)h->param.i_width * h->param.i_height;
+        h->param.rc.i_lookahead_downscale = 2;
+        while( h->param.rc.i_lookahead_downscale < 8 &&
+               pixels > (int64_t)1920*1088/4 * h->param.rc.i_lookahead_downscale * h->param.rc.i_lookahead_downscale )
+            h->param.rc.i_lookahead_downscale <<= 1;
+    }
+    else if( h->param.rc.i_lookahead_downscale >= 8 )
+        h->param.rc.i_lookahead_downscale = 8;
+    else
+        h->param.rc.i_lookahead_downscale = h->param.rc.i_lookahead_downscale >= 4 ? 4 : 2;
+    if( h->param.b_opencl && h->param.rc.i_lookahead_downscale > 2 )
+    {
+        x264_log( h, X264_LOG_WARNING, "OpenCL lookahead only analyses at half resolution, ignoring lookahead-downscale\n" );
+        h->param.rc.i_lookahead_downscale = 2;
+    }
 
     if( !h->param.i_timebase_num || !h->param.i_timebase_den || !(h->param.b_vfr_input || h->param.b_pulldown) )
     {
@@ -1085,6 +1137,10 @@ static int x264_validate_parameters( x264_t *h, int b_open )
     h->param.analyse.i_me_range = x264_clip3( h->param.analyse.i_me_range, 4, 1024 );
     if( h->param.analyse.i_me_range > 16 && h->param.analyse.i_me_method <= X264_ME_HEX )
         h->param.analyse.i_me_range = 16;
+    if( h->param.analyse.i_me_guide_range > 0 )
+        h->param.analyse.i_me_guide_range = x264_clip3( h->param.analyse.i_me_guide_range, 4, h->param.analyse.i_me_range );
+    else
+        h->param.analyse.i_me_guide_range = 0;
     if( h->param.analyse.i_me_method == X264_ME_TESA &&
         (h->mb.b_lossless || h->param.analyse.i_subpel_refine <= 1) )
         h->param.analyse.i_me_method = X264_ME_ESA;
@@ -1110,6 +1166,9 @@ static int x264_validate_parameters( x264_t *h, int b_open )
         h->param.analyse.b_psnr = 0;
         h->param.analyse.b_ssim = 0;
     }
+    /* The maps are only handed out through the frame_stats callback. */
+    if( !h->param.frame_stats || !(h->param.analyse.b_psnr || h->param.analyse.b_ssim) )
+        h->param.analyse.b_metric_maps = 0;
     /* Warn users trying to measure PSNR/SSIM with psy opts on. */
     if( b_open && (h->param.analyse.b_psnr || h->param.analyse.b_ssim) )
     {
@@ -1361,6 +1420,7 @@ static int x264_validate_parameters( x264_t *h, int b_open )
     BOOLIFY( b_aud );
     BOOLIFY( b_repeat_headers );
     BOOLIFY( b_annexb );
+    BOOLIFY( b_single_nal );
     BOOLIFY( b_vfr_input );
     BOOLIFY( b_pulldown );
     BOOLIFY( b_tff );
@@ -1373,6 +1433,7 @@ static int x264_validate_parameters( x264_t *h, int b_open )
     BOOLIFY( b_alternate_scan );
     BOOLIFY( b_stitchable );
     BOOLIFY( b_full_recon );
+    BOOLIFY( b_row_input );
     BOOLIFY( b_opencl );
     BOOLIFY( analyse.b_transform_8x8 );
     BOOLIFY( analyse.b_weighted_bipred );
@@ -1383,10 +1444,12 @@ static int x264_validate_parameters( x264_t *h, int b_open )
     BOOLIFY( analyse.b_psy );
     BOOLIFY( analyse.b_psnr );
     BOOLIFY( analyse.b_ssim );
+    BOOLIFY( analyse.b_metric_maps );
     BOOLIFY( rc.b_stat_write );
     BOOLIFY( rc.b_stat_read );
     BOOLIFY( rc.b_mb_tree );
     BOOLIFY( rc.b_filler );
+    BOOLIFY( rc.b_vbv_rows );
 #undef BOOLIFY
 
     return 0;
@@ -1633,6 +1696,8 @@ x264_t *x264_encoder_open( x264_param_t *param )
           || h->param.rc.b_mb_tree
           || h->param.analyse.i_weighted_pred );
     h->frames.b_have_lowres |= h->param.rc.b_stat_read && h->param.rc.i_vbv_buffer_size > 0;
+    for( int i = h->param.rc.i_lookahead_downscale; i > 2; i >>= 1 )
+        h->frames.i_lowres_level++;
     h->frames.b_have_sub8x8_esa = !!(h->param.analyse.inter & X264_ANALYSE_PSUB8x8);
 
     h->frames.i_last_idr =
@@ -1749,12 +1814,33 @@ x264_t *x264_encoder_open( x264_param_t *param )
 
     CHECKED_MALLOC( h->reconfig_h, sizeof(x264_t) );
 
+    if( h->param.b_row_input )
+    {
+        CHECKED_MALLOCZERO( h->row_input, sizeof(x264_row_input_t) );
+        if( x264_pthread_mutex_init( &h->row_input->mutex, NULL ) ||
+            x264_pthread_cond_init( &h->row_input->cv, NULL ) )
+            goto fail;
+        /* A delayed picture is encoded by a later x264_encoder_encode, so it has to be read completely
+         * before this one returns, as does one that is analysed as a whole before it is encoded. */
+        h->row_input->b_whole_picture = h->frames.i_delay || h->frames.b_have_lowres
+                                     || (h->param.rc.i_aq_mode == X264_AQ_AUTOVARIANCE && h->param.rc.f_aq_strength != 0);
+        h->row_input->b_row_aq = !h->row_input->b_whole_picture && h->param.rc.i_aq_mode == X264_AQ_VARIANCE
+                              && h->param.rc.f_aq_strength != 0 && !(h->param.rc.b_mb_tree && h->param.rc.b_stat_read);
+        if( h->row_input->b_whole_picture )
+            x264_log( h, X264_LOG_WARNING, "row input: the settings need whole pictures, encoding won't start early\n" );
+    }
+
     if( h->param.i_threads > 1 &&
         x264_threadpool_init( &h->threadpool, h->param.i_threads, (void*)x264_encoder_thread_init, h ) )
         goto fail;
     if( h->param.i_lookahead_threads > 1 &&
         x264_threadpool_init( &h->lookaheadpool, h->param.i_lookahead_threads, NULL, NULL ) )
         goto fail;
+    /* With frame threads, measuring quality on the frame thread would delay the row broadcasts
+     * other frames wait on, so each frame gets a low priority job that follows its rows instead. */
+    if( h->i_thread_frames > 1 && (h->param.analyse.b_psnr || h->param.analyse.b_ssim) &&
+        x264_threadpool_init( &h->metricpool, h->i_thread_frames, (void*)x264_metrics_thread_init, h ) )
+        goto fail;
 
 #if HAVE_OPENCL
     if( h->param.b_opencl )
@@ -1776,6 +1862,8 @@ x264_t *x264_encoder_open( x264_param_t *param )
         {
             CHECKED_MALLOC( h->lookahead_thread[i], sizeof(x264_t) );
             *h->lookahead_thread[i] = *h;
+            /* workers run on the pool, they never dispatch to it */
+            h->lookahead_thread[i]->lookaheadpool = NULL;
         }
     *h->reconfig_h = *h;
 
@@ -1821,6 +1909,11 @@ x264_t *x264_encoder_open( x264_param_t *param )
         if( x264_macroblock_thread_allocate( h->thread[i], 0 ) < 0 )
             goto fail;
 
+    if( h->param.i_lookahead_threads > 1 && h->frames.b_have_lowres )
+        for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+            if( x264_macroblock_lookahead_thread_allocate( h->lookahead_thread[i] ) < 0 )
+                goto fail;
+
     if( x264_ratecontrol_new( h ) < 0 )
         goto fail;
 
@@ -1915,6 +2008,8 @@ static int x264_encoder_try_reconfig( x264_t *h, x264_param_t *param, int *rc_re
     /* Scratch buffer prevents me_range from being increased for esa/tesa */
     if( h->param.analyse.i_me_method < X264_ME_ESA || param->analyse.i_me_range < h->param.analyse.i_me_range )
         COPY( analyse.i_me_range );
+    if( param->analyse.i_me_guide_range <= h->param.analyse.i_me_range )
+        COPY( analyse.i_me_guide_range );
     COPY( analyse.i_noise_reduction );
     /* We can't switch out of subme=0 during encoding. */
     if( h->param.analyse.i_subpel_refine )
@@ -2019,6 +2114,13 @@ static void x264_nal_start( x264_t *h, int i_type, int i_ref_idc )
     nal->i_type           = i_type;
     nal->b_long_startcode = 1;
 
+    /* The start code stays out of the payload until encapsulation, like the H.264 NAL header. */
+    if( STARTCODE_INPLACE )
+    {
+        bs_write32( &h->out.bs, 0x100 | MPEG2_START_CODE( i_type ) );
+        bs_flush( &h->out.bs );
+    }
+
     nal->i_payload= 0;
     nal->p_payload= &h->out.p_bitstream[bs_pos( &h->out.bs ) / 8];
     nal->i_padding= 0;
@@ -2091,6 +2193,18 @@ static int x264_encoder_encapsulate_nals( x264_t *h, int start )
         return nal_size;
     }
 
+    /* Each start code is already in front of its payload, and the payloads follow each other. */
+    if( STARTCODE_INPLACE )
+    {
+        for( int i = start; i < h->out.i_nal; i++ )
+        {
+            h->out.nal[i].p_payload -= STRUCTURE_OVERHEAD;
+            h->out.nal[i].i_payload += STRUCTURE_OVERHEAD;
+            nal_size += h->out.nal[i].i_payload;
+        }
+        return nal_size;
+    }
+
     for( int i = 0; i < start; i++ )
         previous_nal_size += h->out.nal[i].i_payload;
 
@@ -2131,6 +2245,19 @@ static int x264_encoder_encapsulate_nals( x264_t *h, int start )
     return nal_buffer - (h0->nal_buffer + previous_nal_size);
 }
 
+/* Describe the encapsulated NAL units, which are sequential in memory, with the first one. */
+static void x264_encoder_single_nal( x264_t *h )
+{
+    x264_nal_t *nal = h->out.nal;
+    for( int i = 1; i < h->out.i_nal; i++ )
+    {
+        nal[0].i_payload += nal[i].i_payload;
+        nal[0].i_padding += nal[i].i_padding;
+    }
+    nal[0].i_last_mb = nal[h->out.i_nal-1].i_last_mb;
+    h->out.i_nal = 1;
+}
+
 /****************************************************************************
  * x264_encoder_headers:
  ****************************************************************************/
@@ -2176,6 +2303,8 @@ int x264_encoder_headers( x264_t *h, x264_nal_t **pp_nal, int *pi_nal )
     frame_size = x264_encoder_encapsulate_nals( h, 0 );
     if( frame_size < 0 )
         return -1;
+    if( h->param.b_single_nal )
+        x264_encoder_single_nal( h );
 
     /* now set output*/
     *pi_nal = h->out.i_nal;
@@ -2445,6 +2574,150 @@ static inline void x264_reference_build_list( x264_t *h, int i_poc )
     h->mb.pic.i_fref[1] = h->i_ref[1];
 }
 
+/* Measure the rows finished by x264_fdec_filter_row( h, mb_y ): mb rows [min_y,mb_y), less
+ * the pixels that deblocking the next row can still change. */
+static void x264_metrics_rows( x264_t *h, int min_y, int mb_y, int b_start, int b_end,
+                               int64_t ssd[3], double ssim[3], int ssim_cnt[3] )
+{
+    x264_frame_t *fdec = h->fdec;
+    x264_frame_t *fenc = h->fenc;
+    int minpix_y = min_y*16 - 4 * !b_start;
+    int maxpix_y = X264_MIN( mb_y*16 - 4 * !b_end, h->param.i_height );
+    if( h->param.analyse.b_psnr )
+    {
+        for( int p = 0; p < (CHROMA444 ? 3 : 1); p++ )
+            ssd[p] += x264_pixel_ssd_wxh( &h->pixf,
+                fdec->plane[p] + minpix_y * fdec->i_stride[p], fdec->i_stride[p],
+                fenc->plane[p] + minpix_y * fenc->i_stride[p], fenc->i_stride[p],
+                h->param.i_width, maxpix_y-minpix_y );
+        if( !CHROMA444 )
+        {
+            uint64_t ssd_u, ssd_v;
+            int v_shift = CHROMA_V_SHIFT;
+            x264_pixel_ssd_nv12( &h->pixf,
+                fdec->plane[1] + (minpix_y>>v_shift) * fdec->i_stride[1], fdec->i_stride[1],
+                fenc->plane[1] + (minpix_y>>v_shift) * fenc->i_stride[1], fenc->i_stride[1],
+                h->param.i_width>>1, (maxpix_y-minpix_y)>>v_shift, &ssd_u, &ssd_v );
+            ssd[1] += ssd_u;
+            ssd[2] += ssd_v;
+        }
+    }
+
+    if( h->param.analyse.b_ssim )
+    {
+        int cnt;
+        x264_emms();
+        /* offset by 2 pixels to avoid alignment of ssim blocks with dct blocks,
+         * and overlap by 4 */
+        int y = minpix_y + (b_start ? 2 : -6);
+        ssim[0] += x264_pixel_ssim_wxh( &h->pixf,
+                       fdec->plane[0] + 2+y*fdec->i_stride[0], fdec->i_stride[0],
+                       fenc->plane[0] + 2+y*fenc->i_stride[0], fenc->i_stride[0],
+                       h->param.i_width-2, maxpix_y-y, h->metrics.buf_ssim, &cnt );
+        ssim_cnt[0] += cnt;
+
+        /* Chroma keeps the same 4-row grid of windows: start with the first window
+         * the previous chunk didn't have the rows for. */
+        int v_shift = CHROMA_V_SHIFT;
+        int width = h->param.i_width >> CHROMA_H_SHIFT;
+        int cmin = b_start ? (minpix_y>>v_shift) + 2 : ((((minpix_y>>v_shift) - 6) & ~3) + 2);
+        int cmax = maxpix_y >> v_shift;
+        pixel *plane[2][2];
+        intptr_t stride[2];
+        if( CHROMA444 )
+            for( int i = 0; i < 2; i++ )
+            {
+                x264_frame_t *frame = i ? fenc : fdec;
+                plane[i][0] = frame->plane[1] + cmin * frame->i_stride[1];
+                plane[i][1] = frame->plane[2] + cmin * frame->i_stride[2];
+                stride[i] = frame->i_stride[1];
+            }
+        else
+        {
+            int cs = h->metrics.i_chroma_stride;
+            for( int i = 0; i < 2; i++ )
+            {
+                x264_frame_t *frame = i ? fenc : fdec;
+                plane[i][0] = h->metrics.buf_chroma + (2*i+0)*48*cs;
+                plane[i][1] = h->metrics.buf_chroma + (2*i+1)*48*cs;
+                stride[i] = cs;
+                h->mc.plane_copy_deinterleave( plane[i][0], cs, plane[i][1], cs,
+                                               frame->plane[1] + cmin * frame->i_stride[1], frame->i_stride[1],
+                                               width, cmax-cmin );
+            }
+        }
+        for( int p = 0; p < 2; p++ )
+        {
+            ssim[p+1] += x264_pixel_ssim_wxh( &h->pixf, plane[0][p] + 2, stride[0], plane[1][p] + 2, stride[1],
+                                              width-2, cmax-cmin, h->metrics.buf_ssim, &cnt );
+            ssim_cnt[p+1] += cnt;
+        }
+    }
+}
+
+/* Per-MB luma psnr, and ssim of the 8x8 windows whose top left pixel lies in the MB,
+ * which together make up the frame's ssim. */
+static void x264_metrics_maps( x264_t *h )
+{
+    x264_frame_t *fdec = h->fdec;
+    x264_frame_t *fenc = h->fenc;
+    x264_emms();
+    for( int mb_y = 0; mb_y < h->mb.i_mb_height; mb_y++ )
+        for( int mb_x = 0; mb_x < h->mb.i_mb_width; mb_x++ )
+        {
+            int mb_xy = mb_x + mb_y * h->mb.i_mb_width;
+            int x = mb_x*16;
+            int y = mb_y*16;
+            if( h->metrics.psnr_map )
+            {
+                int w = X264_MIN( 16, h->param.i_width - x );
+                int ht = X264_MIN( 16, h->param.i_height - y );
+                if( w > 0 && ht > 0 )
+                {
+                    uint64_t ssd = x264_pixel_ssd_wxh( &h->pixf,
+                        fdec->plane[0] + x + y * fdec->i_stride[0], fdec->i_stride[0],
+                        fenc->plane[0] + x + y * fenc->i_stride[0], fenc->i_stride[0], w, ht );
+                    h->metrics.psnr_map[mb_xy] = x264_psnr( ssd, w * ht );
+                }
+                else
+                    h->metrics.psnr_map[mb_xy] = 100;
+            }
+            if( h->metrics.ssim_map )
+            {
+                /* 4 windows per MB in each direction, offset by 2 like the frame's */
+                int w = X264_MIN( 20, h->param.i_width - x - 2 );
+                int ht = X264_MIN( 20, h->param.i_height - y - 2 );
+                if( w >= 8 && ht >= 8 )
+                {
+                    int cnt;
+                    float ssim = x264_pixel_ssim_wxh( &h->pixf,
+                        fdec->plane[0] + x+2 + (y+2) * fdec->i_stride[0], fdec->i_stride[0],
+                        fenc->plane[0] + x+2 + (y+2) * fenc->i_stride[0], fenc->i_stride[0],
+                        w, ht, h->metrics.buf_ssim, &cnt );
+                    h->metrics.ssim_map[mb_xy] = ssim / cnt;
+                }
+                else
+                    h->metrics.ssim_map[mb_xy] = 1;
+            }
+        }
+}
+
+/* metricpool job: measures each row of the frame once the frame thread has broadcast it. */
+static void *x264_metrics_frame( x264_t *h )
+{
+    int step = 1 << SLICE_MBAFF;
+    for( int mb_y = step; mb_y <= h->mb.i_mb_height; mb_y += step )
+    {
+        int b_end = mb_y == h->mb.i_mb_height;
+        x264_frame_cond_wait( h->fdec, mb_y*16 - 4 * !b_end );
+        x264_metrics_rows( h, mb_y - step, mb_y, mb_y == step, b_end,
+                           h->metrics.i_ssd, h->metrics.f_ssim, h->metrics.i_ssim_cnt );
+    }
+    if( h->param.analyse.b_metric_maps )
+        x264_metrics_maps( h );
+    return NULL;
+}
+
 static void x264_fdec_filter_row( x264_t *h, int mb_y, int pass )
 {
     /* mb_y is the mb to be encoded next, not the mb to be filtered here */
@@ -2488,6 +2761,8 @@ static void x264_fdec_filter_row( x264_t *h, int mb_y, int pass )
     if( min_y < h->i_threadslice_start )
         return;
 
+    int64_t stage_start = x264_stage_start( h );
+
     if( b_deblock )
         for( int y = min_y; y < mb_y; y += (1 << SLICE_MBAFF) )
             x264_frame_deblock_row( h, y );
@@ -2522,47 +2797,13 @@ static void x264_fdec_filter_row( x264_t *h, int mb_y, int pass )
             XCHG( pixel *, h->intra_border_backup[1][i], h->intra_border_backup[4][i] );
         }
 
-    if( h->i_thread_frames > 1 && h->fdec->b_kept_as_ref )
+    if( h->i_thread_frames > 1 && (h->fdec->b_kept_as_ref || h->metrics.b_active) )
         x264_frame_cond_broadcast( h->fdec, mb_y*16 + (b_end ? 10000 : -(X264_THREAD_HEIGHT << SLICE_MBAFF)) );
 
-    if( b_measure_quality )
-    {
-        maxpix_y = X264_MIN( maxpix_y, h->param.i_height );
-        if( h->param.analyse.b_psnr )
-        {
-            for( int p = 0; p < (CHROMA444 ? 3 : 1); p++ )
-                h->stat.frame.i_ssd[p] += x264_pixel_ssd_wxh( &h->pixf,
-                    h->fdec->plane[p] + minpix_y * h->fdec->i_stride[p], h->fdec->i_stride[p],
-                    h->fenc->plane[p] + minpix_y * h->fenc->i_stride[p], h->fenc->i_stride[p],
-                    h->param.i_width, maxpix_y-minpix_y );
-            if( !CHROMA444 )
-            {
-                uint64_t ssd_u, ssd_v;
-                int v_shift = CHROMA_V_SHIFT;
-                x264_pixel_ssd_nv12( &h->pixf,
-                    h->fdec->plane[1] + (minpix_y>>v_shift) * h->fdec->i_stride[1], h->fdec->i_stride[1],
-                    h->fenc->plane[1] + (minpix_y>>v_shift) * h->fenc->i_stride[1], h->fenc->i_stride[1],
-                    h->param.i_width>>1, (maxpix_y-minpix_y)>>v_shift, &ssd_u, &ssd_v );
-                h->stat.frame.i_ssd[1] += ssd_u;
-                h->stat.frame.i_ssd[2] += ssd_v;
-            }
-        }
-
-        if( h->param.analyse.b_ssim )
-        {
-            int ssim_cnt;
-            x264_emms();
-            /* offset by 2 pixels to avoid alignment of ssim blocks with dct blocks,
-             * and overlap by 4 */
-            minpix_y += b_start ? 2 : -6;
-            h->stat.frame.f_ssim +=
-                x264_pixel_ssim_wxh( &h->pixf,
-                    h->fdec->plane[0] + 2+minpix_y*h->fdec->i_stride[0], h->fdec->i_stride[0],
-                    h->fenc->plane[0] + 2+minpix_y*h->fenc->i_stride[0], h->fenc->i_stride[0],
-                    h->param.i_width-2, maxpix_y-minpix_y, h->scratch_buffer, &ssim_cnt );
-            h->stat.frame.i_ssim_cnt += ssim_cnt;
-        }
-    }
+    if( b_measure_quality && !h->metrics.b_active )
+        x264_metrics_rows( h, min_y, mb_y, b_start, b_end,
+                           h->stat.frame.i_ssd, h->stat.frame.f_ssim, h->stat.frame.i_ssim_cnt );
+    x264_stage_end( h, X264_STAGE_FILTER, stage_start );
 }
 
 static inline int x264_reference_update( x264_t *h )
@@ -2767,6 +3008,54 @@ static ALWAYS_INLINE void x264_bitstream_restore( x264_t *h, x264_bs_bak_t *bak,
     }
 }
 
+/* Row input: read the picture being passed in frame up to line i_line, waiting for the application
+ * to signal the lines.  Whichever thread needs more lines copies all that are available. */
+static void x264_row_input_read( x264_t *h, x264_frame_t *frame, int i_line )
+{
+    x264_row_input_t *in = h->row_input;
+    x264_pthread_mutex_lock( &in->mutex );
+    while( in->frame == frame && in->i_lines_read < i_line )
+    {
+        int i_lines = in->i_pictures > in->i_picture ? h->param.i_height : in->i_lines & ~15;
+        if( i_lines <= in->i_lines_read )
+        {
+            int64_t wait_start = x264_nanotime();
+            x264_pthread_cond_wait( &in->cv, &in->mutex );
+            x264_wait_account( h, X264_WAIT_INPUT, x264_nanotime() - wait_start );
+            continue;
+        }
+
+        x264_frame_copy_picture_lines( h, frame, &in->pic, in->i_lines_read, i_lines );
+        int b_end = i_lines == h->param.i_height;
+        if( h->param.i_width != 16 * h->mb.i_mb_width || h->param.i_height != 16 * h->mb.i_mb_height )
+            x264_frame_expand_border_mod16( h, frame, in->i_lines_read, i_lines );
+        if( in->b_row_aq )
+        {
+            /* Interlaced AQ measures macroblock pairs */
+            int mb_y_start = (in->i_lines_read >> 4) & ~PARAM_INTERLACED;
+            int mb_y_end = b_end ? h->mb.i_mb_height : (i_lines >> 4) & ~PARAM_INTERLACED;
+            x264_adaptive_quant_rows( h, frame, in->pic.prop.quant_offsets, mb_y_start, mb_y_end );
+        }
+        in->i_lines_read = i_lines;
+        if( b_end )
+        {
+            if( in->b_row_aq && in->pic.prop.quant_offsets_free )
+                in->pic.prop.quant_offsets_free( in->pic.prop.quant_offsets );
+            in->frame = NULL;
+            in->i_picture++;
+        }
+        x264_pthread_cond_broadcast( &in->cv );
+    }
+    x264_pthread_mutex_unlock( &in->mutex );
+}
+
+/* Row input: wait for the lines of the macroblock row (or pair) before encoding it. */
+static ALWAYS_INLINE void x264_row_input_mb_row( x264_t *h, int mb_y )
+{
+    if( h->row_input && !h->row_input->b_whole_picture )
+        x264_row_input_read( h, h->fenc, X264_MIN( ((mb_y | PARAM_INTERLACED) + 1) * 16, h->param.i_height ) );
+}
+
 static intptr_t x264_slice_write( x264_t *h )
 {
     int i_skip;
@@ -2785,6 +3074,7 @@ static intptr_t x264_slice_write( x264_t *h )
     int orig_last_mb = h->sh.i_last_mb;
     int thread_last_mb = h->i_threadslice_end * h->mb.i_mb_width - 1;
     uint8_t *last_emu_check;
+    int64_t stage_start;
 #define BS_BAK_SLICE_MAX_SIZE 0
 #define BS_BAK_CAVLC_OVERFLOW 1
 #define BS_BAK_SLICE_MIN_MBS  2
@@ -2802,6 +3092,7 @@ static intptr_t x264_slice_write( x264_t *h )
     x264_macroblock_thread_init( h );
 
     /* Set the QP equal to the first QP in the slice for more accurate CABAC initialization. */
+    x264_row_input_mb_row( h, h->sh.i_first_mb / h->mb.i_mb_width );
     h->mb.i_mb_xy = h->sh.i_first_mb;
     h->sh.i_qp = x264_ratecontrol_mb_qp( h );
     h->sh.i_qp = SPEC_QP( h->sh.i_qp );
@@ -2836,6 +3127,7 @@ static intptr_t x264_slice_write( x264_t *h )
 
         if( i_mb_x == 0 )
         {
+            x264_row_input_mb_row( h, i_mb_y );
             if( x264_bitstream_check_buffer( h ) )
                 return -1;
             if( !(i_mb_y & SLICE_MBAFF) && h->param.rc.i_vbv_buffer_size )
@@ -2893,18 +3185,25 @@ static intptr_t x264_slice_write( x264_t *h )
         else
             x264_macroblock_cache_load_progressive( h, i_mb_x, i_mb_y );
 
+        stage_start = x264_stage_start( h );
         x264_macroblock_analyse( h );
+        x264_stage_end( h, X264_STAGE_ANALYSE, stage_start );
 
         if( MPEG2 && i_mb_x == 0 )
         {
             x264_nal_start( h, (i_mb_y % 175) + 1, h->i_nal_ref_idc );
+            if( STARTCODE_INPLACE )
+                mb_spos += STRUCTURE_OVERHEAD * 8;
             x264_slice_header_write_mpeg2( h, &h->out.bs, i_mb_y );
         }
 
         /* encode this macroblock -> be careful it can change the mb type to P_SKIP if needed */
 reencode:
+        stage_start = x264_stage_start( h );
         x264_macroblock_encode( h );
+        x264_stage_end( h, X264_STAGE_ENCODE, stage_start );
 
+        stage_start = x264_stage_start( h );
         if( h->param.b_cabac )
         {
             if( mb_xy > h->sh.i_first_mb && !(SLICE_MBAFF && (i_mb_y&1)) )
@@ -2966,6 +3265,7 @@ reencode:
                 }
             }
         }
+        x264_stage_end( h, X264_STAGE_ENTROPY, stage_start );
 
         int total_bits = bs_pos(&h->out.bs) + x264_cabac_pos(&h->cabac);
         int mb_size = total_bits - mb_spos;
@@ -3035,7 +3335,10 @@ cont:
         /* save cache */
         x264_macroblock_cache_save( h );
 
-        if( x264_ratecontrol_mb( h, mb_size ) < 0 )
+        stage_start = x264_stage_start( h );
+        int rc_status = x264_ratecontrol_mb( h, mb_size );
+        x264_stage_end( h, X264_STAGE_RATECONTROL, stage_start );
+        if( rc_status < 0 )
         {
             x264_bitstream_restore( h, &bs_bak[BS_BAK_ROW_VBV], &i_skip, 1 );
             h->mb.b_reencode_mb = 1;
@@ -3183,6 +3486,8 @@ cont:
                                   + (h->out.i_nal*NALU_OVERHEAD * 8)
                                   - h->stat.frame.i_tex_bits
                                   - h->stat.frame.i_mv_bits;
+        if( STARTCODE_INPLACE )
+            h->stat.frame.i_misc_bits -= h->out.i_nal*STRUCTURE_OVERHEAD * 8;
         x264_fdec_filter_row( h, h->i_threadslice_end, 0 );
 
         if( h->param.b_sliced_threads )
@@ -3196,7 +3501,7 @@ cont:
             /* Do the first row of hpel, now that the previous slice is done */
             if( h->i_thread_idx > 0 )
             {
-                x264_threadslice_cond_wait( h->thread[h->i_thread_idx-1], 2 );
+                x264_wait_account( h, X264_WAIT_SLICE, x264_threadslice_cond_wait( h->thread[h->i_thread_idx-1], 2 ) );
                 x264_fdec_filter_row( h, h->i_threadslice_start + (1 << SLICE_MBAFF), 2 );
             }
         }
@@ -3245,6 +3550,9 @@ static void *x264_slices_write( x264_t *h )
 {
     int i_slice_num = 0;
     int last_thread_mb = h->sh.i_last_mb;
+    intptr_t ret = 0;
+    int64_t busy_start = x264_nanotime();
+    int64_t wait_start = h->wait_stats[X264_WAIT_REFERENCE].i_time + h->wait_stats[X264_WAIT_SLICE].i_time;
 
     /* init stats */
     memset( &h->stat.frame, 0, sizeof(h->stat.frame) );
@@ -3291,13 +3599,19 @@ static void *x264_slices_write( x264_t *h )
             h->sh.i_first_mb -= h->mb.i_mb_stride;
     }
 
-    return (void *)0;
+end:
+    h->i_busy_time += x264_nanotime() - busy_start + wait_start
+                    - h->wait_stats[X264_WAIT_REFERENCE].i_time - h->wait_stats[X264_WAIT_SLICE].i_time;
+    return (void *)ret;
 
 fail:
     /* Tell other threads we're done, so they wouldn't wait for it */
     if( h->param.b_sliced_threads )
         x264_threadslice_cond_broadcast( h, 2 );
-    return (void *)-1;
+    else if( h->metrics.b_active )
+        x264_frame_cond_broadcast( h->fdec, 10000 );
+    ret = -1;
+    goto end;
 }
 
 static int x264_threaded_slices_write( x264_t *h )
@@ -3334,7 +3648,7 @@ static int x264_threaded_slices_write( x264_t *h )
         x264_threadpool_run( h->threadpool, (void*)x264_slices_write, h->thread[i] );
     /* wait */
     for( int i = 0; i < h->param.i_threads; i++ )
-        x264_threadslice_cond_wait( h->thread[i], 1 );
+        x264_wait_account( h, X264_WAIT_FRAME, x264_threadslice_cond_wait( h->thread[i], 1 ) );
 
     x264_threads_merge_ratecontrol( h );
 
@@ -3351,9 +3665,11 @@ static int x264_threaded_slices_write( x264_t *h )
         for( int j = 0; j < (offsetof(x264_t,stat.frame.i_ssd) - offsetof(x264_t,stat.frame.i_mv_bits)) / sizeof(int); j++ )
             ((int*)&h->stat.frame)[j] += ((int*)&t->stat.frame)[j];
         for( int j = 0; j < 3; j++ )
+        {
             h->stat.frame.i_ssd[j] += t->stat.frame.i_ssd[j];
-        h->stat.frame.f_ssim += t->stat.frame.f_ssim;
-        h->stat.frame.i_ssim_cnt += t->stat.frame.i_ssim_cnt;
+            h->stat.frame.f_ssim[j] += t->stat.frame.f_ssim[j];
+            h->stat.frame.i_ssim_cnt[j] += t->stat.frame.i_ssim_cnt[j];
+        }
     }
 
     return 0;
@@ -3389,6 +3705,27 @@ int x264_encoder_invalidate_reference( x264_t *h, int64_t pts )
     return 0;
 }
 
+int x264_encoder_input_rows( x264_t *h, int i_lines )
+{
+    x264_row_input_t *in = h->row_input;
+    if( !in )
+    {
+        x264_log( h, X264_LOG_ERROR, "x264_encoder_input_rows requires b_row_input\n" );
+        return -1;
+    }
+    x264_pthread_mutex_lock( &in->mutex );
+    if( i_lines >= h->param.i_height )
+    {
+        in->i_pictures++;
+        in->i_lines = 0;
+    }
+    else
+        in->i_lines = X264_MAX( in->i_lines, i_lines );
+    x264_pthread_cond_broadcast( &in->cv );
+    x264_pthread_mutex_unlock( &in->mutex );
+    return 0;
+}
+
 /****************************************************************************
  * x264_encoder_encode:
  *  XXX: i_poc   : is the poc of the current given picture
@@ -3416,6 +3753,9 @@ int     x264_encoder_encode( x264_t *h,
         return -1;
 #endif
 
+    if( !h->i_wall_start )
+        h->i_wall_start = x264_nanotime();
+
     if( h->i_thread_frames > 1 )
     {
         thread_prev    = h->thread[ h->i_thread_phase ];
@@ -3447,10 +3787,21 @@ int     x264_encoder_encode( x264_t *h,
 
         if( x264_frame_copy_picture( h, fenc, pic_in ) < 0 )
             return -1;
+        fenc->i_input_time = x264_nanotime();
 
-        if( h->param.i_width != 16 * h->mb.i_mb_width ||
-            h->param.i_height != 16 * h->mb.i_mb_height )
-            x264_frame_expand_border_mod16( h, fenc );
+        if( h->row_input )
+        {
+            x264_pthread_mutex_lock( &h->row_input->mutex );
+            h->row_input->frame = fenc;
+            h->row_input->pic = *pic_in;
+            h->row_input->i_lines_read = 0;
+            x264_pthread_mutex_unlock( &h->row_input->mutex );
+            if( h->row_input->b_whole_picture )
+                x264_row_input_read( h, fenc, h->param.i_height );
+        }
+        else if( h->param.i_width != 16 * h->mb.i_mb_width ||
+                 h->param.i_height != 16 * h->mb.i_mb_height )
+            x264_frame_expand_border_mod16( h, fenc, 0, h->param.i_height );
 
         fenc->i_frame = h->frames.i_input++;
 
@@ -3489,16 +3840,15 @@ int     x264_encoder_encode( x264_t *h,
             if( x264_macroblock_tree_read( h, fenc, pic_in->prop.quant_offsets ) )
                 return -1;
         }
-        else
+        else if( !h->row_input || !h->row_input->b_row_aq )
             x264_stack_align( x264_adaptive_quant_frame, h, fenc, pic_in->prop.quant_offsets );
 
-        if( pic_in->prop.quant_offsets_free )
+        /* With row AQ the offsets are freed once the picture has been read */
+        if( pic_in->prop.quant_offsets_free && (!h->row_input || !h->row_input->b_row_aq) )
             pic_in->prop.quant_offsets_free( pic_in->prop.quant_offsets );
 
-        if( h->frames.b_have_lowres )
-            x264_frame_init_lowres( h, fenc );
-
-        /* 2: Place the frame into the queue for its slice type decision */
+        /* 2: Place the frame into the queue for its slice type decision.
+         * The lookahead builds its lowres planes once it enters the next list. */
         x264_lookahead_put_frame( h, fenc );
 
         if( h->frames.i_input <= h->frames.i_delay + 1 - h->i_thread_frames )
@@ -3780,12 +4130,17 @@ int     x264_encoder_encode( x264_t *h,
                 overhead += h->out.nal[h->out.i_nal-1].i_payload + STRUCTURE_OVERHEAD;
             }
 
-            /* generate gop header */
-            x264_nal_start( h, MPEG2_GOP_HEADER, NAL_PRIORITY_HIGHEST );
-            x264_gop_header_write_mpeg2( h, &h->out.bs );
-            if( x264_nal_end( h ) )
-                return -1;
-            overhead += h->out.nal[h->out.i_nal-1].i_payload + STRUCTURE_OVERHEAD;
+            /* generate gop header
+             * A GOP has to start with an I picture: an intra refresh starting on a P picture
+             * only repeats the sequence header, which marks it as an entry point. */
+            if( IS_X264_TYPE_I( h->fenc->i_type ) )
+            {
+                x264_nal_start( h, MPEG2_GOP_HEADER, NAL_PRIORITY_HIGHEST );
+                x264_gop_header_write_mpeg2( h, &h->out.bs );
+                if( x264_nal_end( h ) )
+                    return -1;
+                overhead += h->out.nal[h->out.i_nal-1].i_payload + STRUCTURE_OVERHEAD;
+            }
         }
 
         /* generate picture header */
@@ -3993,8 +4348,10 @@ int     x264_encoder_encode( x264_t *h,
 
     /* Init the rate control */
     /* FIXME: Include slice header bit cost. */
+    int64_t stage_start = x264_stage_start( h );
     x264_ratecontrol_start( h, h->fenc->i_qpplus1, overhead*8 );
     i_global_qp = x264_ratecontrol_qp( h );
+    x264_stage_end( h, X264_STAGE_RATECONTROL, stage_start );
 
     pic_out->i_qpplus1 =
     h->fdec->i_qpplus1 = i_global_qp + 1;
@@ -4025,8 +4382,17 @@ int     x264_encoder_encode( x264_t *h,
     h->i_threadslice_end = h->mb.i_mb_height;
     if( h->i_thread_frames > 1 )
     {
+        if( h->metricpool )
+        {
+            memset( h->metrics.i_ssd, 0, sizeof(h->metrics.i_ssd) );
+            memset( h->metrics.f_ssim, 0, sizeof(h->metrics.f_ssim) );
+            memset( h->metrics.i_ssim_cnt, 0, sizeof(h->metrics.i_ssim_cnt) );
+            h->metrics.b_active = 1;
+        }
         x264_threadpool_run( h->threadpool, (void*)x264_slices_write, h );
         h->b_thread_active = 1;
+        if( h->metricpool )
+            x264_threadpool_run( h->metricpool, (void*)x264_metrics_frame, h );
     }
     else if( h->param.b_sliced_threads )
     {
@@ -4048,8 +4414,23 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
 
     if( !h->param.b_sliced_threads && h->b_thread_active )
     {
+        int64_t time = 0;
         h->b_thread_active = 0;
-        if( (intptr_t)x264_threadpool_wait( h->threadpool, h ) )
+        intptr_t ret = (intptr_t)x264_threadpool_wait_timed( h->threadpool, h, &time );
+        x264_wait_account( h, X264_WAIT_FRAME, time );
+        if( h->metrics.b_active )
+        {
+            h->metrics.b_active = 0;
+            x264_threadpool_wait_timed( h->metricpool, h, &time );
+            x264_wait_account( h, X264_WAIT_FRAME, time );
+            for( int i = 0; i < 3; i++ )
+            {
+                h->stat.frame.i_ssd[i] += h->metrics.i_ssd[i];
+                h->stat.frame.f_ssim[i] += h->metrics.f_ssim[i];
+                h->stat.frame.i_ssim_cnt[i] += h->metrics.i_ssim_cnt[i];
+            }
+        }
+        if( ret )
             return -1;
     }
     if( !h->out.i_nal )
@@ -4060,6 +4441,9 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
 
     x264_emms();
 
+    if( h->param.analyse.b_metric_maps && !h->metricpool )
+        x264_metrics_maps( h );
+
     /* generate buffering period sei and insert it into place */
     if( h->i_thread_frames > 1 && h->fenc->b_keyframe && h->sps->vui.b_nal_hrd_parameters_present )
     {
@@ -4114,7 +4498,10 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
 
     /* update rc */
     int filler = 0;
-    if( x264_ratecontrol_end( h, frame_size * 8, &filler ) < 0 )
+    int64_t stage_start = x264_stage_start( h );
+    int rc_status = x264_ratecontrol_end( h, frame_size * 8, &filler );
+    x264_stage_end( h, X264_STAGE_RATECONTROL, stage_start );
+    if( rc_status < 0 )
         return -1;
 
     pic_out->hrd_timing = h->fenc->hrd_timing;
@@ -4162,6 +4549,9 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
         }
     }
 
+    if( h->param.b_single_nal )
+        x264_encoder_single_nal( h );
+
     /* End bitstream, set output  */
     *pi_nal = h->out.i_nal;
     *pp_nal = h->out.nal;
@@ -4247,13 +4637,58 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
 
     if( h->param.analyse.b_ssim )
     {
-        pic_out->prop.f_ssim = h->stat.frame.f_ssim / h->stat.frame.i_ssim_cnt;
+        pic_out->prop.f_ssim = h->stat.frame.f_ssim[0] / h->stat.frame.i_ssim_cnt[0];
+        pic_out->prop.f_ssim_chroma[0] = h->stat.frame.f_ssim[1] / h->stat.frame.i_ssim_cnt[1];
+        pic_out->prop.f_ssim_chroma[1] = h->stat.frame.f_ssim[2] / h->stat.frame.i_ssim_cnt[2];
         h->stat.f_ssim_mean_y[h->sh.i_type] += pic_out->prop.f_ssim * dur;
+        h->stat.f_ssim_mean_u[h->sh.i_type] += pic_out->prop.f_ssim_chroma[0] * dur;
+        h->stat.f_ssim_mean_v[h->sh.i_type] += pic_out->prop.f_ssim_chroma[1] * dur;
         snprintf( psz_message + strlen(psz_message), 80 - strlen(psz_message),
-                  " SSIM Y:%.5f", pic_out->prop.f_ssim );
+                  " SSIM Y:%.5f U:%.5f V:%.5f", pic_out->prop.f_ssim,
+                  pic_out->prop.f_ssim_chroma[0], pic_out->prop.f_ssim_chroma[1] );
     }
     psz_message[79] = '\0';
 
+    if( h->param.frame_stats )
+    {
+        x264_frame_stats_t stats = {0};
+        stats.i_frame         = h->i_frame;
+        stats.i_frame_in      = h->fenc->i_frame;
+        stats.i_type          = pic_out->i_type;
+        stats.b_keyframe      = pic_out->b_keyframe;
+        stats.i_pts           = pic_out->i_pts;
+        stats.i_dts           = pic_out->i_dts;
+        stats.i_size          = frame_size;
+        stats.i_tex_bits      = h->stat.frame.i_tex_bits;
+        stats.i_mv_bits       = h->stat.frame.i_mv_bits;
+        stats.i_misc_bits     = h->stat.frame.i_misc_bits;
+        stats.i_mb_count_i    = h->stat.frame.i_mb_count_i;
+        stats.i_mb_count_p    = h->stat.frame.i_mb_count_p;
+        stats.i_mb_count_skip = h->stat.frame.i_mb_count_skip;
+        stats.f_qp_avg_aq     = h->fdec->f_qp_avg_aq;
+        stats.f_crf_avg       = h->fdec->f_crf_avg;
+        stats.i_lookahead_cost = h->fdec->i_satd;
+        x264_ratecontrol_frame_stats( h, &stats );
+        if( h->param.analyse.b_psnr )
+            for( int i = 0; i < 3; i++ )
+                stats.f_psnr[i] = pic_out->prop.f_psnr[i];
+        if( h->param.analyse.b_ssim )
+        {
+            stats.f_ssim = pic_out->prop.f_ssim;
+            stats.f_ssim_chroma[0] = pic_out->prop.f_ssim_chroma[0];
+            stats.f_ssim_chroma[1] = pic_out->prop.f_ssim_chroma[1];
+        }
+        if( h->param.analyse.b_metric_maps )
+        {
+            stats.f_psnr_map   = h->metrics.psnr_map;
+            stats.f_ssim_map   = h->metrics.ssim_map;
+            stats.i_map_width  = h->mb.i_mb_width;
+            stats.i_map_height = h->mb.i_mb_height;
+        }
+        stats.i_latency       = x264_nanotime() - h->fenc->i_input_time;
+        h->param.frame_stats( h, &stats, h->fenc->opaque );
+    }
+
     x264_log( h, X264_LOG_DEBUG,
                   "frame=%4d QP=%.2f NAL=%d Slice:%c Poc:%-3d I:%-4d P:%-4d SKIP:%-4d size=%d bytes%s\n",
               h->i_frame,
@@ -4271,6 +4706,7 @@ static int x264_encoder_frame_end( x264_t *h, x264_t *thread_current,
     x264_thread_sync_stat( h->thread[0], h );
     // for the use of the next frame
     x264_thread_sync_stat( thread_current, h );
+    h->thread[0]->i_wall_end = x264_nanotime();
 
 #ifdef DEBUG_MB_TYPE
 {
@@ -4317,9 +4753,45 @@ static void x264_print_intra( int64_t *i_mb_count, double i_count, int b_print_p
 }
 
 /****************************************************************************
- * x264_encoder_close:
+ * x264_encoder_stats:
  ****************************************************************************/
-void    x264_encoder_close  ( x264_t *h )
+int x264_encoder_stats( x264_t *h, int i_thread, x264_encoder_stats_t *stats )
+{
+    int i_threads = h->param.i_threads + !!h->param.i_sync_lookahead;
+    if( i_thread >= i_threads )
+        return -1;
+
+    memset( stats, 0, sizeof(x264_encoder_stats_t) );
+    stats->i_threads = i_threads;
+    for( int i = 0; i < i_threads; i++ )
+    {
+        if( i_thread >= 0 && i != i_thread )
+            continue;
+        for( int j = 0; j < X264_STAGE_MAX; j++ )
+        {
+            x264_stage_stats_t *src = &h->thread[i]->stage_stats[j];
+            stats->stage[j].i_calls += src->i_calls;
+            stats->stage[j].i_time += src->i_time;
+            for( int k = 0; k < X264_STAGE_HIST_BINS; k++ )
+                stats->stage[j].i_hist[k] += src->i_hist[k];
+        }
+        for( int j = 0; j < X264_WAIT_MAX; j++ )
+        {
+            stats->wait[j].i_waits += h->thread[i]->wait_stats[j].i_waits;
+            stats->wait[j].i_time += h->thread[i]->wait_stats[j].i_time;
+        }
+        stats->i_busy_time += h->thread[i]->i_busy_time;
+    }
+    stats->i_wall_time = h->thread[0]->i_wall_end - h->thread[0]->i_wall_start;
+    if( i_thread < 0 && stats->i_wall_time > 0 )
+        stats->f_parallelism = (double)stats->i_busy_time / stats->i_wall_time;
+    return 0;
+}
+
+/****************************************************************************
+ * x264_encoder_summary: print the statistics of the stream encoded so far
+ ****************************************************************************/
+static void x264_encoder_summary( x264_t *h )
 {
     int64_t i_yuv_size = FRAME_SIZE( h->param.i_width * h->param.i_height );
     int64_t i_mb_count_size[2][7] = {{0}};
@@ -4328,28 +4800,8 @@ void    x264_encoder_close  ( x264_t *h )
                    || h->stat.i_mb_count[SLICE_TYPE_P][I_PCM]
                    || h->stat.i_mb_count[SLICE_TYPE_B][I_PCM];
 
-    x264_lookahead_delete( h );
-
-#if HAVE_OPENCL
-    x264_opencl_lookahead_delete( h );
-    x264_opencl_function_t *ocl = h->opencl.ocl;
-#endif
-
-    if( h->param.b_sliced_threads )
-        x264_threadpool_wait_all( h );
-    if( h->param.i_threads > 1 )
-        x264_threadpool_delete( h->threadpool );
-    if( h->param.i_lookahead_threads > 1 )
-        x264_threadpool_delete( h->lookaheadpool );
     if( h->i_thread_frames > 1 )
     {
-        for( int i = 0; i < h->i_thread_frames; i++ )
-            if( h->thread[i]->b_thread_active )
-            {
-                assert( h->thread[i]->fenc->i_reference_count == 1 );
-                x264_frame_delete( h->thread[i]->fenc );
-            }
-
         x264_t *thread_prev = h->thread[h->i_thread_phase];
         x264_thread_sync_ratecontrol( h, thread_prev, h );
         x264_thread_sync_ratecontrol( thread_prev, thread_prev, h );
@@ -4603,7 +5055,8 @@ void    x264_encoder_close  ( x264_t *h )
         if( h->param.analyse.b_ssim )
         {
             float ssim = SUM3( h->stat.f_ssim_mean_y ) / duration;
-            x264_log( h, X264_LOG_INFO, "SSIM Mean Y:%.7f (%6.3fdb)\n", ssim, x264_ssim( ssim ) );
+            x264_log( h, X264_LOG_INFO, "SSIM Mean Y:%.7f (%6.3fdb) U:%.7f V:%.7f\n", ssim, x264_ssim( ssim ),
+                      SUM3( h->stat.f_ssim_mean_u ) / duration, SUM3( h->stat.f_ssim_mean_v ) / duration );
         }
         if( h->param.analyse.b_psnr )
         {
@@ -4618,7 +5071,71 @@ void    x264_encoder_close  ( x264_t *h )
         }
         else
             x264_log( h, X264_LOG_INFO, "kb/s:%.2f\n", f_bitrate );
+
+        x264_encoder_stats_t stats;
+        if( (h->param.i_threads > 1 || h->param.i_sync_lookahead) && !x264_encoder_stats( h, -1, &stats ) )
+        {
+            char waits[X264_WAIT_MAX*48] = "";
+            char *p = waits;
+            for( int i = 0; i < X264_WAIT_MAX; i++ )
+                if( stats.wait[i].i_waits )
+                    p += sprintf( p, " %s:%.3fs/%"PRId64, x264_wait_names[i],
+                                  stats.wait[i].i_time / 1e9, stats.wait[i].i_waits );
+            /* only part of the default summary when stage profiling was asked for */
+            x264_log( h, h->param.b_profile_stages ? X264_LOG_INFO : X264_LOG_DEBUG,
+                      "threads: %d, effective parallelism: %.2f, blocked:%s\n",
+                      stats.i_threads, stats.f_parallelism, p == waits ? " none" : waits );
+            for( int t = 0; t < stats.i_threads; t++ )
+            {
+                x264_encoder_stats( h, t, &stats );
+                p = waits;
+                for( int i = 0; i < X264_WAIT_MAX; i++ )
+                    if( stats.wait[i].i_waits )
+                        p += sprintf( p, " %s:%.3fs", x264_wait_names[i], stats.wait[i].i_time / 1e9 );
+                x264_log( h, X264_LOG_DEBUG, "  thread %d: busy %.3fs, blocked:%s\n",
+                          t, stats.i_busy_time / 1e9, p == waits ? " none" : waits );
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * x264_encoder_close:
+ ****************************************************************************/
+void    x264_encoder_close  ( x264_t *h )
+{
+    x264_lookahead_delete( h );
+
+#if HAVE_OPENCL
+    x264_opencl_lookahead_delete( h );
+    x264_opencl_function_t *ocl = h->opencl.ocl;
+#endif
+
+    if( h->param.b_sliced_threads )
+        x264_threadpool_wait_all( h );
+    if( h->param.i_threads > 1 )
+        x264_threadpool_delete( h->threadpool );
+    if( h->param.i_lookahead_threads > 1 )
+        x264_threadpool_delete( h->lookaheadpool );
+    if( h->metricpool )
+    {
+        for( int i = 0; i < h->i_thread_frames; i++ )
+            if( h->thread[i]->metrics.b_active )
+                x264_threadpool_wait( h->metricpool, h->thread[i] );
+        x264_threadpool_delete( h->metricpool );
+    }
+    if( h->i_thread_frames > 1 )
+    {
+        for( int i = 0; i < h->i_thread_frames; i++ )
+            if( h->thread[i]->b_thread_active )
+            {
+                assert( h->thread[i]->fenc->i_reference_count == 1 );
+                x264_frame_delete( h->thread[i]->fenc );
+            }
     }
+    /* no ratecontrol after a failed x264_encoder_reset */
+    if( h->rc )
+        x264_encoder_summary( h );
 
     /* rc */
     x264_ratecontrol_delete( h );
@@ -4633,6 +5150,12 @@ void    x264_encoder_close  ( x264_t *h )
     x264_free( h->nal_buffer );
     x264_free( h->reconfig_h );
     x264_analyse_free_costs( h );
+    if( h->row_input )
+    {
+        x264_pthread_mutex_destroy( &h->row_input->mutex );
+        x264_pthread_cond_destroy( &h->row_input->cv );
+        x264_free( h->row_input );
+    }
 
     if( h->i_thread_frames > 1 )
         h = h->thread[h->i_thread_phase];
@@ -4653,7 +5176,14 @@ void    x264_encoder_close  ( x264_t *h )
 
     if( h->param.i_lookahead_threads > 1 )
         for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+        {
+            if( h->frames.b_have_lowres )
+                x264_macroblock_lookahead_thread_free( h->lookahead_thread[i] );
             x264_free( h->lookahead_thread[i] );
+        }
+
+    if( h->param.i_sync_lookahead )
+        x264_free( h->thread[h->param.i_threads] );
 
     for( int i = h->param.i_threads - 1; i >= 0; i-- )
     {
@@ -4690,6 +5220,115 @@ void    x264_encoder_close  ( x264_t *h )
 #endif
 }
 
+/****************************************************************************
+ * x264_encoder_reset:
+ ****************************************************************************/
+int     x264_encoder_reset( x264_t *h, x264_param_t *param )
+{
+    if( x264_encoder_delayed_frames( h ) )
+    {
+        x264_log( h, X264_LOG_ERROR, "reset: the encoder has delayed frames, flush it first\n" );
+        return -1;
+    }
+    /* validated now, applied below once the previous stream is finished */
+    if( param && x264_encoder_reconfig( h, param ) < 0 )
+        return -1;
+
+    if( h->param.b_sliced_threads )
+        x264_threadpool_wait_all( h );
+    if( h->metricpool )
+        for( int i = 0; i < h->i_thread_frames; i++ )
+            if( h->thread[i]->metrics.b_active )
+                x264_threadpool_wait( h->metricpool, h->thread[i] );
+    x264_encoder_summary( h );
+    x264_ratecontrol_delete( h );
+    h->rc = NULL;
+
+    /* The next frame continues from h, like the first frame after x264_encoder_open. */
+    if( h->i_thread_frames > 1 )
+    {
+        x264_t *thread_prev = h->thread[h->i_thread_phase];
+        x264_thread_sync_context( h, thread_prev );
+        thread_prev->reconfig = 0;
+        h->i_thread_phase = 0;
+    }
+    if( h->reconfig )
+    {
+        int rc_reconfig;
+        x264_encoder_try_reconfig( h, &h->reconfig_h->param, &rc_reconfig );
+        mbcmp_init( h );
+        x264_sps_init( h->sps, h->param.i_sps_id, &h->param );
+        /* unlike the middle of a stream, the start of one can signal a new initial QP */
+        h->pps->i_pic_init_qp = h->param.rc.i_rc_method == X264_RC_ABR || h->param.b_stitchable ? 26 + QP_BD_OFFSET : SPEC_QP( h->param.rc.i_qp_constant );
+        h->reconfig = 0;
+    }
+
+    while( h->frames.reference[0] )
+        x264_frame_push_unused( h, x264_frame_pop( h->frames.reference ) );
+    /* the last picture of the previous stream isn't a reference of the next */
+    h->fdec->b_kept_as_ref = 0;
+
+    h->i_frame = -1;
+    h->i_frame_num = 0;
+    h->i_idr_pic_id = 0;
+    h->frames.i_last_idr =
+    h->frames.i_last_keyframe = - h->param.i_keyint_max;
+    h->frames.i_input = 0;
+    h->frames.i_largest_pts = h->frames.i_second_largest_pts = -1;
+    h->frames.i_poc_last_open_gop = -1;
+    h->frames.i_last_temporal_ref = 0;
+    h->frames.i_first_pts = h->frames.i_bframe_delay_time = 0;
+    h->frames.i_prev_reordered_pts[0] = h->frames.i_prev_reordered_pts[1] = 0;
+    h->i_ref[0] = h->i_ref[1] = 0;
+    h->i_cpb_delay = h->i_coded_fields = h->i_disp_fields = 0;
+    h->i_cpb_delay_lookahead = h->i_coded_fields_lookahead = 0;
+    h->i_cpb_delay_pir_offset = h->i_cpb_delay_pir_offset_next = 0;
+    h->i_prev_duration = ((uint64_t)h->param.i_fps_den * h->sps->vui.i_time_scale) / ((uint64_t)h->param.i_fps_num * h->sps->vui.i_num_units_in_tick);
+    h->i_disp_fields_last_frame = -1;
+    h->b_queued_intra_refresh = 0;
+    h->i_last_idr_pts = 0;
+    h->b_sh_backup = 0;
+    h->initial_cpb_removal_delay = h->initial_cpb_removal_delay_offset = 0;
+    h->i_reordered_pts_delay = 0;
+    memset( &h->stat, 0, sizeof(h->stat) );
+    h->i_wall_start = h->i_wall_end = 0;
+    for( int i = 0; i < h->param.i_threads + !!h->param.i_sync_lookahead; i++ )
+    {
+        x264_t *t = h->thread[i];
+        memset( t->nr_offset_denoise, 0, sizeof(t->nr_offset_denoise) );
+        memset( t->nr_residual_sum_buf, 0, sizeof(t->nr_residual_sum_buf) );
+        memset( t->nr_count_buf, 0, sizeof(t->nr_count_buf) );
+        memset( t->stage_stats, 0, sizeof(t->stage_stats) );
+        memset( t->wait_stats, 0, sizeof(t->wait_stats) );
+        t->i_busy_time = 0;
+    }
+    if( h->row_input )
+    {
+        x264_pthread_mutex_lock( &h->row_input->mutex );
+        h->row_input->i_pictures = h->row_input->i_picture = h->row_input->i_lines = 0;
+        x264_pthread_mutex_unlock( &h->row_input->mutex );
+    }
+
+    if( x264_lookahead_reset( h ) < 0 )
+        return -1;
+    for( x264_frame_t **frame = h->frames.unused[0]; *frame; frame++ )
+        x264_frame_reset_lookahead( h, *frame );
+    if( x264_ratecontrol_new( h ) < 0 )
+        return -1;
+
+    if( h->param.psz_dump_yuv )
+    {
+        FILE *f = x264_fopen( h->param.psz_dump_yuv, "w" );
+        if( !f )
+        {
+            x264_log( h, X264_LOG_ERROR, "dump_yuv: can't write to %s\n", h->param.psz_dump_yuv );
+            return -1;
+        }
+        fclose( f );
+    }
+    return 0;
+}
+
 int x264_encoder_delayed_frames( x264_t *h )
 {
     int delayed_frames = 0;
@@ -56,6 +56,61 @@ static void x264_lookahead_shift( x264_sync_frame_list_t *dst, x264_sync_frame_l
     }
 }
 
+static void x264_lookahead_init_lowres( x264_frame_t *frame )
+{
+    x264_frame_init_lowres( frame->lowres_h, frame );
+}
+
+/* Build the lowres planes of the last count frames of the next list. With lookahead threads
+ * they are built on the pool while the frames wait for their slicetype decision, which then
+ * waits for them in x264_lookahead_sync_lowres.  The pool has a job slot per thread and the
+ * thread that owns the next list is its only user, so it makes room by finishing the oldest. */
+static void x264_lookahead_start_lowres( x264_t *h, int count )
+{
+    x264_sync_frame_list_t *next = &h->lookahead->next;
+    if( !h->frames.b_have_lowres )
+        return;
+    for( int i = next->i_size - count; i < next->i_size; i++ )
+    {
+        x264_frame_t *frame = next->list[i];
+        if( !h->lookaheadpool )
+        {
+            x264_frame_init_lowres( h, frame );
+            continue;
+        }
+        int pending = 0;
+        int oldest = -1;
+        for( int j = 0; j < i; j++ )
+            if( next->list[j]->lowres_h )
+            {
+                if( oldest < 0 )
+                    oldest = j;
+                pending++;
+            }
+        if( pending == h->param.i_lookahead_threads )
+        {
+            x264_threadpool_wait( h->lookaheadpool, next->list[oldest] );
+            next->list[oldest]->lowres_h = NULL;
+        }
+        frame->lowres_h = h;
+        x264_threadpool_run( h->lookaheadpool, (void*)x264_lookahead_init_lowres, frame );
+    }
+}
+
+/* Wait for the lowres planes of the frames about to be analysed. */
+static void x264_lookahead_sync_lowres( x264_t *h )
+{
+    for( int i = 0; i < h->lookahead->next.i_size; i++ )
+    {
+        x264_frame_t *frame = h->lookahead->next.list[i];
+        if( frame->lowres_h )
+        {
+            x264_threadpool_wait( h->lookaheadpool, frame );
+            frame->lowres_h = NULL;
+        }
+    }
+}
+
 static void x264_lookahead_update_last_nonb( x264_t *h, x264_frame_t *new_nonb )
 {
     if( h->lookahead->last_nonb )
@@ -67,14 +122,24 @@ static void x264_lookahead_update_last_nonb( x264_t *h, x264_frame_t *new_nonb )
 #if HAVE_THREAD
 static void x264_lookahead_slicetype_decide( x264_t *h )
 {
+    int64_t busy_start = x264_nanotime();
+    int64_t stage_start = x264_stage_start( h );
+    x264_lookahead_sync_lowres( h );
     x264_stack_align( x264_slicetype_decide, h );
+    x264_stage_end( h, X264_STAGE_LOOKAHEAD, stage_start );
 
     x264_lookahead_update_last_nonb( h, h->lookahead->next.list[0] );
     int shift_frames = h->lookahead->next.list[0]->i_bframes + 1;
 
     x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-    while( h->lookahead->ofbuf.i_size == h->lookahead->ofbuf.i_max_size )
-        x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_empty, &h->lookahead->ofbuf.mutex );
+    h->i_busy_time += x264_nanotime() - busy_start;
+    if( h->lookahead->ofbuf.i_size == h->lookahead->ofbuf.i_max_size )
+    {
+        int64_t wait_start = x264_nanotime();
+        while( h->lookahead->ofbuf.i_size == h->lookahead->ofbuf.i_max_size )
+            x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_empty, &h->lookahead->ofbuf.mutex );
+        x264_wait_account( h, X264_WAIT_LOOKAHEAD_OUTPUT, x264_nanotime() - wait_start );
+    }
 
     x264_pthread_mutex_lock( &h->lookahead->next.mutex );
     x264_lookahead_shift( &h->lookahead->ofbuf, &h->lookahead->next, shift_frames );
@@ -82,7 +147,13 @@ static void x264_lookahead_slicetype_decide( x264_t *h )
 
     /* For MB-tree and VBV lookahead, we have to perform propagation analysis on I-frames too. */
     if( h->lookahead->b_analyse_keyframe && IS_X264_TYPE_I( h->lookahead->last_nonb->i_type ) )
+    {
+        busy_start = x264_nanotime();
+        stage_start = x264_stage_start( h );
         x264_stack_align( x264_slicetype_analyse, h, shift_frames );
+        x264_stage_end( h, X264_STAGE_LOOKAHEAD, stage_start );
+        h->i_busy_time += x264_nanotime() - busy_start;
+    }
 
     x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
 }
@@ -96,23 +167,30 @@ static void *x264_lookahead_thread( x264_t *h )
         int shift = X264_MIN( h->lookahead->next.i_max_size - h->lookahead->next.i_size, h->lookahead->ifbuf.i_size );
         x264_lookahead_shift( &h->lookahead->next, &h->lookahead->ifbuf, shift );
         x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
+        x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
+        x264_lookahead_start_lowres( h, shift );
         if( h->lookahead->next.i_size <= h->lookahead->i_slicetype_length + h->param.b_vfr_input )
         {
-            while( !h->lookahead->ifbuf.i_size && !h->lookahead->b_exit_thread )
-                x264_pthread_cond_wait( &h->lookahead->ifbuf.cv_fill, &h->lookahead->ifbuf.mutex );
+            x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
+            if( !h->lookahead->ifbuf.i_size && !h->lookahead->b_exit_thread )
+            {
+                int64_t wait_start = x264_nanotime();
+                while( !h->lookahead->ifbuf.i_size && !h->lookahead->b_exit_thread )
+                    x264_pthread_cond_wait( &h->lookahead->ifbuf.cv_fill, &h->lookahead->ifbuf.mutex );
+                x264_wait_account( h, X264_WAIT_LOOKAHEAD_INPUT, x264_nanotime() - wait_start );
+            }
             x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
         }
         else
-        {
-            x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
             x264_lookahead_slicetype_decide( h );
-        }
     }   /* end of input frames */
     x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
     x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-    x264_lookahead_shift( &h->lookahead->next, &h->lookahead->ifbuf, h->lookahead->ifbuf.i_size );
+    int shift = h->lookahead->ifbuf.i_size;
+    x264_lookahead_shift( &h->lookahead->next, &h->lookahead->ifbuf, shift );
     x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
     x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
+    x264_lookahead_start_lowres( h, shift );
     while( h->lookahead->next.i_size )
         x264_lookahead_slicetype_decide( h );
     x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
@@ -173,8 +251,10 @@ void x264_lookahead_delete( x264_t *h )
         x264_pthread_join( h->lookahead->thread_handle, NULL );
         x264_macroblock_cache_free( h->thread[h->param.i_threads] );
         x264_macroblock_thread_free( h->thread[h->param.i_threads], 1 );
-        x264_free( h->thread[h->param.i_threads] );
+        /* the context itself is freed in x264_encoder_close, after the stats have been printed */
     }
+    /* frames left over when closing without flushing may still be in the pool */
+    x264_lookahead_sync_lowres( h );
     x264_sync_frame_list_delete( &h->lookahead->ifbuf );
     x264_sync_frame_list_delete( &h->lookahead->next );
     if( h->lookahead->last_nonb )
@@ -183,12 +263,45 @@ void x264_lookahead_delete( x264_t *h )
     x264_free( h->lookahead );
 }
 
+/* Start a new stream, once the encoder has been flushed. */
+int x264_lookahead_reset( x264_t *h )
+{
+    x264_lookahead_t *look = h->lookahead;
+    if( look->last_nonb )
+        x264_frame_push_unused( h, look->last_nonb );
+    look->last_nonb = NULL;
+    look->i_last_keyframe = - h->param.i_keyint_max;
+
+    if( !h->param.i_sync_lookahead )
+        return 0;
+
+    /* The thread exits when the encoder is flushed (or is still waiting for the first frame),
+     * start it again with the state of the new stream. */
+    x264_pthread_mutex_lock( &look->ifbuf.mutex );
+    look->b_exit_thread = 1;
+    x264_pthread_cond_broadcast( &look->ifbuf.cv_fill );
+    x264_pthread_mutex_unlock( &look->ifbuf.mutex );
+    x264_pthread_join( look->thread_handle, NULL );
+    look->b_exit_thread = 0;
+
+    x264_t *look_h = h->thread[h->param.i_threads];
+    memcpy( &look_h->i_frame, &h->i_frame, offsetof(x264_t, mb.base) - offsetof(x264_t, i_frame) );
+    look_h->param = h->param;
+    if( x264_pthread_create( &look->thread_handle, NULL, (void*)x264_lookahead_thread, look_h ) )
+        return -1;
+    look->b_thread_active = 1;
+    return 0;
+}
+
 void x264_lookahead_put_frame( x264_t *h, x264_frame_t *frame )
 {
     if( h->param.i_sync_lookahead )
         x264_sync_frame_list_push( &h->lookahead->ifbuf, frame );
     else
+    {
         x264_sync_frame_list_push( &h->lookahead->next, frame );
+        x264_lookahead_start_lowres( h, 1 );
+    }
 }
 
 int x264_lookahead_is_empty( x264_t *h )
@@ -219,8 +332,13 @@ void x264_lookahead_get_frames( x264_t *h )
     if( h->param.i_sync_lookahead )
     {   /* We have a lookahead thread, so get frames from there */
         x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-        while( !h->lookahead->ofbuf.i_size && h->lookahead->b_thread_active )
-            x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_fill, &h->lookahead->ofbuf.mutex );
+        if( !h->lookahead->ofbuf.i_size && h->lookahead->b_thread_active )
+        {
+            int64_t wait_start = x264_nanotime();
+            while( !h->lookahead->ofbuf.i_size && h->lookahead->b_thread_active )
+                x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_fill, &h->lookahead->ofbuf.mutex );
+            x264_wait_account( h, X264_WAIT_LOOKAHEAD, x264_nanotime() - wait_start );
+        }
         x264_lookahead_encoder_shift( h );
         x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
     }
@@ -230,6 +348,9 @@ void x264_lookahead_get_frames( x264_t *h )
         if( h->frames.current[0] || !h->lookahead->next.i_size )
             return;
 
+        int64_t busy_start = x264_nanotime();
+        int64_t stage_start = x264_stage_start( h );
+        x264_lookahead_sync_lowres( h );
         x264_stack_align( x264_slicetype_decide, h );
         x264_lookahead_update_last_nonb( h, h->lookahead->next.list[0] );
         int shift_frames = h->lookahead->next.list[0]->i_bframes + 1;
@@ -238,6 +359,8 @@ void x264_lookahead_get_frames( x264_t *h )
         /* For MB-tree and VBV lookahead, we have to perform propagation analysis on I-frames too. */
         if( h->lookahead->b_analyse_keyframe && IS_X264_TYPE_I( h->lookahead->last_nonb->i_type ) )
             x264_stack_align( x264_slicetype_analyse, h, shift_frames );
+        x264_stage_end( h, X264_STAGE_LOOKAHEAD, stage_start );
+        h->i_busy_time += x264_nanotime() - busy_start;
 
         x264_lookahead_encoder_shift( h );
     }
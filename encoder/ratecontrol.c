@@ -32,6 +32,7 @@
 
 #include "common/common.h"
 #include "ratecontrol.h"
+#include "stats.h"
 #include "me.h"
 
 typedef struct
@@ -60,6 +61,8 @@ typedef struct
     int64_t i_cpb_duration;
 } ratecontrol_entry_t;
 
+typedef struct mbtree_reader_t mbtree_reader_t;
+
 typedef struct
 {
     float coeff_min;
@@ -124,6 +127,10 @@ struct x264_ratecontrol_t
     char *psz_mbtree_stat_file_tmpname;
     char *psz_mbtree_stat_file_name;
     FILE *p_mbtree_stat_file_in;
+    void *stat_map;             /* mapped binary 1st pass stats, released once parsed */
+    size_t stat_map_size;
+    int b_stat_mapped;
+    uint32_t stat_options_size; /* size of the options string in binary stats output */
 
     int num_entries;            /* number of ratecontrol_entry_ts */
     ratecontrol_entry_t *entry; /* FIXME: copy needed data and free this once init is done */
@@ -150,6 +157,11 @@ struct x264_ratecontrol_t
         float *coeffs[2];
         int *pos[2];
         int srcdim[2];          /* Source dimensions (W/H) */
+
+        /* Compact format */
+        uint8_t *bs_buffer;     /* coded qp offsets of the frame being written */
+        int bs_size;
+        mbtree_reader_t *reader;
     } mbtree;
 
     /* MBRC stuff */
@@ -158,6 +170,12 @@ struct x264_ratecontrol_t
     double frame_size_maximum;  /* Maximum frame size due to MinCR */
     double frame_size_planned;
     double slice_size_planned;
+    /* Row VBV: with sliced threads, each thread gets a share of the buffer for its rows */
+    double row_buffer_size;     /* as requested, it may be smaller than a frame */
+    double row_buffer_fill;     /* buffer after the rows encoded so far */
+    double row_buffer_share;    /* size of this thread's part of the buffer */
+    double row_buffer_rate;     /* # of bits added to row_buffer_fill after each row */
+    int row_overhead;           /* bits of the frame's headers, sent with its first row */
     predictor_t (*row_pred)[2];
     predictor_t row_preds[3][2];
     predictor_t *pred_b_from_p; /* predict B-frame size from P-frame satd */
@@ -305,6 +323,30 @@ static NOINLINE uint32_t x264_ac_energy_mb( x264_t *h, int mb_x, int mb_y, x264_
     return var;
 }
 
+static ALWAYS_INLINE void x264_adaptive_quant_set( x264_t *h, x264_frame_t *frame, float *quant_offsets, int mb_xy, float qp_adj )
+{
+    if( quant_offsets )
+        qp_adj += quant_offsets[mb_xy];
+    frame->f_qp_offset[mb_xy] =
+    frame->f_qp_offset_aq[mb_xy] = qp_adj;
+    if( h->frames.b_have_lowres )
+        frame->i_inv_qscale_factor[mb_xy] = x264_exp2fix8(qp_adj);
+}
+
+/* X264_AQ_VARIANCE offsets only depend on each macroblock's own pixels, so they can be computed
+ * for rows [i_mb_y_start, i_mb_y_end) as soon as those are in place. */
+void x264_adaptive_quant_rows( x264_t *h, x264_frame_t *frame, float *quant_offsets, int i_mb_y_start, int i_mb_y_end )
+{
+    float strength = h->param.rc.f_aq_strength * 1.0397f;
+    for( int mb_y = i_mb_y_start; mb_y < i_mb_y_end; mb_y++ )
+        for( int mb_x = 0; mb_x < h->mb.i_mb_width; mb_x++ )
+        {
+            uint32_t energy = x264_ac_energy_mb( h, mb_x, mb_y, frame );
+            float qp_adj = strength * (x264_log2( X264_MAX(energy, 1) ) - (14.427f + 2*(BIT_DEPTH-8)));
+            x264_adaptive_quant_set( h, frame, quant_offsets, mb_x + mb_y*h->mb.i_mb_stride, qp_adj );
+        }
+}
+
 void x264_adaptive_quant_frame( x264_t *h, x264_frame_t *frame, float *quant_offsets )
 {
     /* constants chosen to result in approximately the same overall bitrate as without AQ.
@@ -352,50 +394,31 @@ void x264_adaptive_quant_frame( x264_t *h, x264_frame_t *frame, float *quant_off
             return;
     }
     /* Actual adaptive quantization */
+    else if( h->param.rc.i_aq_mode == X264_AQ_VARIANCE )
+        x264_adaptive_quant_rows( h, frame, quant_offsets, 0, h->mb.i_mb_height );
     else
     {
-        if( h->param.rc.i_aq_mode == X264_AQ_AUTOVARIANCE )
-        {
-            float bit_depth_correction = powf(1 << (BIT_DEPTH-8), 0.5f);
-            float avg_adj_pow2 = 0.f;
-            for( int mb_y = 0; mb_y < h->mb.i_mb_height; mb_y++ )
-                for( int mb_x = 0; mb_x < h->mb.i_mb_width; mb_x++ )
-                {
-                    uint32_t energy = x264_ac_energy_mb( h, mb_x, mb_y, frame );
-                    float qp_adj = powf( energy + 1, 0.125f );
-                    frame->f_qp_offset[mb_x + mb_y*h->mb.i_mb_stride] = qp_adj;
-                    avg_adj += qp_adj;
-                    avg_adj_pow2 += qp_adj * qp_adj;
-                }
-            avg_adj /= h->mb.i_mb_count;
-            avg_adj_pow2 /= h->mb.i_mb_count;
-            strength = h->param.rc.f_aq_strength * avg_adj / bit_depth_correction;
-            avg_adj = avg_adj - 0.5f * (avg_adj_pow2 - (14.f * bit_depth_correction)) / avg_adj;
-        }
-        else
-            strength = h->param.rc.f_aq_strength * 1.0397f;
+        float bit_depth_correction = powf(1 << (BIT_DEPTH-8), 0.5f);
+        float avg_adj_pow2 = 0.f;
+        for( int mb_y = 0; mb_y < h->mb.i_mb_height; mb_y++ )
+            for( int mb_x = 0; mb_x < h->mb.i_mb_width; mb_x++ )
+            {
+                uint32_t energy = x264_ac_energy_mb( h, mb_x, mb_y, frame );
+                float qp_adj = powf( energy + 1, 0.125f );
+                frame->f_qp_offset[mb_x + mb_y*h->mb.i_mb_stride] = qp_adj;
+                avg_adj += qp_adj;
+                avg_adj_pow2 += qp_adj * qp_adj;
+            }
+        avg_adj /= h->mb.i_mb_count;
+        avg_adj_pow2 /= h->mb.i_mb_count;
+        strength = h->param.rc.f_aq_strength * avg_adj / bit_depth_correction;
+        avg_adj = avg_adj - 0.5f * (avg_adj_pow2 - (14.f * bit_depth_correction)) / avg_adj;
 
         for( int mb_y = 0; mb_y < h->mb.i_mb_height; mb_y++ )
             for( int mb_x = 0; mb_x < h->mb.i_mb_width; mb_x++ )
             {
-                float qp_adj;
                 int mb_xy = mb_x + mb_y*h->mb.i_mb_stride;
-                if( h->param.rc.i_aq_mode == X264_AQ_AUTOVARIANCE )
-                {
-                    qp_adj = frame->f_qp_offset[mb_xy];
-                    qp_adj = strength * (qp_adj - avg_adj);
-                }
-                else
-                {
-                    uint32_t energy = x264_ac_energy_mb( h, mb_x, mb_y, frame );
-                    qp_adj = strength * (x264_log2( X264_MAX(energy, 1) ) - (14.427f + 2*(BIT_DEPTH-8)));
-                }
-                if( quant_offsets )
-                    qp_adj += quant_offsets[mb_xy];
-                frame->f_qp_offset[mb_xy] =
-                frame->f_qp_offset_aq[mb_xy] = qp_adj;
-                if( h->frames.b_have_lowres )
-                    frame->i_inv_qscale_factor[mb_xy] = x264_exp2fix8(qp_adj);
+                x264_adaptive_quant_set( h, frame, quant_offsets, mb_xy, strength * (frame->f_qp_offset[mb_xy] - avg_adj) );
             }
     }
 
@@ -534,6 +557,421 @@ static void x264_macroblock_tree_rescale( x264_t *h, x264_ratecontrol_t *rc, flo
     }
 }
 
+/* Compact MB-tree stats: see encoder/stats.h for the layout. */
+
+#define MBTREE_PREFETCH 4
+
+enum
+{
+    MBTREE_SLOT_EMPTY,
+    MBTREE_SLOT_LOADING,
+    MBTREE_SLOT_READY,
+    MBTREE_SLOT_ERROR
+};
+
+typedef struct
+{
+    int frame;
+    int status;
+    uint8_t type;
+    int16_t *qp;                /* quantized qp offsets */
+} mbtree_slot_t;
+
+struct mbtree_reader_t
+{
+    FILE *fh;
+    int mb_width;
+    int mb_height;
+    int qp_shift;
+    int num_frames;             /* highest frame with a record + 1 */
+    uint64_t *offset;           /* record offset of each frame in display order */
+    uint32_t *size;             /* coded size of each frame, 0 if it has no record */
+    uint8_t *buf;
+    uint32_t buf_size;
+
+    /* frames are decoded ahead of x264_macroblock_tree_read, in display order */
+    mbtree_slot_t slot[MBTREE_PREFETCH];
+    int next;                   /* next frame for the loader to consider */
+    int b_exit;
+    int b_thread;
+    x264_pthread_t thread;
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t cv;
+};
+
+/* median edge detector on the left, top and top-left neighbours */
+static ALWAYS_INLINE int mbtree_predict( int16_t *v, int x, int y, int width )
+{
+    if( !y )
+        return x ? v[-1] : 0;
+    if( !x )
+        return v[-width];
+    int a = v[-1], b = v[-width], c = v[-width-1];
+    int max = X264_MAX( a, b );
+    int min = X264_MIN( a, b );
+    return c >= max ? min : c <= min ? max : a + b - c;
+}
+
+#define MBTREE_RICE_UPDATE( sum, count, r )\
+{\
+    sum += abs( r );\
+    if( ++count == 64 )\
+    {\
+        sum >>= 1;\
+        count >>= 1;\
+    }\
+}
+
+static void mbtree_encode( bs_t *s, int16_t *v, int width, int height )
+{
+    int sum = 4, count = 1;
+    for( int y = 0; y < height; y++ )
+        for( int x = 0; x < width; x++, v++ )
+        {
+            int r = *v - mbtree_predict( v, x, y, width );
+            uint32_t u = r >= 0 ? 2*r : -2*r-1;
+            int k = 0;
+            while( (count << k) < sum )
+                k++;
+            if( (u >> k) < X264_MBTREE_RICE_LIMIT )
+            {
+                bs_write( s, (u >> k) + 1, 1 );
+                if( k )
+                    bs_write( s, k, u & ((1 << k) - 1) );
+            }
+            else
+            {
+                bs_write( s, X264_MBTREE_RICE_LIMIT + 1, 1 );
+                bs_write( s, X264_MBTREE_ESC_BITS, u );
+            }
+            MBTREE_RICE_UPDATE( sum, count, r );
+        }
+}
+
+typedef struct
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t cache;
+    int bits;
+} mbtree_bits_t;
+
+static ALWAYS_INLINE uint32_t mbtree_read_bits( mbtree_bits_t *b, int n )
+{
+    while( b->bits < n )
+    {
+        b->cache = (b->cache << 8) | (b->p < b->end ? *b->p : 0);
+        b->p++;
+        b->bits += 8;
+    }
+    b->bits -= n;
+    return (b->cache >> b->bits) & ((1ULL << n) - 1);
+}
+
+static int mbtree_decode( const uint8_t *buf, int size, int16_t *v, int width, int height )
+{
+    mbtree_bits_t b = { buf, buf + size, 0, 0 };
+    int sum = 4, count = 1;
+    for( int y = 0; y < height; y++ )
+        for( int x = 0; x < width; x++, v++ )
+        {
+            uint32_t u, q = 0;
+            int k = 0;
+            while( (count << k) < sum )
+                k++;
+            while( q <= X264_MBTREE_RICE_LIMIT && !mbtree_read_bits( &b, 1 ) )
+                q++;
+            if( q < X264_MBTREE_RICE_LIMIT )
+                u = (q << k) | (k ? mbtree_read_bits( &b, k ) : 0);
+            else if( q == X264_MBTREE_RICE_LIMIT )
+                u = mbtree_read_bits( &b, X264_MBTREE_ESC_BITS );
+            else
+                return -1;
+            int r = u & 1 ? -(int)((u + 1) >> 1) : (int)(u >> 1);
+            *v = mbtree_predict( v, x, y, width ) + r;
+            MBTREE_RICE_UPDATE( sum, count, r );
+        }
+    /* running past the end pads with zeros, which must not have been needed */
+    return (b.p - buf) * 8 - b.bits > size * 8 ? -1 : 0;
+}
+
+static int mbtree_write_compact( x264_t *h, uint8_t i_type )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    int16_t *v = (int16_t*)rc->mbtree.qp_buffer[0];
+    x264_mbtree_record_t rec = {0};
+    bs_t s;
+
+    for( int i = 0; i < h->mb.i_mb_count; i++ )
+        v[i] = ((int)(h->fenc->f_qp_offset[i]*256.0) + ((1 << X264_MBTREE_QP_SHIFT) >> 1)) >> X264_MBTREE_QP_SHIFT;
+    bs_init( &s, rc->mbtree.bs_buffer, rc->mbtree.bs_size );
+    mbtree_encode( &s, v, h->mb.i_mb_width, h->mb.i_mb_height );
+    bs_flush( &s );
+
+    rec.i_frame = h->fenc->i_frame;
+    rec.size = s.p - s.p_start;
+    rec.type = i_type;
+    if( fwrite( &rec, sizeof(rec), 1, rc->p_mbtree_stat_file_out ) != 1 ||
+        fwrite( rc->mbtree.bs_buffer, 1, rec.size, rc->p_mbtree_stat_file_out ) != rec.size )
+        return -1;
+    return 0;
+}
+
+static int mbtree_write_header( x264_t *h, FILE *f, uint32_t num_records, uint64_t index_offset )
+{
+    x264_mbtree_header_t hdr = {{0}};
+    memcpy( hdr.magic, X264_MBTREE_MAGIC, 8 );
+    hdr.version = X264_MBTREE_VERSION;
+    hdr.byte_order = X264_STATS_BYTE_ORDER;
+    hdr.header_size = sizeof(hdr);
+    hdr.mb_width = h->mb.i_mb_width;
+    hdr.mb_height = h->mb.i_mb_height;
+    hdr.qp_shift = X264_MBTREE_QP_SHIFT;
+    hdr.num_records = num_records;
+    hdr.index_offset = index_offset;
+    if( fseek( f, 0, SEEK_SET ) < 0 )
+        return -1;
+    return fwrite( &hdr, sizeof(hdr), 1, f ) == 1 ? 0 : -1;
+}
+
+/* Like the binary stats, the index is built by walking the records once they are all written. */
+static int mbtree_finish_compact( x264_t *h )
+{
+    FILE *f = h->rc->p_mbtree_stat_file_out;
+    x264_mbtree_index_t *index = NULL;
+    x264_mbtree_record_t rec;
+    int num_records = 0, max_records = 0;
+    uint64_t offset = sizeof(x264_mbtree_header_t);
+    int b_error = fseek( f, offset, SEEK_SET ) < 0;
+
+    while( !b_error && fread( &rec, sizeof(rec), 1, f ) == 1 )
+    {
+        if( num_records == max_records )
+        {
+            x264_mbtree_index_t *tmp = x264_malloc( (max_records = 2*max_records + 256) * sizeof(x264_mbtree_index_t) );
+            b_error = !tmp;
+            if( tmp && num_records )
+                memcpy( tmp, index, num_records * sizeof(x264_mbtree_index_t) );
+            x264_free( index );
+            index = tmp;
+            if( b_error )
+                break;
+        }
+        index[num_records].i_frame = rec.i_frame;
+        index[num_records].size = rec.size;
+        index[num_records++].offset = offset;
+        offset += sizeof(rec) + rec.size;
+        b_error = fseek( f, offset, SEEK_SET ) < 0;
+    }
+    b_error = b_error || fseek( f, offset, SEEK_SET ) < 0
+                      || fwrite( index, sizeof(x264_mbtree_index_t), num_records, f ) != num_records
+                      || mbtree_write_header( h, f, num_records, offset ) < 0;
+    x264_free( index );
+    return b_error ? -1 : 0;
+}
+
+static int mbtree_load( mbtree_reader_t *r, mbtree_slot_t *slot )
+{
+    x264_mbtree_record_t rec;
+    int frame = slot->frame;
+    if( fseek( r->fh, r->offset[frame], SEEK_SET ) < 0 ||
+        fread( &rec, sizeof(rec), 1, r->fh ) != 1 || rec.i_frame != frame || rec.size != r->size[frame] ||
+        fread( r->buf, 1, rec.size, r->fh ) != rec.size )
+        return -1;
+    slot->type = rec.type;
+    return mbtree_decode( r->buf, rec.size, slot->qp, r->mb_width, r->mb_height );
+}
+
+#if HAVE_THREAD
+static void *mbtree_reader_thread( mbtree_reader_t *r )
+{
+    x264_pthread_mutex_lock( &r->mutex );
+    while( !r->b_exit )
+    {
+        mbtree_slot_t *slot = NULL;
+        while( r->next < r->num_frames && !r->size[r->next] )
+            r->next++;
+        for( int i = 0; i < MBTREE_PREFETCH && !slot; i++ )
+            if( r->slot[i].status == MBTREE_SLOT_EMPTY )
+                slot = &r->slot[i];
+        if( !slot || r->next >= r->num_frames )
+        {
+            x264_pthread_cond_wait( &r->cv, &r->mutex );
+            continue;
+        }
+        slot->frame = r->next++;
+        slot->status = MBTREE_SLOT_LOADING;
+        x264_pthread_mutex_unlock( &r->mutex );
+        int ret = mbtree_load( r, slot );
+        x264_pthread_mutex_lock( &r->mutex );
+        slot->status = ret < 0 ? MBTREE_SLOT_ERROR : MBTREE_SLOT_READY;
+        x264_pthread_cond_broadcast( &r->cv );
+    }
+    x264_pthread_mutex_unlock( &r->mutex );
+    return NULL;
+}
+#endif
+
+/* Returns the decoded slot for frame; the caller must hand it back with mbtree_reader_release. */
+static mbtree_slot_t *mbtree_reader_get( mbtree_reader_t *r, int frame )
+{
+    mbtree_slot_t *slot = NULL;
+    if( frame < 0 || frame >= r->num_frames || !r->size[frame] )
+        return NULL;
+    if( !r->b_thread )
+    {
+        slot = &r->slot[0];
+        slot->frame = frame;
+        slot->status = mbtree_load( r, slot ) < 0 ? MBTREE_SLOT_ERROR : MBTREE_SLOT_READY;
+        return slot;
+    }
+    x264_pthread_mutex_lock( &r->mutex );
+    while( !slot )
+    {
+        int b_loading = 0;
+        for( int i = 0; i < MBTREE_PREFETCH; i++ )
+        {
+            mbtree_slot_t *s = &r->slot[i];
+            if( s->status == MBTREE_SLOT_EMPTY )
+                continue;
+            if( s->frame == frame )
+                slot = s;
+            else if( s->status == MBTREE_SLOT_LOADING )
+                b_loading = 1;
+            /* input is in display order, so earlier frames won't be asked for again */
+            else if( s->frame < frame )
+                s->status = MBTREE_SLOT_EMPTY;
+        }
+        if( slot && slot->status != MBTREE_SLOT_LOADING )
+            break;
+        slot = NULL;
+        if( r->next > frame && !b_loading )
+        {
+            /* the loader is past this frame: drop the prefetched frames and restart from it */
+            for( int i = 0; i < MBTREE_PREFETCH; i++ )
+                r->slot[i].status = MBTREE_SLOT_EMPTY;
+            r->next = frame;
+        }
+        x264_pthread_cond_broadcast( &r->cv );
+        x264_pthread_cond_wait( &r->cv, &r->mutex );
+    }
+    x264_pthread_mutex_unlock( &r->mutex );
+    return slot;
+}
+
+static void mbtree_reader_release( mbtree_reader_t *r, mbtree_slot_t *slot )
+{
+    if( !r->b_thread )
+        return;
+    x264_pthread_mutex_lock( &r->mutex );
+    slot->status = MBTREE_SLOT_EMPTY;
+    x264_pthread_cond_broadcast( &r->cv );
+    x264_pthread_mutex_unlock( &r->mutex );
+}
+
+static void mbtree_reader_close( mbtree_reader_t *r )
+{
+    if( r->b_thread )
+    {
+        x264_pthread_mutex_lock( &r->mutex );
+        r->b_exit = 1;
+        x264_pthread_cond_broadcast( &r->cv );
+        x264_pthread_mutex_unlock( &r->mutex );
+        x264_pthread_join( r->thread, NULL );
+        x264_pthread_cond_destroy( &r->cv );
+        x264_pthread_mutex_destroy( &r->mutex );
+    }
+    for( int i = 0; i < MBTREE_PREFETCH; i++ )
+        x264_free( r->slot[i].qp );
+    x264_free( r->offset );
+    x264_free( r->size );
+    x264_free( r->buf );
+    if( r->fh )
+        fclose( r->fh );
+    x264_free( r );
+}
+
+/* Takes over rc->p_mbtree_stat_file_in if it is a compact MB-tree file, otherwise leaves it for
+ * the raw reader. */
+static int mbtree_reader_open( x264_t *h, x264_ratecontrol_t *rc )
+{
+    FILE *f = rc->p_mbtree_stat_file_in;
+    x264_mbtree_header_t hdr;
+    x264_mbtree_index_t *index = NULL;
+    mbtree_reader_t *r;
+
+    if( fread( &hdr, sizeof(hdr), 1, f ) != 1 || memcmp( hdr.magic, X264_MBTREE_MAGIC, 8 ) )
+        return fseek( f, 0, SEEK_SET );
+
+    if( hdr.version != X264_MBTREE_VERSION || hdr.byte_order != X264_STATS_BYTE_ORDER ||
+        hdr.header_size < sizeof(hdr) || hdr.qp_shift > 8 )
+    {
+        x264_log( h, X264_LOG_ERROR, "unsupported MB-tree stats file\n" );
+        return -1;
+    }
+    if( !hdr.num_records )
+    {
+        x264_log( h, X264_LOG_ERROR, "Incomplete MB-tree stats file.\n" );
+        return -1;
+    }
+    if( hdr.mb_width * hdr.mb_height != (uint32_t)rc->mbtree.src_mb_count )
+    {
+        x264_log( h, X264_LOG_ERROR, "MB-tree stats resolution doesn't match the stats file\n" );
+        return -1;
+    }
+
+    CHECKED_MALLOCZERO( r, sizeof(mbtree_reader_t) );
+    rc->mbtree.reader = r;
+    r->mb_width = hdr.mb_width;
+    r->mb_height = hdr.mb_height;
+    r->qp_shift = hdr.qp_shift;
+
+    CHECKED_MALLOC( index, hdr.num_records * sizeof(x264_mbtree_index_t) );
+    if( fseek( f, hdr.index_offset, SEEK_SET ) < 0 ||
+        fread( index, sizeof(x264_mbtree_index_t), hdr.num_records, f ) != hdr.num_records )
+        goto damaged;
+    for( int i = 0; i < hdr.num_records; i++ )
+    {
+        if( index[i].i_frame < 0 || index[i].i_frame >= rc->num_entries || !index[i].size )
+            goto damaged;
+        r->num_frames = X264_MAX( r->num_frames, index[i].i_frame + 1 );
+        r->buf_size = X264_MAX( r->buf_size, index[i].size );
+    }
+    CHECKED_MALLOCZERO( r->offset, r->num_frames * sizeof(uint64_t) );
+    CHECKED_MALLOCZERO( r->size, r->num_frames * sizeof(uint32_t) );
+    for( int i = 0; i < hdr.num_records; i++ )
+    {
+        r->offset[index[i].i_frame] = index[i].offset;
+        r->size[index[i].i_frame] = index[i].size;
+    }
+    x264_free( index );
+    index = NULL;
+
+    CHECKED_MALLOC( r->buf, r->buf_size );
+    for( int i = 0; i < MBTREE_PREFETCH; i++ )
+        CHECKED_MALLOC( r->slot[i].qp, rc->mbtree.src_mb_count * sizeof(int16_t) );
+    r->fh = f;
+    rc->p_mbtree_stat_file_in = NULL;
+
+#if HAVE_THREAD
+    if( x264_pthread_mutex_init( &r->mutex, NULL ) || x264_pthread_cond_init( &r->cv, NULL ) )
+        return -1;
+    if( x264_pthread_create( &r->thread, NULL, (void*)mbtree_reader_thread, r ) )
+    {
+        x264_pthread_cond_destroy( &r->cv );
+        x264_pthread_mutex_destroy( &r->mutex );
+        return -1;
+    }
+    r->b_thread = 1;
+#endif
+    return 0;
+damaged:
+    x264_log( h, X264_LOG_ERROR, "MB-tree stats index is damaged\n" );
+fail:
+    x264_free( index );
+    return -1;
+}
+
 int x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offsets )
 {
     x264_ratecontrol_t *rc = h->rc;
@@ -541,38 +979,57 @@ int x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offs
 
     if( rc->entry[frame->i_frame].kept_as_ref )
     {
-        uint8_t i_type;
-        if( rc->mbtree.qpbuf_pos < 0 )
+        float *dst = rc->mbtree.rescale_enabled ? rc->mbtree.scale_buffer[0] : frame->f_qp_offset;
+        if( rc->mbtree.reader )
         {
-            do
+            mbtree_slot_t *slot = mbtree_reader_get( rc->mbtree.reader, frame->i_frame );
+            if( !slot || slot->status == MBTREE_SLOT_ERROR )
+                goto fail;
+            if( slot->type != i_type_actual )
             {
-                rc->mbtree.qpbuf_pos++;
+                x264_log( h, X264_LOG_ERROR, "MB-tree frametype %d doesn't match actual frametype %d.\n", slot->type, i_type_actual );
+                mbtree_reader_release( rc->mbtree.reader, slot );
+                return -1;
+            }
+            float scale = (1 << rc->mbtree.reader->qp_shift) * (1.f/256.f);
+            for( int i = 0; i < rc->mbtree.src_mb_count; i++ )
+                dst[i] = slot->qp[i] * scale;
+            mbtree_reader_release( rc->mbtree.reader, slot );
+        }
+        else
+        {
+            uint8_t i_type;
+            if( rc->mbtree.qpbuf_pos < 0 )
+            {
+                do
+                {
+                    rc->mbtree.qpbuf_pos++;
 
-                if( !fread( &i_type, 1, 1, rc->p_mbtree_stat_file_in ) )
-                    goto fail;
-                if( fread( rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos], sizeof(uint16_t), rc->mbtree.src_mb_count, rc->p_mbtree_stat_file_in ) != rc->mbtree.src_mb_count )
-                    goto fail;
+                    if( !fread( &i_type, 1, 1, rc->p_mbtree_stat_file_in ) )
+                        goto fail;
+                    if( fread( rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos], sizeof(uint16_t), rc->mbtree.src_mb_count, rc->p_mbtree_stat_file_in ) != rc->mbtree.src_mb_count )
+                        goto fail;
 
-                if( i_type != i_type_actual && rc->mbtree.qpbuf_pos == 1 )
-                {
-                    x264_log( h, X264_LOG_ERROR, "MB-tree frametype %d doesn't match actual frametype %d.\n", i_type, i_type_actual );
-                    return -1;
-                }
-            } while( i_type != i_type_actual );
-        }
+                    if( i_type != i_type_actual && rc->mbtree.qpbuf_pos == 1 )
+                    {
+                        x264_log( h, X264_LOG_ERROR, "MB-tree frametype %d doesn't match actual frametype %d.\n", i_type, i_type_actual );
+                        return -1;
+                    }
+                } while( i_type != i_type_actual );
+            }
 
-        float *dst = rc->mbtree.rescale_enabled ? rc->mbtree.scale_buffer[0] : frame->f_qp_offset;
-        for( int i = 0; i < rc->mbtree.src_mb_count; i++ )
-        {
-            int16_t qp_fix8 = endian_fix16( rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos][i] );
-            dst[i] = qp_fix8 * (1.f/256.f);
+            for( int i = 0; i < rc->mbtree.src_mb_count; i++ )
+            {
+                int16_t qp_fix8 = endian_fix16( rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos][i] );
+                dst[i] = qp_fix8 * (1.f/256.f);
+            }
+            rc->mbtree.qpbuf_pos--;
         }
         if( rc->mbtree.rescale_enabled )
             x264_macroblock_tree_rescale( h, rc, frame->f_qp_offset );
         if( h->frames.b_have_lowres )
             for( int i = 0; i < h->mb.i_mb_count; i++ )
                 frame->i_inv_qscale_factor[i] = x264_exp2fix8( frame->f_qp_offset[i] );
-        rc->mbtree.qpbuf_pos--;
     }
     else
         x264_stack_align( x264_adaptive_quant_frame, h, frame, quant_offsets );
@@ -629,6 +1086,224 @@ static char *x264_strcat_filename( char *input, char *suffix )
     return output;
 }
 
+static int stats_frame_type( ratecontrol_entry_t *rce, char pict_type )
+{
+    if( pict_type != 'b' )
+        rce->kept_as_ref = 1;
+    switch( pict_type )
+    {
+        case 'I':
+            rce->frame_type = X264_TYPE_IDR;
+            rce->pict_type  = SLICE_TYPE_I;
+            break;
+        case 'i':
+            rce->frame_type = X264_TYPE_I;
+            rce->pict_type  = SLICE_TYPE_I;
+            break;
+        case 'P':
+            rce->frame_type = X264_TYPE_P;
+            rce->pict_type  = SLICE_TYPE_P;
+            break;
+        case 'B':
+            rce->frame_type = X264_TYPE_BREF;
+            rce->pict_type  = SLICE_TYPE_B;
+            break;
+        case 'b':
+            rce->frame_type = X264_TYPE_B;
+            rce->pict_type  = SLICE_TYPE_B;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+static int stats_check_binary( x264_t *h, const x264_stats_header_t *hdr, size_t size )
+{
+    if( hdr->version != X264_STATS_VERSION )
+    {
+        x264_log( h, X264_LOG_ERROR, "unsupported stats file version %u\n", hdr->version );
+        return -1;
+    }
+    if( hdr->byte_order != X264_STATS_BYTE_ORDER )
+    {
+        x264_log( h, X264_LOG_ERROR, "stats file was written on a machine with a different byte order\n" );
+        return -1;
+    }
+    if( !hdr->num_frames )
+    {
+        x264_log( h, X264_LOG_ERROR, "stats file is incomplete or empty\n" );
+        return -1;
+    }
+    const char *opts = (const char*)hdr + hdr->header_size;
+    if( hdr->header_size < sizeof(x264_stats_header_t) || hdr->record_size < sizeof(x264_stats_record_t) ||
+        !hdr->options_size || (uint64_t)hdr->header_size + hdr->options_size > size || opts[hdr->options_size-1] ||
+        (hdr->records_offset & 7) || hdr->records_offset + (uint64_t)hdr->num_frames * hdr->record_size > size ||
+        (hdr->index_offset & 3) || hdr->index_offset + (uint64_t)hdr->num_frames * sizeof(int32_t) > size )
+    {
+        x264_log( h, X264_LOG_ERROR, "stats file header is damaged\n" );
+        return -1;
+    }
+    return 0;
+}
+
+/* Binary records are fixed-size and indexed by display order, so this is a straight copy. */
+static int stats_read_binary( x264_t *h, const x264_stats_header_t *hdr, float res_factor, float res_factor_bits, double *total_qp_aq )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    const uint8_t *records = (const uint8_t*)hdr + hdr->records_offset;
+    const int32_t *index = (const int32_t*)((const uint8_t*)hdr + hdr->index_offset);
+
+    for( int i = 0; i < rc->num_entries; i++ )
+    {
+        ratecontrol_entry_t *rce = &rc->entry[i];
+        const x264_stats_record_t *r;
+
+        if( index[i] < 0 || index[i] >= rc->num_entries )
+        {
+            x264_log( h, X264_LOG_ERROR, "frame %d is missing from stats file\n", i );
+            return -1;
+        }
+        r = (const x264_stats_record_t*)(records + (size_t)index[i] * hdr->record_size);
+        if( r->i_frame_in != i || r->refs > 16 || stats_frame_type( rce, r->type ) < 0 )
+        {
+            x264_log( h, X264_LOG_ERROR, "statistics are damaged at record %d\n", index[i] );
+            return -1;
+        }
+
+        rce->i_duration     = r->i_duration;
+        rce->i_cpb_duration = r->i_cpb_duration;
+        rce->tex_bits  = r->i_tex_bits * res_factor_bits;
+        rce->mv_bits   = r->i_mv_bits * res_factor_bits;
+        rce->misc_bits = r->i_misc_bits * res_factor_bits;
+        rce->i_count   = r->i_mb_count_i * res_factor;
+        rce->p_count   = r->i_mb_count_p * res_factor;
+        rce->s_count   = r->i_mb_count_skip * res_factor;
+        rce->direct_mode = r->direct;
+        rce->refs = r->refs;
+        memcpy( rce->refcount, r->refcount, r->refs * sizeof(int) );
+
+        rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
+        if( r->weights == 3 || r->weights == 8 )
+        {
+            rce->i_weight_denom[0] = r->weight_denom[0];
+            rce->weight[0][0] = r->weight[0][0];
+            rce->weight[0][1] = r->weight[0][1];
+        }
+        if( r->weights == 8 )
+        {
+            rce->i_weight_denom[1] = r->weight_denom[1];
+            memcpy( rce->weight[1], r->weight[1], 2 * sizeof(int16_t) );
+            memcpy( rce->weight[2], r->weight[2], 2 * sizeof(int16_t) );
+        }
+
+        rce->qscale = qp2qscale( h, r->f_qp_rc );
+        *total_qp_aq += r->f_qp_aq;
+    }
+    return 0;
+}
+
+static int stats_write_header( FILE *f, uint32_t options_size, uint32_t num_frames )
+{
+    x264_stats_header_t hdr = {{0}};
+    memcpy( hdr.magic, X264_STATS_MAGIC, 8 );
+    hdr.version = X264_STATS_VERSION;
+    hdr.byte_order = X264_STATS_BYTE_ORDER;
+    hdr.header_size = sizeof(x264_stats_header_t);
+    hdr.record_size = sizeof(x264_stats_record_t);
+    hdr.num_frames = num_frames;
+    hdr.options_size = options_size;
+    hdr.records_offset = hdr.header_size + options_size;
+    hdr.index_offset = hdr.records_offset + (uint64_t)num_frames * hdr.record_size;
+    if( fseek( f, 0, SEEK_SET ) < 0 )
+        return -1;
+    return fwrite( &hdr, sizeof(hdr), 1, f ) == 1 ? 0 : -1;
+}
+
+/* The header is written with num_frames = 0 up front so that an aborted pass can't be mistaken
+ * for a complete one; the index and the final header are only written here, once all records are in. */
+static int stats_finish_binary( x264_t *h )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    FILE *f = rc->p_stat_file_out;
+    uint64_t records_offset = sizeof(x264_stats_header_t) + rc->stat_options_size;
+    x264_stats_record_t r;
+    int32_t *index;
+    int num_frames;
+
+    if( fseek( f, 0, SEEK_END ) < 0 )
+        return -1;
+    num_frames = (ftell( f ) - records_offset) / sizeof(x264_stats_record_t);
+    if( num_frames <= 0 )
+        return 0;
+    index = x264_malloc( num_frames * sizeof(int32_t) );
+    if( !index )
+        return -1;
+    for( int i = 0; i < num_frames; i++ )
+        index[i] = -1;
+    int b_error = fseek( f, records_offset, SEEK_SET ) < 0;
+    for( int i = 0; i < num_frames && !b_error; i++ )
+    {
+        b_error = fread( &r, sizeof(r), 1, f ) != 1;
+        if( !b_error && r.i_frame_in >= 0 && r.i_frame_in < num_frames )
+            index[r.i_frame_in] = i;
+    }
+    b_error = b_error || fseek( f, records_offset + (uint64_t)num_frames * sizeof(r), SEEK_SET ) < 0
+                      || fwrite( index, sizeof(int32_t), num_frames, f ) != num_frames
+                      || stats_write_header( f, rc->stat_options_size, num_frames ) < 0;
+    x264_free( index );
+    return b_error ? -1 : 0;
+}
+
+static int stats_write_binary( x264_t *h, char c_type, char c_direct )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    x264_stats_record_t r = {0};
+
+    r.i_frame_in      = h->fenc->i_frame;
+    r.i_frame_out     = h->i_frame;
+    r.type            = c_type;
+    r.direct          = c_direct;
+    r.i_duration      = h->fenc->i_duration;
+    r.i_cpb_duration  = h->fenc->i_cpb_duration;
+    r.f_qp_rc         = rc->qpa_rc;
+    r.f_qp_aq         = h->fdec->f_qp_avg_aq;
+    r.i_tex_bits      = h->stat.frame.i_tex_bits;
+    r.i_mv_bits       = h->stat.frame.i_mv_bits;
+    r.i_misc_bits     = h->stat.frame.i_misc_bits;
+    r.i_mb_count_i    = h->stat.frame.i_mb_count_i;
+    r.i_mb_count_p    = h->stat.frame.i_mb_count_p;
+    r.i_mb_count_skip = h->stat.frame.i_mb_count_skip;
+
+    /* Only write information for reference reordering once. */
+    int use_old_stats = h->param.rc.b_stat_read && rc->rce->refs > 1;
+    r.refs = use_old_stats ? rc->rce->refs : X264_MIN( h->i_ref[0], 16 );
+    for( int i = 0; i < r.refs; i++ )
+        r.refcount[i] = use_old_stats         ? rc->rce->refcount[i]
+                      : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
+                                              + h->stat.frame.i_mb_count_ref[0][i*2+1]
+                      :                         h->stat.frame.i_mb_count_ref[0][i];
+
+    if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
+    {
+        r.weights = 3;
+        r.weight_denom[0] = h->sh.weight[0][0].i_denom;
+        r.weight[0][0] = h->sh.weight[0][0].i_scale;
+        r.weight[0][1] = h->sh.weight[0][0].i_offset;
+        if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
+        {
+            r.weights = 8;
+            r.weight_denom[1] = h->sh.weight[0][1].i_denom;
+            r.weight[1][0] = h->sh.weight[0][1].i_scale;
+            r.weight[1][1] = h->sh.weight[0][1].i_offset;
+            r.weight[2][0] = h->sh.weight[0][2].i_scale;
+            r.weight[2][1] = h->sh.weight[0][2].i_offset;
+        }
+    }
+
+    return fwrite( &r, sizeof(r), 1, rc->p_stat_file_out ) == 1 ? 0 : -1;
+}
+
 void x264_ratecontrol_init_reconfigurable( x264_t *h, int b_init )
 {
     x264_ratecontrol_t *rc = h->rc;
@@ -652,14 +1327,20 @@ void x264_ratecontrol_init_reconfigurable( x264_t *h, int b_init )
         if( rc->b_vbv_min_rate )
             h->param.rc.i_vbv_max_bitrate = h->param.rc.i_bitrate;
 
+        int row_buffer_size = h->param.rc.i_vbv_buffer_size;
         if( h->param.rc.i_vbv_buffer_size < (int)(h->param.rc.i_vbv_max_bitrate / rc->fps) )
         {
             h->param.rc.i_vbv_buffer_size = h->param.rc.i_vbv_max_bitrate / rc->fps;
-            x264_log( h, X264_LOG_WARNING, "VBV buffer size cannot be smaller than one frame, using %d kbit\n",
-                      h->param.rc.i_vbv_buffer_size );
+            if( h->param.rc.b_vbv_rows )
+                x264_log( h, X264_LOG_INFO, "VBV buffer size is smaller than one frame, using %d kbit for frames "
+                          "and %d kbit for rows\n", h->param.rc.i_vbv_buffer_size, row_buffer_size );
+            else
+                x264_log( h, X264_LOG_WARNING, "VBV buffer size cannot be smaller than one frame, using %d kbit\n",
+                          h->param.rc.i_vbv_buffer_size );
         }
 
         int kilobit_size = h->param.i_avcintra_class ? 1024 : 1000;
+        rc->row_buffer_size = (double)row_buffer_size * kilobit_size;
         int vbv_buffer_size = h->param.rc.i_vbv_buffer_size * kilobit_size;
         int vbv_max_bitrate = h->param.rc.i_vbv_max_bitrate * kilobit_size;
 
@@ -731,6 +1412,7 @@ void x264_ratecontrol_init_reconfigurable( x264_t *h, int b_init )
                 h->param.rc.f_vbv_buffer_init = x264_clip3f( h->param.rc.f_vbv_buffer_init / h->param.rc.i_vbv_buffer_size, 0, 1 );
             h->param.rc.f_vbv_buffer_init = x264_clip3f( X264_MAX( h->param.rc.f_vbv_buffer_init, rc->buffer_rate / rc->buffer_size ), 0, 1);
             rc->buffer_fill_final = rc->buffer_size * h->param.rc.f_vbv_buffer_init * h->sps->vui.i_time_scale;
+            rc->row_buffer_fill = rc->row_buffer_size * h->param.rc.f_vbv_buffer_init;
             rc->b_vbv = 1;
             rc->b_vbv_min_rate = !rc->b_2pass
                           && h->param.rc.i_rc_method == X264_RC_ABR
@@ -868,16 +1550,36 @@ int x264_ratecontrol_new( x264_t *h )
     /* Load stat file and init 2pass algo */
     if( h->param.rc.b_stat_read )
     {
-        char *p, *stats_in, *stats_buf;
+        char *p, *opts, *stats_in = NULL, *stats_buf = NULL;
+        const x264_stats_header_t *stats_hdr = NULL;
 
         /* read 1st pass stats */
         assert( h->param.rc.psz_stat_in );
-        stats_buf = stats_in = x264_slurp_file( h->param.rc.psz_stat_in );
-        if( !stats_buf )
+        rc->stat_map = x264_map_file( h->param.rc.psz_stat_in, &rc->stat_map_size, &rc->b_stat_mapped );
+        if( !rc->stat_map )
         {
             x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't open stats file\n" );
             return -1;
         }
+        if( rc->stat_map_size >= sizeof(x264_stats_header_t) && !memcmp( rc->stat_map, X264_STATS_MAGIC, 8 ) )
+        {
+            stats_hdr = rc->stat_map;
+            if( stats_check_binary( h, stats_hdr, rc->stat_map_size ) < 0 )
+                return -1;
+            opts = (char*)stats_hdr + stats_hdr->header_size;
+        }
+        else
+        {
+            /* the text parser works in place on a terminated copy */
+            x264_unmap_file( rc->stat_map, rc->stat_map_size, rc->b_stat_mapped );
+            rc->stat_map = NULL;
+            opts = stats_buf = x264_slurp_file( h->param.rc.psz_stat_in );
+            if( !stats_buf )
+            {
+                x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't open stats file\n" );
+                return -1;
+            }
+        }
         if( h->param.rc.b_mb_tree )
         {
             char *mbtree_stats_in = x264_strcat_filename( h->param.rc.psz_stat_in, ".mbtree" );
@@ -893,7 +1595,7 @@ int x264_ratecontrol_new( x264_t *h )
         }
 
         /* check whether 1st pass options were compatible with current options */
-        if( strncmp( stats_buf, "#options:", 9 ) )
+        if( strncmp( opts, "#options:", 9 ) )
         {
             x264_log( h, X264_LOG_ERROR, "options list in stats file not valid\n" );
             return -1;
@@ -903,12 +1605,14 @@ int x264_ratecontrol_new( x264_t *h )
         {
             int i, j;
             uint32_t k, l;
-            char *opts = stats_buf;
-            stats_in = strchr( stats_buf, '\n' );
-            if( !stats_in )
-                return -1;
-            *stats_in = '\0';
-            stats_in++;
+            if( !stats_hdr )
+            {
+                stats_in = strchr( stats_buf, '\n' );
+                if( !stats_in )
+                    return -1;
+                *stats_in = '\0';
+                stats_in++;
+            }
             if( sscanf( opts, "#options: %dx%d", &i, &j ) != 2 )
             {
                 x264_log( h, X264_LOG_ERROR, "resolution specified in stats file not valid\n" );
@@ -993,10 +1697,15 @@ int x264_ratecontrol_new( x264_t *h )
         }
 
         /* find number of pics */
-        p = stats_in;
         int num_entries;
-        for( num_entries = -1; p; num_entries++ )
-            p = strchr( p + 1, ';' );
+        if( stats_hdr )
+            num_entries = stats_hdr->num_frames;
+        else
+        {
+            p = stats_in;
+            for( num_entries = -1; p; num_entries++ )
+                p = strchr( p + 1, ';' );
+        }
         if( !num_entries )
         {
             x264_log( h, X264_LOG_ERROR, "empty stats file\n" );
@@ -1031,7 +1740,9 @@ int x264_ratecontrol_new( x264_t *h )
         /* read stats */
         p = stats_in;
         double total_qp_aq = 0;
-        for( int i = 0; i < rc->num_entries; i++ )
+        if( stats_hdr && stats_read_binary( h, stats_hdr, res_factor, res_factor_bits, &total_qp_aq ) < 0 )
+            return -1;
+        for( int i = 0; !stats_hdr && i < rc->num_entries; i++ )
         {
             ratecontrol_entry_t *rce;
             int frame_number;
@@ -1094,32 +1805,8 @@ int x264_ratecontrol_new( x264_t *h )
                     rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
             }
 
-            if( pict_type != 'b' )
-                rce->kept_as_ref = 1;
-            switch( pict_type )
-            {
-                case 'I':
-                    rce->frame_type = X264_TYPE_IDR;
-                    rce->pict_type  = SLICE_TYPE_I;
-                    break;
-                case 'i':
-                    rce->frame_type = X264_TYPE_I;
-                    rce->pict_type  = SLICE_TYPE_I;
-                    break;
-                case 'P':
-                    rce->frame_type = X264_TYPE_P;
-                    rce->pict_type  = SLICE_TYPE_P;
-                    break;
-                case 'B':
-                    rce->frame_type = X264_TYPE_BREF;
-                    rce->pict_type  = SLICE_TYPE_B;
-                    break;
-                case 'b':
-                    rce->frame_type = X264_TYPE_B;
-                    rce->pict_type  = SLICE_TYPE_B;
-                    break;
-                default:  e = -1; break;
-            }
+            if( stats_frame_type( rce, pict_type ) < 0 )
+                e = -1;
             if( e < 13 )
             {
 parse_error:
@@ -1133,6 +1820,11 @@ parse_error:
         if( !h->param.b_stitchable )
             h->pps->i_pic_init_qp = SPEC_QP( (int)(total_qp_aq / rc->num_entries + 0.5) );
 
+        if( stats_hdr )
+        {
+            x264_unmap_file( rc->stat_map, rc->stat_map_size, rc->b_stat_mapped );
+            rc->stat_map = NULL;
+        }
         x264_free( stats_buf );
 
         if( h->param.rc.i_rc_method == X264_RC_ABR )
@@ -1152,7 +1844,9 @@ parse_error:
         if( !rc->psz_stat_file_tmpname )
             return -1;
 
-        rc->p_stat_file_out = x264_fopen( rc->psz_stat_file_tmpname, "wb" );
+        /* binary stats are read back on close to build the frame index */
+        int b_binary = h->param.rc.i_stat_format == X264_STATS_FORMAT_BINARY;
+        rc->p_stat_file_out = x264_fopen( rc->psz_stat_file_tmpname, b_binary ? "wb+" : "wb" );
         if( rc->p_stat_file_out == NULL )
         {
             x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't open stats file\n" );
@@ -1160,7 +1854,21 @@ parse_error:
         }
 
         p = x264_param2string( &h->param, 1 );
-        if( p )
+        if( b_binary )
+        {
+            static const uint8_t zero[8];
+            int len = strlen( "#options: " ) + (p ? strlen( p ) : 0);
+            rc->stat_options_size = (len + 8) & ~7;
+            if( stats_write_header( rc->p_stat_file_out, rc->stat_options_size, 0 ) < 0 ||
+                fprintf( rc->p_stat_file_out, "#options: %s", p ? p : "" ) < 0 ||
+                fwrite( zero, 1, rc->stat_options_size - len, rc->p_stat_file_out ) != rc->stat_options_size - len )
+            {
+                x264_free( p );
+                x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't write stats file\n" );
+                return -1;
+            }
+        }
+        else if( p )
             fprintf( rc->p_stat_file_out, "#options: %s\n", p );
         x264_free( p );
         if( h->param.rc.b_mb_tree && !h->param.rc.b_stat_read )
@@ -1170,7 +1878,7 @@ parse_error:
             if( !rc->psz_mbtree_stat_file_tmpname || !rc->psz_mbtree_stat_file_name )
                 return -1;
 
-            rc->p_mbtree_stat_file_out = x264_fopen( rc->psz_mbtree_stat_file_tmpname, "wb" );
+            rc->p_mbtree_stat_file_out = x264_fopen( rc->psz_mbtree_stat_file_tmpname, b_binary ? "wb+" : "wb" );
             if( rc->p_mbtree_stat_file_out == NULL )
             {
                 x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't open mbtree stats file\n" );
@@ -1188,6 +1896,20 @@ parse_error:
         }
         if( x264_macroblock_tree_rescale_init( h, rc ) < 0 )
             return -1;
+        if( rc->p_mbtree_stat_file_in && mbtree_reader_open( h, rc ) < 0 )
+            return -1;
+        /* binary stats come with compact MB-tree stats */
+        if( rc->p_mbtree_stat_file_out && h->param.rc.i_stat_format == X264_STATS_FORMAT_BINARY )
+        {
+            /* worst case: every value escaped */
+            rc->mbtree.bs_size = h->mb.i_mb_count * (X264_MBTREE_RICE_LIMIT + 1 + X264_MBTREE_ESC_BITS + 7) / 8 + 16;
+            CHECKED_MALLOC( rc->mbtree.bs_buffer, rc->mbtree.bs_size );
+            if( mbtree_write_header( h, rc->p_mbtree_stat_file_out, 0, 0 ) < 0 )
+            {
+                x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't write mbtree stats file\n" );
+                return -1;
+            }
+        }
     }
 
     for( int i = 0; i<h->param.i_threads; i++ )
@@ -1345,8 +2067,13 @@ void x264_ratecontrol_delete( x264_t *h )
     x264_ratecontrol_t *rc = h->rc;
     int b_regular_file;
 
+    if( !rc )
+        return;
+
     if( rc->p_stat_file_out )
     {
+        if( h->param.rc.i_stat_format == X264_STATS_FORMAT_BINARY && stats_finish_binary( h ) < 0 )
+            x264_log( h, X264_LOG_ERROR, "failed to write stats file index\n" );
         b_regular_file = x264_is_regular_file( rc->p_stat_file_out );
         fclose( rc->p_stat_file_out );
         if( h->i_frame >= rc->num_entries && b_regular_file )
@@ -1359,6 +2086,8 @@ void x264_ratecontrol_delete( x264_t *h )
     }
     if( rc->p_mbtree_stat_file_out )
     {
+        if( rc->mbtree.bs_buffer && mbtree_finish_compact( h ) < 0 )
+            x264_log( h, X264_LOG_ERROR, "failed to write mbtree stats file index\n" );
         b_regular_file = x264_is_regular_file( rc->p_mbtree_stat_file_out );
         fclose( rc->p_mbtree_stat_file_out );
         if( h->i_frame >= rc->num_entries && b_regular_file )
@@ -1372,6 +2101,11 @@ void x264_ratecontrol_delete( x264_t *h )
     }
     if( rc->p_mbtree_stat_file_in )
         fclose( rc->p_mbtree_stat_file_in );
+    if( rc->mbtree.reader )
+        mbtree_reader_close( rc->mbtree.reader );
+    x264_free( rc->mbtree.bs_buffer );
+    if( rc->stat_map )
+        x264_unmap_file( rc->stat_map, rc->stat_map_size, rc->b_stat_mapped );
     x264_free( rc->pred );
     x264_free( rc->pred_b_from_p );
     x264_free( rc->entry );
@@ -1435,6 +2169,9 @@ void x264_ratecontrol_start( x264_t *h, int i_force_qp, int overhead )
         rc->row_pred = &rc->row_preds[h->sh.i_type];
         rc->buffer_rate = h->fenc->i_cpb_duration * rc->vbv_max_rate * h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
         update_vbv_plan( h, overhead );
+        rc->row_buffer_share = rc->row_buffer_size;
+        rc->row_buffer_rate = rc->buffer_rate / h->mb.i_mb_height;
+        rc->row_overhead = overhead;
 
         const x264_level_t *l = x264_levels;
         while( l->level_idc != 0 && l->level_idc != h->param.i_level_idc )
@@ -1703,6 +2440,35 @@ int x264_ratecontrol_mb( x264_t *h, int bits )
         }
     }
 
+    if( h->param.rc.b_vbv_rows )
+    {
+        /* Each row (pair in MBAFF) leaves the buffer as soon as it's encoded, with its MPEG-2
+         * slice start code, and the buffer refills by 1/mb_height of a frame's bits per row.
+         * Unlike the frame VBV, which only adjusts the QP of the rows still to come, a row that
+         * underflows the buffer is encoded again with the QP it would have needed to fit. */
+        int rows = 1 + SLICE_MBAFF;
+        int row_bits = h->fdec->i_row_bits[y] + (SLICE_MBAFF ? h->fdec->i_row_bits[y-1] : 0)
+                     + (MPEG2 ? STRUCTURE_OVERHEAD * 8 : 0);
+        if( y - SLICE_MBAFF == h->i_threadslice_start )
+            row_bits += rc->row_overhead;
+        double row_fill = X264_MIN( rc->row_buffer_fill + rows * rc->row_buffer_rate, rc->row_buffer_share );
+        float row_qp_max = h->param.rc.i_qp_max;
+        if( row_bits > row_fill && prev_row_qp < row_qp_max && can_reencode_row )
+        {
+            float qp_fit = qscale2qp( h, qscale * row_bits / X264_MAX( row_fill, 1 ) );
+            rc->qpm = x264_clip3f( qp_fit, prev_row_qp + 1.0f, row_qp_max );
+            rc->qpa_rc = rc->qpa_rc_prev;
+            rc->qpa_aq = rc->qpa_aq_prev;
+            h->fdec->i_row_bits[y] = 0;
+            h->fdec->i_row_bits[y-SLICE_MBAFF] = 0;
+            return -1;
+        }
+        if( row_bits > row_fill )
+            x264_log( h, X264_LOG_DEBUG, "row VBV underflow (frame %d, row %d, %.0f bits)\n",
+                      h->i_frame, y, row_bits - row_fill );
+        rc->row_buffer_fill = X264_MAX( row_fill - row_bits, 0 );
+    }
+
     rc->qpa_rc_prev = rc->qpa_rc;
     rc->qpa_aq_prev = rc->qpa_aq;
 
@@ -1790,6 +2556,18 @@ void x264_ratecontrol_set_weights( x264_t *h, x264_frame_t *frm )
     }
 }
 
+/* Fill the ratecontrol fields of the frame_stats callback, after x264_ratecontrol_end. */
+void x264_ratecontrol_frame_stats( x264_t *h, x264_frame_stats_t *stats )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    stats->f_qp_avg_rc = h->fdec->f_qp_avg_rc;
+    stats->f_planned_bits = rc->frame_size_planned;
+    if( rc->b_vbv )
+        stats->f_vbv_fullness = (double)h->thread[0]->rc->buffer_fill_final / h->sps->vui.i_time_scale / rc->buffer_size;
+    else
+        stats->f_vbv_fullness = -1;
+}
+
 /* After encoding one frame, save stats and update ratecontrol state */
 int x264_ratecontrol_end( x264_t *h, int bits, int *filler )
 {
@@ -1819,63 +2597,79 @@ int x264_ratecontrol_end( x264_t *h, int bits, int *filler )
                         ( dir_frame>0 ? 's' : dir_frame<0 ? 't' :
                           dir_avg>0 ? 's' : dir_avg<0 ? 't' : '-' )
                         : '-';
-        if( fprintf( rc->p_stat_file_out,
-                 "in:%d out:%d type:%c dur:%"PRId64" cpbdur:%"PRId64" q:%.2f aq:%.2f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c ref:",
-                 h->fenc->i_frame, h->i_frame,
-                 c_type, h->fenc->i_duration,
-                 h->fenc->i_cpb_duration,
-                 rc->qpa_rc, h->fdec->f_qp_avg_aq,
-                 h->stat.frame.i_tex_bits,
-                 h->stat.frame.i_mv_bits,
-                 h->stat.frame.i_misc_bits,
-                 h->stat.frame.i_mb_count_i,
-                 h->stat.frame.i_mb_count_p,
-                 h->stat.frame.i_mb_count_skip,
-                 c_direct) < 0 )
-            goto fail;
-
-        /* Only write information for reference reordering once. */
-        int use_old_stats = h->param.rc.b_stat_read && rc->rce->refs > 1;
-        for( int i = 0; i < (use_old_stats ? rc->rce->refs : h->i_ref[0]); i++ )
-        {
-            int refcount = use_old_stats         ? rc->rce->refcount[i]
-                         : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
-                                                 + h->stat.frame.i_mb_count_ref[0][i*2+1]
-                         :                         h->stat.frame.i_mb_count_ref[0][i];
-            if( fprintf( rc->p_stat_file_out, "%d ", refcount ) < 0 )
+        if( h->param.rc.i_stat_format == X264_STATS_FORMAT_BINARY )
+        {
+            if( stats_write_binary( h, c_type, c_direct ) < 0 )
                 goto fail;
         }
-
-        if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
+        else
         {
-            if( fprintf( rc->p_stat_file_out, "w:%d,%d,%d",
-                         h->sh.weight[0][0].i_denom, h->sh.weight[0][0].i_scale, h->sh.weight[0][0].i_offset ) < 0 )
+            if( fprintf( rc->p_stat_file_out,
+                     "in:%d out:%d type:%c dur:%"PRId64" cpbdur:%"PRId64" q:%.2f aq:%.2f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c ref:",
+                     h->fenc->i_frame, h->i_frame,
+                     c_type, h->fenc->i_duration,
+                     h->fenc->i_cpb_duration,
+                     rc->qpa_rc, h->fdec->f_qp_avg_aq,
+                     h->stat.frame.i_tex_bits,
+                     h->stat.frame.i_mv_bits,
+                     h->stat.frame.i_misc_bits,
+                     h->stat.frame.i_mb_count_i,
+                     h->stat.frame.i_mb_count_p,
+                     h->stat.frame.i_mb_count_skip,
+                     c_direct) < 0 )
                 goto fail;
-            if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
+
+            /* Only write information for reference reordering once. */
+            int use_old_stats = h->param.rc.b_stat_read && rc->rce->refs > 1;
+            for( int i = 0; i < (use_old_stats ? rc->rce->refs : h->i_ref[0]); i++ )
+            {
+                int refcount = use_old_stats         ? rc->rce->refcount[i]
+                             : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
+                                                     + h->stat.frame.i_mb_count_ref[0][i*2+1]
+                             :                         h->stat.frame.i_mb_count_ref[0][i];
+                if( fprintf( rc->p_stat_file_out, "%d ", refcount ) < 0 )
+                    goto fail;
+            }
+
+            if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
             {
-                if( fprintf( rc->p_stat_file_out, ",%d,%d,%d,%d,%d ",
-                             h->sh.weight[0][1].i_denom, h->sh.weight[0][1].i_scale, h->sh.weight[0][1].i_offset,
-                             h->sh.weight[0][2].i_scale, h->sh.weight[0][2].i_offset ) < 0 )
+                if( fprintf( rc->p_stat_file_out, "w:%d,%d,%d",
+                             h->sh.weight[0][0].i_denom, h->sh.weight[0][0].i_scale, h->sh.weight[0][0].i_offset ) < 0 )
+                    goto fail;
+                if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
+                {
+                    if( fprintf( rc->p_stat_file_out, ",%d,%d,%d,%d,%d ",
+                                 h->sh.weight[0][1].i_denom, h->sh.weight[0][1].i_scale, h->sh.weight[0][1].i_offset,
+                                 h->sh.weight[0][2].i_scale, h->sh.weight[0][2].i_offset ) < 0 )
+                        goto fail;
+                }
+                else if( fprintf( rc->p_stat_file_out, " " ) < 0 )
                     goto fail;
             }
-            else if( fprintf( rc->p_stat_file_out, " " ) < 0 )
+
+            if( fprintf( rc->p_stat_file_out, ";\n") < 0 )
                 goto fail;
         }
 
-        if( fprintf( rc->p_stat_file_out, ";\n") < 0 )
-            goto fail;
-
         /* Don't re-write the data in multi-pass mode. */
         if( h->param.rc.b_mb_tree && h->fenc->b_kept_as_ref && !h->param.rc.b_stat_read )
         {
             uint8_t i_type = h->sh.i_type;
-            /* Values are stored as big-endian FIX8.8 */
-            for( int i = 0; i < h->mb.i_mb_count; i++ )
-                rc->mbtree.qp_buffer[0][i] = endian_fix16( h->fenc->f_qp_offset[i]*256.0 );
-            if( fwrite( &i_type, 1, 1, rc->p_mbtree_stat_file_out ) < 1 )
-                goto fail;
-            if( fwrite( rc->mbtree.qp_buffer[0], sizeof(uint16_t), h->mb.i_mb_count, rc->p_mbtree_stat_file_out ) < h->mb.i_mb_count )
-                goto fail;
+            if( rc->mbtree.bs_buffer )
+            {
+                if( mbtree_write_compact( h, i_type ) < 0 )
+                    goto fail;
+            }
+            else
+            {
+                /* Values are stored as big-endian FIX8.8 */
+                for( int i = 0; i < h->mb.i_mb_count; i++ )
+                    rc->mbtree.qp_buffer[0][i] = endian_fix16( h->fenc->f_qp_offset[i]*256.0 );
+                if( fwrite( &i_type, 1, 1, rc->p_mbtree_stat_file_out ) < 1 )
+                    goto fail;
+                if( fwrite( rc->mbtree.qp_buffer[0], sizeof(uint16_t), h->mb.i_mb_count, rc->p_mbtree_stat_file_out ) < h->mb.i_mb_count )
+                    goto fail;
+            }
         }
     }
 
@@ -2622,12 +3416,22 @@ void x264_threads_distribute_ratecontrol( x264_t *h )
                 memcpy( t->rc->row_preds, rc->row_preds, sizeof(rc->row_preds) );
         }
 
+    double row_buffer_fill = rc->row_buffer_fill;
     for( int i = 0; i < h->param.i_threads; i++ )
     {
         x264_t *t = h->thread[i];
         if( t != h )
             memcpy( t->rc, rc, offsetof(x264_ratecontrol_t, row_pred) );
         t->rc->row_pred = &t->rc->row_preds[h->sh.i_type];
+        if( h->param.rc.b_vbv_rows )
+        {
+            /* Slices are encoded in parallel, so split the buffer so that no combination of
+             * rows can underflow it */
+            double share = (double)(t->i_threadslice_end - t->i_threadslice_start) / h->mb.i_mb_height;
+            t->rc->row_buffer_fill = row_buffer_fill * share;
+            t->rc->row_buffer_share = rc->row_buffer_size * share;
+            t->rc->row_overhead = t->i_threadslice_start ? 0 : rc->row_overhead;
+        }
         /* Calculate the planned slice size. */
         if( rc->b_vbv && rc->frame_size_planned )
         {
@@ -2682,6 +3486,7 @@ void x264_threads_merge_ratecontrol( x264_t *h )
             continue;
         rc->qpa_rc += rct->qpa_rc;
         rc->qpa_aq += rct->qpa_aq;
+        rc->row_buffer_fill += rct->row_buffer_fill;
     }
 }
 
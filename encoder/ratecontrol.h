@@ -46,6 +46,7 @@ void x264_ratecontrol_init_reconfigurable( x264_t *h, int b_init );
 int x264_encoder_reconfig_apply( x264_t *h, x264_param_t *param );
 
 void x264_adaptive_quant_frame( x264_t *h, x264_frame_t *frame, float *quant_offsets );
+void x264_adaptive_quant_rows( x264_t *h, x264_frame_t *frame, float *quant_offsets, int i_mb_y_start, int i_mb_y_end );
 int  x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offsets );
 int  x264_reference_build_list_optimal( x264_t *h );
 void x264_thread_sync_ratecontrol( x264_t *cur, x264_t *prev, x264_t *next );
@@ -56,6 +57,7 @@ int  x264_ratecontrol_mb( x264_t *, int bits );
 int  x264_ratecontrol_qp( x264_t * );
 int  x264_ratecontrol_mb_qp( x264_t *h );
 int  x264_ratecontrol_end( x264_t *, int bits, int *filler );
+void x264_ratecontrol_frame_stats( x264_t *, x264_frame_stats_t *stats );
 void x264_ratecontrol_summary( x264_t * );
 void x264_ratecontrol_set_estimated_size( x264_t *, int bits );
 int  x264_ratecontrol_get_estimated_size( x264_t const *);
@@ -961,8 +961,16 @@ void x264_gop_header_write_mpeg2( x264_t *h, bs_t *s )
     bs_write( s, 6, sec ); // time_code_seconds
     bs_write( s, 6, frames ); // time_code_pictures
 
-    bs_write1( s, h->fenc->i_frame == h->fenc->i_coded ); // closed_gop
-    bs_write1( s, 0 );   // broken_link
+    /* Leading B-frames of an open GOP can't be decoded if the frame they
+     * predict from was invalidated by x264_encoder_invalidate_reference. */
+    int b_closed_gop = h->fenc->i_frame == h->fenc->i_coded;
+    int b_broken_link = 0;
+    if( !b_closed_gop )
+        for( x264_frame_t **f = h->frames.reference; *f; f++ )
+            b_broken_link |= (*f)->b_corrupt;
+
+    bs_write1( s, b_closed_gop ); // closed_gop
+    bs_write1( s, b_broken_link ); // broken_link
 
     bs_align_0( s );
     bs_flush( s );
@@ -69,6 +69,7 @@ static void x264_lowres_context_init( x264_t *h, x264_mb_analysis_t *a )
         h->mb.i_me_method = X264_ME_DIA;
         h->mb.i_subpel_refine = 2;
     }
+    h->mb.i_me_range = h->param.analyse.i_me_range;
     h->mb.b_chroma_me = 0;
 }
 
@@ -493,14 +494,16 @@ void x264_weights_analyse( x264_t *h, x264_frame_t *fenc, x264_frame_t *ref, int
 
     if( weights[0].weightfn && b_lookahead )
     {
-        //scale lowres in lookahead for slicetype_frame_cost
-        pixel *src = ref->buffer_lowres[0];
+        //scale lowres in lookahead for slicetype_frame_cost, at the pyramid level it analyses
+        int level = h->frames.i_lowres_level;
+        pixel *src = level ? ref->buffer_coarse[level-1] : ref->buffer_lowres[0];
         pixel *dst = h->mb.p_weight_buf[0];
-        int width = ref->i_width_lowres + PADH*2;
-        int height = ref->i_lines_lowres + PADV*2;
-        x264_weight_scale_plane( h, dst, ref->i_stride_lowres, src, ref->i_stride_lowres,
+        int stride = level ? ref->i_stride_coarse[level-1] : ref->i_stride_lowres;
+        int width = (level ? ref->i_width_coarse[level-1] : ref->i_width_lowres) + PADH*2;
+        int height = (level ? ref->i_lines_coarse[level-1] : ref->i_lines_lowres) + PADV*2;
+        x264_weight_scale_plane( h, dst, stride, src, stride,
                                  width, height, &weights[0] );
-        fenc->weighted[0] = h->mb.p_weight_buf[0] + PADH + ref->i_stride_lowres * PADV;
+        fenc->weighted[0] = h->mb.p_weight_buf[0] + PADH + stride * PADV;
     }
 }
 
@@ -513,7 +516,7 @@ void x264_weights_analyse( x264_t *h, x264_frame_t *fenc, x264_frame_t *ref, int
 #define COST_EST_AQ 1
 #define INTRA_MBS 2
 #define NUM_ROWS 3
-#define ROW_SATD (NUM_INTS + (h->mb.i_mb_y - h->i_threadslice_start))
+#define ROW_SATD(mb_y) (NUM_INTS + (mb_y) - h->i_threadslice_start)
 
 static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
                                     x264_frame_t **frames, int p0, int p1, int b,
@@ -524,18 +527,25 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     x264_frame_t *fref1 = frames[p1];
     x264_frame_t *fenc  = frames[b];
     const int b_bidir = (b < p1);
+    /* i_mb_x/y index the 8x8 blocks of the analysed pyramid level, each of which covers
+     * a square of 1<<level macroblocks.  The results are stored for every one of them,
+     * with the MVs in lowres units, so the rest of the lookahead works on the macroblock grid. */
+    const int level = h->frames.i_lowres_level;
     const int i_mb_x = h->mb.i_mb_x;
     const int i_mb_y = h->mb.i_mb_y;
+    const int i_mb_width  = (h->mb.i_mb_width  + (1<<level) - 1) >> level;
+    const int i_mb_height = (h->mb.i_mb_height + (1<<level) - 1) >> level;
     const int i_mb_stride = h->mb.i_mb_width;
-    const int i_mb_xy = i_mb_x + i_mb_y * i_mb_stride;
-    const int i_stride = fenc->i_stride_lowres;
+    const int i_mb_xy = (i_mb_x + i_mb_y * i_mb_stride) << level;
+    const int i_covered_w = X264_MIN( 1 << level, h->mb.i_mb_width  - (i_mb_x << level) );
+    const int i_covered_h = X264_MIN( 1 << level, h->mb.i_mb_height - (i_mb_y << level) );
+    pixel **fenc_pels = level ? fenc->coarse[level-1] : fenc->lowres;
+    const int i_stride = level ? fenc->i_stride_coarse[level-1] : fenc->i_stride_lowres;
     const int i_pel_offset = 8 * (i_mb_x + i_mb_y * i_stride);
     const int i_bipred_weight = h->param.analyse.b_weighted_bipred ? 64 - (dist_scale_factor>>2) : 32;
     int16_t (*fenc_mvs[2])[2] = { &fenc->lowres_mvs[0][b-p0-1][i_mb_xy], &fenc->lowres_mvs[1][p1-b-1][i_mb_xy] };
     int (*fenc_costs[2]) = { &fenc->lowres_mv_costs[0][b-p0-1][i_mb_xy], &fenc->lowres_mv_costs[1][p1-b-1][i_mb_xy] };
-    int b_frame_score_mb = (i_mb_x > 0 && i_mb_x < h->mb.i_mb_width - 1 &&
-                            i_mb_y > 0 && i_mb_y < h->mb.i_mb_height - 1) ||
-                            h->mb.i_mb_width <= 2 || h->mb.i_mb_height <= 2;
+    int i_icost = 0;
 
     ALIGNED_ARRAY_16( pixel, pix1,[9*FDEC_STRIDE] );
     pixel *pix2 = pix1+8;
@@ -546,20 +556,20 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     int lowres_penalty = 4;
 
     h->mb.pic.p_fenc[0] = h->mb.pic.fenc_buf;
-    h->mc.copy[PIXEL_8x8]( h->mb.pic.p_fenc[0], FENC_STRIDE, &fenc->lowres[0][i_pel_offset], i_stride, 8 );
+    h->mc.copy[PIXEL_8x8]( h->mb.pic.p_fenc[0], FENC_STRIDE, &fenc_pels[0][i_pel_offset], i_stride, 8 );
 
     if( p0 == p1 )
         goto lowres_intra_mb;
 
     // no need for h->mb.mv_min[]
-    h->mb.mv_limit_fpel[0][0] = -8*h->mb.i_mb_x - 4;
-    h->mb.mv_limit_fpel[1][0] = 8*( h->mb.i_mb_width - h->mb.i_mb_x - 1 ) + 4;
+    h->mb.mv_limit_fpel[0][0] = -8*i_mb_x - 4;
+    h->mb.mv_limit_fpel[1][0] = 8*( i_mb_width - i_mb_x - 1 ) + 4;
     h->mb.mv_min_spel[0] = 4*( h->mb.mv_limit_fpel[0][0] - 8 );
     h->mb.mv_max_spel[0] = 4*( h->mb.mv_limit_fpel[1][0] + 8 );
-    if( h->mb.i_mb_x >= h->mb.i_mb_width - 2 )
+    if( i_mb_x >= i_mb_width - 2 )
     {
-        h->mb.mv_limit_fpel[0][1] = -8*h->mb.i_mb_y - 4;
-        h->mb.mv_limit_fpel[1][1] = 8*( h->mb.i_mb_height - h->mb.i_mb_y - 1 ) + 4;
+        h->mb.mv_limit_fpel[0][1] = -8*i_mb_y - 4;
+        h->mb.mv_limit_fpel[1][1] = 8*( i_mb_height - i_mb_y - 1 ) + 4;
         h->mb.mv_min_spel[1] = 4*( h->mb.mv_limit_fpel[0][1] - 8 );
         h->mb.mv_max_spel[1] = 4*( h->mb.mv_limit_fpel[1][1] + 8 );
     }
@@ -573,6 +583,13 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     }
 #define LOAD_WPELS_LUMA(dst,src) \
     (dst) = &(src)[i_pel_offset];
+#define LOWRES_PELS( frame ) (level ? (frame)->coarse[level-1] : (frame)->lowres)
+/* Convert MVs between lowres units and those of the analysed level. */
+#define LOAD_MV( dst, src ) \
+    { \
+        (dst)[0] = (src)[0] >> level; \
+        (dst)[1] = (src)[1] >> level; \
+    }
 
 #define CLIP_MV( mv ) \
     { \
@@ -611,15 +628,16 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     m[0].p_fenc[0] = h->mb.pic.p_fenc[0];
     m[0].weight = w;
     m[0].i_ref = 0;
-    LOAD_HPELS_LUMA( m[0].p_fref, fref0->lowres );
+    LOAD_HPELS_LUMA( m[0].p_fref, LOWRES_PELS( fref0 ) );
     m[0].p_fref_w = m[0].p_fref[0];
     if( w[0].weightfn )
         LOAD_WPELS_LUMA( m[0].p_fref_w, fenc->weighted[0] );
 
     if( b_bidir )
     {
-        int16_t *mvr = fref1->lowres_mvs[0][p1-p0-1][i_mb_xy];
+        int16_t mvr[2];
         ALIGNED_ARRAY_8( int16_t, dmv,[2],[2] );
+        LOAD_MV( mvr, fref1->lowres_mvs[0][p1-p0-1][i_mb_xy] );
 
         m[1].i_pixel = PIXEL_8x8;
         m[1].p_cost_mv = a->p_cost_mv;
@@ -627,7 +645,7 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
         m[1].p_fenc[0] = h->mb.pic.p_fenc[0];
         m[1].i_ref = 0;
         m[1].weight = x264_weight_none;
-        LOAD_HPELS_LUMA( m[1].p_fref, fref1->lowres );
+        LOAD_HPELS_LUMA( m[1].p_fref, LOWRES_PELS( fref1 ) );
         m[1].p_fref_w = m[1].p_fref[0];
 
         dmv[0][0] = ( mvr[0] * dist_scale_factor + 128 ) >> 8;
@@ -660,16 +678,18 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
             /* Reverse-order MV prediction. */
             M32( mvc[0] ) = 0;
             M32( mvc[2] ) = 0;
-#define MVC(mv) { CP32( mvc[i_mvc], mv ); i_mvc++; }
-            if( i_mb_x < h->mb.i_mb_width - 1 )
-                MVC( fenc_mv[1] );
-            if( i_mb_y < h->i_threadslice_end - 1 )
+#define MVC(mv) { LOAD_MV( mvc[i_mvc], mv ); i_mvc++; }
+            const int right = 1 << level;
+            const int below = i_mb_stride << level;
+            if( i_mb_x < i_mb_width - 1 )
+                MVC( fenc_mv[right] );
+            if( ((i_mb_y+1) << level) < h->i_threadslice_end )
             {
-                MVC( fenc_mv[i_mb_stride] );
+                MVC( fenc_mv[below] );
                 if( i_mb_x > 0 )
-                    MVC( fenc_mv[i_mb_stride-1] );
-                if( i_mb_x < h->mb.i_mb_width - 1 )
-                    MVC( fenc_mv[i_mb_stride+1] );
+                    MVC( fenc_mv[below-right] );
+                if( i_mb_x < i_mb_width - 1 )
+                    MVC( fenc_mv[below+right] );
             }
 #undef MVC
             if( i_mvc <= 1 )
@@ -695,12 +715,17 @@ static void x264_slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
                 m[l].cost += 5 * a->i_lambda;
 
 skip_motionest:
-            CP32( fenc_mvs[l], m[l].mv );
-            *fenc_costs[l] = m[l].cost;
+            for( int y = 0; y < i_covered_h; y++ )
+                for( int x = 0; x < i_covered_w; x++ )
+                {
+                    fenc_mvs[l][x+y*i_mb_stride][0] = m[l].mv[0] * (1 << level);
+                    fenc_mvs[l][x+y*i_mb_stride][1] = m[l].mv[1] * (1 << level);
+                    fenc_costs[l][x+y*i_mb_stride] = m[l].cost;
+                }
         }
         else
         {
-            CP32( m[l].mv, fenc_mvs[l] );
+            LOAD_MV( m[l].mv, fenc_mvs[l][0] );
             m[l].cost = *fenc_costs[l];
         }
         COPY2_IF_LT( i_bcost, m[l].cost, list_used, l+1 );
@@ -714,7 +739,7 @@ lowres_intra_mb:
     {
         ALIGNED_ARRAY_16( pixel, edge,[36] );
         pixel *pix = &pix1[8+FDEC_STRIDE];
-        pixel *src = &fenc->lowres[0][i_pel_offset];
+        pixel *src = &fenc_pels[0][i_pel_offset];
         const int intra_penalty = 5 * a->i_lambda;
         int satds[3];
         int pixoff = 4 / sizeof(pixel);
@@ -725,7 +750,7 @@ lowres_intra_mb:
             M32( &pix[i*FDEC_STRIDE-pixoff] ) = M32( &src[i*i_stride-pixoff] );
 
         h->pixf.intra_mbcmp_x3_8x8c( h->mb.pic.p_fenc[0], pix, satds );
-        int i_icost = X264_MIN3( satds[0], satds[1], satds[2] );
+        i_icost = X264_MIN3( satds[0], satds[1], satds[2] );
 
         if( h->param.analyse.i_subpel_refine > 1 )
         {
@@ -742,52 +767,69 @@ lowres_intra_mb:
         }
 
         i_icost += intra_penalty + lowres_penalty;
-        fenc->i_intra_cost[i_mb_xy] = i_icost;
-        int i_icost_aq = i_icost;
-        if( h->param.rc.i_aq_mode )
-            i_icost_aq = (i_icost_aq * fenc->i_inv_qscale_factor[i_mb_xy] + 128) >> 8;
-        output_intra[ROW_SATD] += i_icost_aq;
-        if( b_frame_score_mb )
-        {
-            output_intra[COST_EST] += i_icost;
-            output_intra[COST_EST_AQ] += i_icost_aq;
-        }
     }
     i_bcost += lowres_penalty;
 
-    /* forbid intra-mbs in B-frames, because it's rare and not worth checking */
-    /* FIXME: Should we still forbid them now that we cache intra scores? */
-    if( !b_bidir )
-    {
-        int i_icost = fenc->i_intra_cost[i_mb_xy];
-        int b_intra = i_icost < i_bcost;
-        if( b_intra )
+    for( int mb_y = i_mb_y << level; mb_y < (i_mb_y << level) + i_covered_h; mb_y++ )
+        for( int mb_x = i_mb_x << level; mb_x < (i_mb_x << level) + i_covered_w; mb_x++ )
         {
-            i_bcost = i_icost;
-            list_used = 0;
-        }
-        if( b_frame_score_mb )
-            output_inter[INTRA_MBS] += b_intra;
-    }
+            int mb_xy = mb_x + mb_y * i_mb_stride;
+            int mb_bcost = i_bcost;
+            int mb_list_used = list_used;
+            int b_frame_score_mb = (mb_x > 0 && mb_x < h->mb.i_mb_width - 1 &&
+                                    mb_y > 0 && mb_y < h->mb.i_mb_height - 1) ||
+                                    h->mb.i_mb_width <= 2 || h->mb.i_mb_height <= 2;
 
-    /* In an I-frame, we've already added the results above in the intra section. */
-    if( p0 != p1 )
-    {
-        int i_bcost_aq = i_bcost;
-        if( h->param.rc.i_aq_mode )
-            i_bcost_aq = (i_bcost_aq * fenc->i_inv_qscale_factor[i_mb_xy] + 128) >> 8;
-        output_inter[ROW_SATD] += i_bcost_aq;
-        if( b_frame_score_mb )
-        {
-            /* Don't use AQ-weighted costs for slicetype decision, only for ratecontrol. */
-            output_inter[COST_EST] += i_bcost;
-            output_inter[COST_EST_AQ] += i_bcost_aq;
-        }
-    }
+            if( !fenc->b_intra_calculated )
+            {
+                fenc->i_intra_cost[mb_xy] = i_icost;
+                int i_icost_aq = i_icost;
+                if( h->param.rc.i_aq_mode )
+                    i_icost_aq = (i_icost_aq * fenc->i_inv_qscale_factor[mb_xy] + 128) >> 8;
+                output_intra[ROW_SATD(mb_y)] += i_icost_aq;
+                if( b_frame_score_mb )
+                {
+                    output_intra[COST_EST] += i_icost;
+                    output_intra[COST_EST_AQ] += i_icost_aq;
+                }
+            }
+
+            /* forbid intra-mbs in B-frames, because it's rare and not worth checking */
+            /* FIXME: Should we still forbid them now that we cache intra scores? */
+            if( !b_bidir )
+            {
+                int mb_icost = fenc->i_intra_cost[mb_xy];
+                int b_intra = mb_icost < mb_bcost;
+                if( b_intra )
+                {
+                    mb_bcost = mb_icost;
+                    mb_list_used = 0;
+                }
+                if( b_frame_score_mb )
+                    output_inter[INTRA_MBS] += b_intra;
+            }
+
+            /* In an I-frame, we've already added the results above in the intra section. */
+            if( p0 != p1 )
+            {
+                int i_bcost_aq = mb_bcost;
+                if( h->param.rc.i_aq_mode )
+                    i_bcost_aq = (i_bcost_aq * fenc->i_inv_qscale_factor[mb_xy] + 128) >> 8;
+                output_inter[ROW_SATD(mb_y)] += i_bcost_aq;
+                if( b_frame_score_mb )
+                {
+                    /* Don't use AQ-weighted costs for slicetype decision, only for ratecontrol. */
+                    output_inter[COST_EST] += mb_bcost;
+                    output_inter[COST_EST_AQ] += i_bcost_aq;
+                }
+            }
 
-    fenc->lowres_costs[b-p0][p1-b][i_mb_xy] = X264_MIN( i_bcost, LOWRES_COST_MASK ) + (list_used << LOWRES_COST_SHIFT);
+            fenc->lowres_costs[b-p0][p1-b][mb_xy] = X264_MIN( mb_bcost, LOWRES_COST_MASK ) + (mb_list_used << LOWRES_COST_SHIFT);
+        }
 }
 #undef TRY_BIDIR
+#undef LOWRES_PELS
+#undef LOAD_MV
 
 #define NUM_MBS\
    (h->mb.i_mb_width > 2 && h->mb.i_mb_height > 2 ?\
@@ -809,6 +851,12 @@ typedef struct
     int *output_intra;
 } x264_slicetype_slice_t;
 
+/* Also check that we already calculated the row SATDs for the current frame. */
+static ALWAYS_INLINE int x264_slicetype_cost_cached( x264_t *h, x264_frame_t *fenc, int p0, int p1, int b )
+{
+    return fenc->i_cost_est[b-p0][p1-b] >= 0 && (!h->param.rc.i_vbv_buffer_size || fenc->i_row_satds[b-p0][p1-b][0] != -1);
+}
+
 static void x264_slicetype_slice_cost( x264_slicetype_slice_t *s )
 {
     x264_t *h = s->h;
@@ -825,6 +873,13 @@ static void x264_slicetype_slice_cost( x264_slicetype_slice_t *s )
     int start_x = h->mb.i_mb_width - 2 + do_edges;
     int end_x = 1 - do_edges;
 
+    /* Walk the blocks of the analysed pyramid level covering those macroblocks. */
+    int level = h->frames.i_lowres_level;
+    start_y >>= level;
+    end_y >>= level;
+    start_x >>= level;
+    end_x >>= level;
+
     for( h->mb.i_mb_y = start_y; h->mb.i_mb_y >= end_y; h->mb.i_mb_y-- )
         for( h->mb.i_mb_x = start_x; h->mb.i_mb_x >= end_x; h->mb.i_mb_x-- )
             x264_slicetype_mb_cost( h, s->a, s->frames, s->p0, s->p1, s->b, s->dist_scale_factor,
@@ -840,11 +895,10 @@ static int x264_slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
     const x264_weight_t *w = x264_weight_none;
     x264_frame_t *fenc = frames[b];
 
-    /* Check whether we already evaluated this frame
+    /* Check whether we already evaluated this frame, possibly in an earlier slicetype decision.
      * If we have tried this frame as P, then we have also tried
      * the preceding frames as B. (is this still true?) */
-    /* Also check that we already calculated the row SATDs for the current frame. */
-    if( fenc->i_cost_est[b-p0][p1-b] >= 0 && (!h->param.rc.i_vbv_buffer_size || fenc->i_row_satds[b-p0][p1-b][0] != -1) )
+    if( x264_slicetype_cost_cached( h, fenc, p0, p1, b ) )
         i_score = fenc->i_cost_est[b-p0][p1-b];
     else
     {
@@ -900,21 +954,30 @@ static int x264_slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
             if( h->param.i_lookahead_threads > 1 )
             {
                 x264_slicetype_slice_t s[X264_LOOKAHEAD_THREAD_MAX];
+                /* The lookahead worker contexts have no pool: they are already running on it,
+                 * so they cost the slices themselves, keeping the same slice boundaries. */
+                int b_inline = !h->lookaheadpool;
 
                 for( int i = 0; i < h->param.i_lookahead_threads; i++ )
                 {
-                    x264_t *t = h->lookahead_thread[i];
+                    x264_t *t = b_inline ? h : h->lookahead_thread[i];
 
                     /* FIXME move this somewhere else */
                     t->mb.i_me_method = h->mb.i_me_method;
+                    t->mb.i_me_range = h->mb.i_me_range;
                     t->mb.i_subpel_refine = h->mb.i_subpel_refine;
                     t->mb.b_chroma_me = h->mb.b_chroma_me;
 
                     s[i] = (x264_slicetype_slice_t){ t, a, frames, p0, p1, b, dist_scale_factor, do_search, w,
                         output_inter[i], output_intra[i] };
 
-                    t->i_threadslice_start = ((h->mb.i_mb_height *  i    + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads);
-                    t->i_threadslice_end   = ((h->mb.i_mb_height * (i+1) + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads);
+                    /* Slices are whole rows of blocks of the analysed pyramid level. */
+                    int level = h->frames.i_lowres_level;
+                    int rows = (h->mb.i_mb_height + (1<<level) - 1) >> level;
+                    t->i_threadslice_start = ((rows *  i    + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads) << level;
+                    t->i_threadslice_end   = ((rows * (i+1) + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads) << level;
+                    t->i_threadslice_start = X264_MIN( t->i_threadslice_start, h->mb.i_mb_height );
+                    t->i_threadslice_end   = X264_MIN( t->i_threadslice_end, h->mb.i_mb_height );
 
                     int thread_height = t->i_threadslice_end - t->i_threadslice_start;
                     int thread_output_size = thread_height + NUM_INTS;
@@ -925,10 +988,14 @@ static int x264_slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
                     output_inter[i+1] = output_inter[i] + thread_output_size + PAD_SIZE;
                     output_intra[i+1] = output_intra[i] + thread_output_size + PAD_SIZE;
 
-                    x264_threadpool_run( h->lookaheadpool, (void*)x264_slicetype_slice_cost, &s[i] );
+                    if( b_inline )
+                        x264_slicetype_slice_cost( &s[i] );
+                    else
+                        x264_threadpool_run( h->lookaheadpool, (void*)x264_slicetype_slice_cost, &s[i] );
                 }
-                for( int i = 0; i < h->param.i_lookahead_threads; i++ )
-                    x264_threadpool_wait( h->lookaheadpool, &s[i] );
+                if( !b_inline )
+                    for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+                        x264_threadpool_wait( h->lookaheadpool, &s[i] );
             }
             else
             {
@@ -999,6 +1066,66 @@ static int x264_slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
     return i_score;
 }
 
+typedef struct
+{
+    x264_t *h;
+    x264_frame_t **frames;
+    int *list;
+    int i_start;
+    int i_count;
+    int i_step;
+    int i_max_dist;
+} x264_slicetype_precompute_t;
+
+static void x264_slicetype_precompute_frames( x264_slicetype_precompute_t *s )
+{
+    x264_t *h = s->h;
+    x264_mb_analysis_t a;
+    x264_lowres_context_init( h, &a );
+    for( int i = s->i_start; i < s->i_count; i += s->i_step )
+    {
+        int b = s->list[i];
+        for( int p0 = b-1; p0 >= X264_MAX( 0, b - s->i_max_dist ); p0-- )
+            x264_slicetype_frame_cost( h, &a, s->frames, p0, b, b, 0 );
+    }
+}
+
+/* Compute the intra cost and the P costs against the nearest references of every frame
+ * in the window on the lookahead pool, one whole frame per job: each frame only writes
+ * its own costs and motion vectors, so the frames are independent of each other.
+ * Scenecut, the path search and MB-tree then find these in the cost cache, which leaves
+ * mostly B-frame costs to the serial code. */
+static void x264_slicetype_precompute( x264_t *h, x264_frame_t **frames, int num_frames )
+{
+    int max_dist = 1;
+    if( h->param.i_bframe_adaptive == X264_B_ADAPT_TRELLIS )
+        max_dist = h->param.i_bframe + 1;
+    else if( h->param.i_bframe_adaptive == X264_B_ADAPT_FAST )
+        max_dist = X264_MIN( h->param.i_bframe + 1, 2 );
+
+    int list[X264_LOOKAHEAD_MAX+1];
+    int count = 0;
+    for( int b = 1; b <= num_frames; b++ )
+        for( int p0 = b-1; p0 >= X264_MAX( 0, b - max_dist ); p0-- )
+            if( !x264_slicetype_cost_cached( h, frames[b], p0, b, b ) )
+            {
+                list[count++] = b;
+                break;
+            }
+    if( !count )
+        return;
+
+    x264_slicetype_precompute_t s[X264_LOOKAHEAD_THREAD_MAX];
+    int jobs = X264_MIN( count, h->param.i_lookahead_threads );
+    for( int i = 0; i < jobs; i++ )
+    {
+        s[i] = (x264_slicetype_precompute_t){ h->lookahead_thread[i], frames, list, i, count, jobs, max_dist };
+        x264_threadpool_run( h->lookaheadpool, (void*)x264_slicetype_precompute_frames, &s[i] );
+    }
+    for( int i = 0; i < jobs; i++ )
+        x264_threadpool_wait( h->lookaheadpool, &s[i] );
+}
+
 /* If MB-tree changes the quantizers, we need to recalculate the frame cost without
  * re-running lookahead. */
 static int x264_slicetype_frame_cost_recalculate( x264_t *h, x264_frame_t **frames, int p0, int p1, int b )
@@ -1053,9 +1180,25 @@ static void x264_macroblock_tree_finish( x264_t *h, x264_frame_t *frame, float a
     }
 }
 
-static void x264_macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float average_duration, int p0, int p1, int b, int referenced )
+typedef struct
+{
+    x264_t *h;
+    x264_frame_t **frames;
+    int p0;
+    int p1;
+    int b;
+    int referenced;
+    float fps_factor;
+    uint16_t *ref_costs[2];
+    int i_start;
+    int i_end;
+} x264_mbtree_slice_t;
+
+static void x264_macroblock_tree_propagate_rows( x264_mbtree_slice_t *s )
 {
-    uint16_t *ref_costs[2] = {frames[p0]->i_propagate_cost,frames[p1]->i_propagate_cost};
+    x264_t *h = s->h;
+    x264_frame_t **frames = s->frames;
+    int p0 = s->p0, p1 = s->p1, b = s->b;
     int dist_scale_factor = ( ((b-p0) << 8) + ((p1-p0) >> 1) ) / (p1-p0);
     int i_bipred_weight = h->param.analyse.b_weighted_bipred ? 64 - (dist_scale_factor>>2) : 32;
     int16_t (*mvs[2])[2] = { frames[b]->lowres_mvs[0][b-p0-1], frames[b]->lowres_mvs[1][p1-b-1] };
@@ -1064,6 +1207,38 @@ static void x264_macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, fl
     uint16_t *propagate_cost = frames[b]->i_propagate_cost;
     uint16_t *lowres_costs = frames[b]->lowres_costs[b-p0][p1-b];
 
+    if( s->referenced )
+        propagate_cost += s->i_start * h->mb.i_mb_width;
+
+    for( int mb_y = s->i_start; mb_y < s->i_end; mb_y++ )
+    {
+        int mb_index = mb_y*h->mb.i_mb_stride;
+        h->mc.mbtree_propagate_cost( buf, propagate_cost,
+            frames[b]->i_intra_cost+mb_index, lowres_costs+mb_index,
+            frames[b]->i_inv_qscale_factor+mb_index, &s->fps_factor, h->mb.i_mb_width );
+        if( s->referenced )
+            propagate_cost += h->mb.i_mb_width;
+
+        h->mc.mbtree_propagate_list( h, s->ref_costs[0], &mvs[0][mb_index], buf, &lowres_costs[mb_index],
+                                     bipred_weights[0], mb_y, h->mb.i_mb_width, 0 );
+        if( b != p1 )
+        {
+            h->mc.mbtree_propagate_list( h, s->ref_costs[1], &mvs[1][mb_index], buf, &lowres_costs[mb_index],
+                                         bipred_weights[1], mb_y, h->mb.i_mb_width, 1 );
+        }
+    }
+}
+
+/* Saturating adds of non-negative amounts can be regrouped freely, so summing the per-thread
+ * targets gives exactly the same result as propagating all rows serially. */
+static void x264_macroblock_tree_propagate_reduce( uint16_t *dst, uint16_t *src, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = X264_MIN( dst[i] + src[i], (1<<15)-1 );
+}
+
+static void x264_macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float average_duration, int p0, int p1, int b, int referenced )
+{
     x264_emms();
     float fps_factor = CLIP_DURATION(frames[b]->f_duration) / (CLIP_DURATION(average_duration) * 256.0f) * MBTREE_PRECISION;
 
@@ -1071,22 +1246,35 @@ static void x264_macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, fl
     if( !referenced )
         memset( frames[b]->i_propagate_cost, 0, h->mb.i_mb_width * sizeof(uint16_t) );
 
-    for( h->mb.i_mb_y = 0; h->mb.i_mb_y < h->mb.i_mb_height; h->mb.i_mb_y++ )
+    /* With lookahead threads, each thread propagates a band of rows into targets of its own,
+     * since the motion vectors scatter the costs anywhere in the reference frames. */
+    int threads = h->lookaheadpool ? X264_MIN( h->param.i_lookahead_threads, h->mb.i_mb_height ) : 1;
+    if( threads > 1 )
     {
-        int mb_index = h->mb.i_mb_y*h->mb.i_mb_stride;
-        h->mc.mbtree_propagate_cost( buf, propagate_cost,
-            frames[b]->i_intra_cost+mb_index, lowres_costs+mb_index,
-            frames[b]->i_inv_qscale_factor+mb_index, &fps_factor, h->mb.i_mb_width );
-        if( referenced )
-            propagate_cost += h->mb.i_mb_width;
-
-        h->mc.mbtree_propagate_list( h, ref_costs[0], &mvs[0][mb_index], buf, &lowres_costs[mb_index],
-                                     bipred_weights[0], h->mb.i_mb_y, h->mb.i_mb_width, 0 );
-        if( b != p1 )
+        int lists = 1 + (b != p1);
+        x264_mbtree_slice_t s[X264_LOOKAHEAD_THREAD_MAX];
+        for( int i = 0; i < threads; i++ )
         {
-            h->mc.mbtree_propagate_list( h, ref_costs[1], &mvs[1][mb_index], buf, &lowres_costs[mb_index],
-                                         bipred_weights[1], h->mb.i_mb_y, h->mb.i_mb_width, 1 );
+            x264_t *t = h->lookahead_thread[i];
+            for( int l = 0; l < lists; l++ )
+                memset( t->propagate_accum[l], 0, h->mb.i_mb_count * sizeof(uint16_t) );
+            s[i] = (x264_mbtree_slice_t){ t, frames, p0, p1, b, referenced, fps_factor,
+                                          { t->propagate_accum[0], t->propagate_accum[1] },
+                                          (h->mb.i_mb_height *  i    + threads/2) / threads,
+                                          (h->mb.i_mb_height * (i+1) + threads/2) / threads };
+            x264_threadpool_run( h->lookaheadpool, (void*)x264_macroblock_tree_propagate_rows, &s[i] );
         }
+        for( int i = 0; i < threads; i++ )
+            x264_threadpool_wait( h->lookaheadpool, &s[i] );
+        for( int i = 0; i < threads; i++ )
+            for( int l = 0; l < lists; l++ )
+                x264_macroblock_tree_propagate_reduce( frames[l ? p1 : p0]->i_propagate_cost, s[i].ref_costs[l], h->mb.i_mb_count );
+    }
+    else
+    {
+        x264_mbtree_slice_t s = { h, frames, p0, p1, b, referenced, fps_factor,
+                                  { frames[p0]->i_propagate_cost, frames[p1]->i_propagate_cost }, 0, h->mb.i_mb_height };
+        x264_macroblock_tree_propagate_rows( &s );
     }
 
     if( h->param.rc.i_vbv_buffer_size && h->param.rc.i_lookahead && referenced )
@@ -1498,6 +1686,9 @@ void x264_slicetype_analyse( x264_t *h, int intra_minigop )
         return;
     }
 
+    if( h->lookaheadpool && !h->param.b_opencl )
+        x264_slicetype_precompute( h, frames, num_frames );
+
     int num_bframes = 0;
     int num_analysed_frames = num_frames;
     int reset_start;
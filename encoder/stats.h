@@ -0,0 +1,124 @@
+/*****************************************************************************
+ * stats.h: binary first-pass statistics format
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+
+#ifndef X264_STATS_H
+#define X264_STATS_H
+
+#include <stdint.h>
+
+/* Binary 2pass stats file layout:
+ *   x264_stats_header_t
+ *   options string, NUL-terminated and zero-padded to a multiple of 8 bytes
+ *   num_frames x264_stats_record_t, in coded order
+ *   index: num_frames int32_t, the record number of each frame in display order
+ * All fields are stored in the byte order of the machine that wrote the file;
+ * byte_order lets readers reject files from a machine with different endianness. */
+
+#define X264_STATS_MAGIC      "x264stat"
+#define X264_STATS_VERSION    1
+#define X264_STATS_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t num_frames;     /* 0 until the file has been completely written */
+    uint32_t options_size;   /* including NUL and padding */
+    uint64_t records_offset;
+    uint64_t index_offset;
+    uint8_t  reserved[16];
+} x264_stats_header_t;
+
+typedef struct
+{
+    int64_t  i_duration;
+    int64_t  i_cpb_duration;
+    int32_t  i_frame_in;     /* display order */
+    int32_t  i_frame_out;    /* coded order */
+    float    f_qp_rc;
+    float    f_qp_aq;
+    int32_t  i_tex_bits;
+    int32_t  i_mv_bits;
+    int32_t  i_misc_bits;
+    int32_t  i_mb_count_i;
+    int32_t  i_mb_count_p;
+    int32_t  i_mb_count_skip;
+    int32_t  refcount[16];
+    int16_t  weight[3][2];   /* scale, offset */
+    int16_t  weight_denom[2];
+    char     type;           /* I, i, P, B or b as in the text format */
+    char     direct;         /* s, t or - */
+    uint8_t  refs;           /* valid entries in refcount */
+    uint8_t  weights;        /* 0, 3 (luma only) or 8 (luma and chroma) weight values */
+    uint32_t reserved;
+} x264_stats_record_t;
+
+/* Compact MB-tree stats file layout (the .mbtree companion of binary stats):
+ *   x264_mbtree_header_t
+ *   one record per reference frame, in coded order: x264_mbtree_record_t followed by
+ *   `size` bytes of coded qp offsets
+ *   index: num_records x264_mbtree_index_t, in coded order
+ * Each frame's FIX8.8 qp offsets are quantized by qp_shift bits, predicted from their
+ * left, top and top-left neighbours (median edge detector) and the residuals are coded
+ * with adaptive Golomb-Rice codes, MSB first, starting on a byte boundary. */
+
+#define X264_MBTREE_MAGIC      "x264mbtr"
+#define X264_MBTREE_VERSION    1
+#define X264_MBTREE_QP_SHIFT   2
+#define X264_MBTREE_RICE_LIMIT 24 /* unary prefixes this long are followed by an escaped value */
+#define X264_MBTREE_ESC_BITS   20
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t mb_width;
+    uint32_t mb_height;
+    uint32_t qp_shift;
+    uint32_t num_records;    /* 0 until the file has been completely written */
+    uint32_t reserved0;
+    uint64_t index_offset;
+} x264_mbtree_header_t;
+
+typedef struct
+{
+    int32_t  i_frame;        /* display order */
+    uint32_t size;           /* coded bytes following this record header */
+    uint8_t  type;           /* slice type */
+    uint8_t  reserved[3];
+} x264_mbtree_record_t;
+
+typedef struct
+{
+    int32_t  i_frame;
+    uint32_t size;
+    uint64_t offset;         /* of the x264_mbtree_record_t */
+} x264_mbtree_index_t;
+
+#endif
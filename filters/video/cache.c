@@ -28,6 +28,22 @@
 #define NAME "cache"
 #define LAST_FRAME (h->first_frame + h->cur_size - 1)
 
+/* The cache keeps the last max_size frames available for look-back filters.
+ * Frames are kept as references to the upstream pictures when the upstream filter chain
+ * can keep enough frames alive at once, and are only copied otherwise.
+ * Each entry is reference counted: the cache holds one reference while the frame is
+ * cached and every get_frame adds one until the matching release_frame.
+ * Entries that leave the cache while still referenced downstream are retired, so copied frames
+ * stay valid until they are released. Referenced frames only do if the upstream ones do. */
+
+typedef struct
+{
+    cli_pic_t pic;
+    cli_pic_t *copy; /* private buffer backing pic, NULL when referencing the upstream frame */
+    int frame;
+    int refs;
+} cache_entry_t;
+
 typedef struct
 {
     hnd_t prev_hnd;
@@ -35,9 +51,18 @@ typedef struct
 
     int max_size;
     int first_frame; /* first cached frame */
-    cli_pic_t **cache;
+    cache_entry_t **cache;
     int cur_size;
     int eof;         /* frame beyond end of the file */
+
+    cache_entry_t **retired; /* entries out of the cache that are still referenced downstream */
+    int retired_size;
+    cli_pic_t **spare;       /* copy buffers not in use */
+    int b_reference;         /* upstream frames stay valid while cached */
+    int csp, width, height;
+
+    int64_t referenced;
+    int64_t copied;
 } cache_hnd_t;
 
 cli_vid_filter_t cache_filter;
@@ -53,17 +78,23 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
         return -1;
 
     h->max_size = size;
-    h->cache = malloc( (h->max_size+1) * sizeof(cli_pic_t*) );
-    if( !h->cache )
+    /* all lists require a null terminator for list methods */
+    h->cache = calloc( h->max_size+1, sizeof(cache_entry_t*) );
+    h->retired_size = h->max_size;
+    h->retired = calloc( h->retired_size+1, sizeof(cache_entry_t*) );
+    h->spare = calloc( 2*h->max_size+1, sizeof(cli_pic_t*) );
+    if( !h->cache || !h->retired || !h->spare )
         return -1;
 
-    for( int i = 0; i < h->max_size; i++ )
-    {
-        h->cache[i] = malloc( sizeof(cli_pic_t) );
-        if( !h->cache[i] || x264_cli_pic_alloc( h->cache[i], info->csp, info->width, info->height ) )
-            return -1;
-    }
-    h->cache[h->max_size] = NULL; /* require null terminator for list methods */
+    /* the cached frames plus the next request must fit in the window the upstream can keep alive */
+    h->b_reference = info->frame_refs > h->max_size;
+    if( !h->b_reference || info->frame_refs == INT_MAX )
+        info->frame_refs = INT_MAX;
+    else
+        info->frame_refs = 1;
+    h->csp = info->csp;
+    h->width = info->width;
+    h->height = info->height;
 
     h->prev_filter = *filter;
     h->prev_hnd = *handle;
@@ -73,13 +104,73 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
     return 0;
 }
 
-static void fill_cache( cache_hnd_t *h, int frame )
+static void free_entry( cache_hnd_t *h, cache_entry_t *entry )
+{
+    if( entry->copy )
+        x264_frame_push( (void*)h->spare, (void*)entry->copy );
+    else
+        h->prev_filter.release_frame( h->prev_hnd, &entry->pic, entry->frame );
+    free( entry );
+}
+
+static void unref_entry( cache_hnd_t *h, cache_entry_t *entry )
+{
+    if( --entry->refs )
+        return;
+    for( int i = 0; h->retired[i]; i++ )
+        if( h->retired[i] == entry )
+        {
+            x264_frame_shift( (void*)(h->retired+i) );
+            break;
+        }
+    free_entry( h, entry );
+}
+
+static cache_entry_t *read_entry( cache_hnd_t *h, int frame )
+{
+    cli_pic_t temp;
+    cache_entry_t *entry = calloc( 1, sizeof(cache_entry_t) );
+    if( !entry || h->prev_filter.get_frame( h->prev_hnd, &temp, frame ) )
+    {
+        free( entry );
+        return NULL;
+    }
+    entry->frame = frame;
+    entry->refs = 1;
+    if( h->b_reference )
+    {
+        entry->pic = temp;
+        h->referenced++;
+        return entry;
+    }
+    entry->copy = h->spare[0] ? (void*)x264_frame_pop( (void*)h->spare ) : NULL;
+    if( !entry->copy && (entry->copy = malloc( sizeof(cli_pic_t) )) &&
+        x264_cli_pic_alloc( entry->copy, h->csp, h->width, h->height ) )
+    {
+        free( entry->copy );
+        entry->copy = NULL;
+    }
+    int ret = !entry->copy || x264_cli_pic_copy( entry->copy, &temp );
+    ret |= h->prev_filter.release_frame( h->prev_hnd, &temp, frame );
+    if( ret )
+    {
+        if( entry->copy )
+            x264_frame_push( (void*)h->spare, (void*)entry->copy );
+        free( entry );
+        return NULL;
+    }
+    entry->pic = *entry->copy;
+    h->copied++;
+    return entry;
+}
+
+static int fill_cache( cache_hnd_t *h, int frame )
 {
     /* shift frames out of the cache as the frame request is beyond the filled cache */
     int shift = frame - LAST_FRAME;
     /* no frames to shift or no frames left to read */
     if( shift <= 0 || h->eof )
-        return;
+        return 0;
     /* the next frames to read are either
      * A) starting at the end of the current cache, or
      * B) starting at a new frame that has the end of the cache at the desired frame
@@ -89,54 +180,89 @@ static void fill_cache( cache_hnd_t *h, int frame )
      * A) the current one shifted the number of frames entering/leaving the cache, or
      * B) at a new frame that has the end of the cache at the desired frame. */
     h->first_frame = X264_MIN( h->first_frame + shift, cur_frame );
+    for( int i = X264_MIN( shift, h->cur_size ); i > 0; i-- )
+    {
+        cache_entry_t *entry = (void*)x264_frame_shift( (void*)h->cache );
+        if( entry->refs > 1 )
+        {
+            if( h->retired[h->retired_size-1] )
+            {
+                cache_entry_t **retired = realloc( h->retired, (2*h->retired_size+1) * sizeof(cache_entry_t*) );
+                if( !retired )
+                    return -1;
+                memset( retired + h->retired_size + 1, 0, h->retired_size * sizeof(cache_entry_t*) );
+                h->retired = retired;
+                h->retired_size *= 2;
+            }
+            x264_frame_push( (void*)h->retired, (void*)entry );
+        }
+        unref_entry( h, entry );
+    }
     h->cur_size = X264_MAX( h->cur_size - shift, 0 );
     while( h->cur_size < h->max_size )
     {
-        cli_pic_t temp;
-        /* the old front frame is going to shift off, overwrite it with the new frame */
-        cli_pic_t *cache = h->cache[0];
-        if( h->prev_filter.get_frame( h->prev_hnd, &temp, cur_frame ) ||
-            x264_cli_pic_copy( cache, &temp ) ||
-            h->prev_filter.release_frame( h->prev_hnd, &temp, cur_frame ) )
+        cache_entry_t *entry = read_entry( h, cur_frame );
+        if( !entry )
         {
             h->eof = cur_frame;
-            return;
+            return 0;
         }
-        /* the read was successful, shift the frame off the front to the end */
-        x264_frame_push( (void*)h->cache, x264_frame_shift( (void*)h->cache ) );
+        x264_frame_push( (void*)h->cache, (void*)entry );
         cur_frame++;
         h->cur_size++;
     }
+    return 0;
 }
 
 static int get_frame( hnd_t handle, cli_pic_t *output, int frame )
 {
     cache_hnd_t *h = handle;
     FAIL_IF_ERR( frame < h->first_frame, NAME, "frame %d is before first cached frame %d \n", frame, h->first_frame );
-    fill_cache( h, frame );
+    if( fill_cache( h, frame ) )
+        return -1;
     if( frame > LAST_FRAME ) /* eof */
         return -1;
-    int idx = frame - (h->eof ? h->eof - h->max_size : h->first_frame);
-    *output = *h->cache[idx];
+    cache_entry_t *entry = h->cache[frame - h->first_frame];
+    entry->refs++;
+    *output = entry->pic;
     return 0;
 }
 
 static int release_frame( hnd_t handle, cli_pic_t *pic, int frame )
 {
-    /* the parent filter's frame has already been released so do nothing here */
+    cache_hnd_t *h = handle;
+    for( int i = 0; h->cache[i]; i++ )
+        if( h->cache[i]->frame == frame )
+        {
+            unref_entry( h, h->cache[i] );
+            return 0;
+        }
+    for( int i = 0; h->retired[i]; i++ )
+        if( h->retired[i]->frame == frame )
+        {
+            unref_entry( h, h->retired[i] );
+            return 0;
+        }
     return 0;
 }
 
 static void free_filter( hnd_t handle )
 {
     cache_hnd_t *h = handle;
+    x264_cli_log( NAME, X264_LOG_DEBUG, "%"PRId64" frames referenced, %"PRId64" copied\n", h->referenced, h->copied );
+    while( h->cache[0] )
+        free_entry( h, (void*)x264_frame_shift( (void*)h->cache ) );
+    while( h->retired[0] )
+        free_entry( h, (void*)x264_frame_shift( (void*)h->retired ) );
     h->prev_filter.free( h->prev_hnd );
-    for( int i = 0; i < h->max_size; i++ )
+    for( int i = 0; h->spare[i]; i++ )
     {
-        x264_cli_pic_clean( h->cache[i] );
-        free( h->cache[i] );
+        x264_cli_pic_clean( h->spare[i] );
+        free( h->spare[i] );
     }
     free( h->cache );
+    free( h->retired );
+    free( h->spare );
     free( h );
 }
 
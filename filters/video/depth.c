@@ -24,12 +24,36 @@
  *****************************************************************************/
 
 #include "video.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #define NAME "depth"
 #define FAIL_IF_ERROR( cond, ... ) FAIL_IF_ERR( cond, NAME, __VA_ARGS__ )
 
+#define MAX_STRIPES 64
+
 cli_vid_filter_t depth_filter;
 
+enum
+{
+    DITHER_SIERRA,
+    DITHER_ORDERED
+};
+
+static const char * const dither_names[] = { "sierra", "ordered", 0 };
+
+typedef struct depth_hnd_t depth_hnd_t;
+
 typedef struct
+{
+    depth_hnd_t *h;
+    cli_image_t *out;
+    cli_image_t *img;
+    int stripe;
+    int16_t *error_buf;
+} depth_job_t;
+
+struct depth_hnd_t
 {
     hnd_t prev_hnd;
     cli_vid_filter_t prev_filter;
@@ -38,7 +62,30 @@ typedef struct
     int dst_csp;
     cli_pic_t buffer;
     int16_t *error_buf;
-} depth_hnd_t;
+
+    int dither;
+    int stripes;
+    /* ordered dither thresholds, one 8-row table per sample interleave (pitch) */
+    uint16_t *threshold[4];
+    int threshold_stride;
+    x264_threadpool_t *pool;
+    depth_job_t job[MAX_STRIPES];
+};
+
+static void help( int longhelp )
+{
+    printf( "      "NAME":[bit_depth][,dither][,stripes]\n" );
+    if( !longhelp )
+        return;
+    printf( "            converts the bit depth of the frames\n"
+            "            - bit_depth: output bit depth [build bit depth]\n"
+            "            - dither: method used when reducing the bit depth [\"sierra\"]\n"
+            "               - sierra: Sierra-2-4A error diffusion\n"
+            "               - ordered: 8x8 ordered dither, vectorized\n"
+            "            - stripes: split each plane into this many independently\n"
+            "              dithered horizontal stripes processed in parallel [1]\n"
+            "              note: changes the output of sierra dithering\n" );
+}
 
 static int depth_filter_csp_is_supported( int csp )
 {
@@ -95,18 +142,89 @@ DITHER_PLANE( 2 )
 DITHER_PLANE( 3 )
 DITHER_PLANE( 4 )
 
-static void dither_image( cli_image_t *out, cli_image_t *img, int16_t *error_buf )
+/* Ordered dithering works on half the source precision so that the sum with the
+ * threshold fits in 16 bits. The thresholds stay below one output step, so an
+ * image upconverted by scale_image is still converted back losslessly. */
+static void dither_row_ordered( pixel *dst, uint16_t *src, uint16_t *threshold, int width )
+{
+    const int rshift = 16-BIT_DEPTH-1;
+    const int pixel_max = (1 << BIT_DEPTH)-1;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i shift = _mm_cvtsi32_si128( rshift );
+    for( ; x <= width-8; x += 8 )
+    {
+        __m128i s = _mm_loadu_si128( (__m128i*)(src+x) );
+        __m128i t = _mm_loadu_si128( (__m128i*)(threshold+x) );
+        s = _mm_srl_epi16( _mm_add_epi16( _mm_srli_epi16( s, 1 ), t ), shift );
+#if BIT_DEPTH == 8
+        _mm_storel_epi64( (__m128i*)(dst+x), _mm_packus_epi16( s, s ) );
+#else
+        _mm_storeu_si128( (__m128i*)(dst+x), _mm_min_epi16( s, _mm_set1_epi16( pixel_max ) ) );
+#endif
+    }
+#endif
+    for( ; x < width; x++ )
+        dst[x] = X264_MIN( ((src[x]>>1) + threshold[x]) >> rshift, pixel_max );
+}
+
+static int init_thresholds( depth_hnd_t *h, int width )
+{
+    static const uint8_t bayer[8][8] =
+    {
+        {  0, 32,  8, 40,  2, 34, 10, 42 },
+        { 48, 16, 56, 24, 50, 18, 58, 26 },
+        { 12, 44,  4, 36, 14, 46,  6, 38 },
+        { 60, 28, 52, 20, 62, 30, 54, 22 },
+        {  3, 35, 11, 43,  1, 33,  9, 41 },
+        { 51, 19, 59, 27, 49, 17, 57, 25 },
+        { 15, 47,  7, 39, 13, 45,  5, 37 },
+        { 63, 31, 55, 23, 61, 29, 53, 21 }
+    };
+    const int rshift = 16-BIT_DEPTH-1;
+    h->threshold_stride = (width * 4 + 15) & ~15;
+    for( int i = 0; i < h->buffer.img.planes; i++ )
+    {
+        int pitch = csp_num_interleaved( h->dst_csp, i );
+        if( h->threshold[pitch-1] )
+            continue;
+        uint16_t *thr = h->threshold[pitch-1] = malloc( 8 * h->threshold_stride * sizeof(uint16_t) );
+        if( !thr )
+            return -1;
+        for( int y = 0; y < 8; y++, thr += h->threshold_stride )
+            for( int x = 0; x < h->threshold_stride; x++ )
+                thr[x] = ((2 * bayer[y][(x / pitch) & 7] + 1) << rshift) >> 7;
+    }
+    return 0;
+}
+
+static void dither_stripe( depth_hnd_t *h, cli_image_t *out, cli_image_t *img, int stripe, int16_t *error_buf )
 {
     int csp_mask = img->csp & X264_CSP_MASK;
     for( int i = 0; i < img->planes; i++ )
     {
         int num_interleaved = csp_num_interleaved( img->csp, i );
-        int height = x264_cli_csps[csp_mask].height[i] * img->height;
+        int plane_height = x264_cli_csps[csp_mask].height[i] * img->height;
         int width = x264_cli_csps[csp_mask].width[i] * img->width / num_interleaved;
+        int y0 = plane_height * stripe / h->stripes;
+        int height = plane_height * (stripe + 1) / h->stripes - y0;
+        pixel *dst = (pixel*)(out->plane[i] + y0 * out->stride[i]);
+        uint16_t *src = (uint16_t*)(img->plane[i] + y0 * img->stride[i]);
+
+        if( h->dither == DITHER_ORDERED )
+        {
+            for( int y = y0; y < y0 + height; y++ )
+            {
+                dither_row_ordered( dst, src, h->threshold[num_interleaved-1] + (y&7) * h->threshold_stride,
+                                    width * num_interleaved );
+                dst += out->stride[i]/sizeof(pixel);
+                src += img->stride[i]/2;
+            }
+            continue;
+        }
 
 #define CALL_DITHER_PLANE( pitch, off ) \
-        dither_plane_##pitch( ((pixel*)out->plane[i])+off, out->stride[i]/sizeof(pixel), \
-                ((uint16_t*)img->plane[i])+off, img->stride[i]/2, width, height, error_buf )
+        dither_plane_##pitch( dst+off, out->stride[i]/sizeof(pixel), src+off, img->stride[i]/2, width, height, error_buf )
 
         if( num_interleaved == 4 )
         {
@@ -133,6 +251,31 @@ static void dither_image( cli_image_t *out, cli_image_t *img, int16_t *error_buf
     }
 }
 
+static void *dither_stripe_job( depth_job_t *job )
+{
+    dither_stripe( job->h, job->out, job->img, job->stripe, job->error_buf );
+    return NULL;
+}
+
+static void dither_image( depth_hnd_t *h, cli_image_t *out, cli_image_t *img )
+{
+    for( int i = 0; i < h->stripes; i++ )
+    {
+        h->job[i].out = out;
+        h->job[i].img = img;
+        if( h->pool && i )
+            x264_threadpool_run( h->pool, (void*)dither_stripe_job, &h->job[i] );
+    }
+    /* the first stripe is done on the calling thread */
+    for( int i = 0; i < h->stripes; i++ )
+    {
+        if( h->pool && i )
+            x264_threadpool_wait( h->pool, &h->job[i] );
+        else
+            dither_stripe_job( &h->job[i] );
+    }
+}
+
 static void scale_image( cli_image_t *output, cli_image_t *img )
 {
     int csp_mask = img->csp & X264_CSP_MASK;
@@ -146,7 +289,17 @@ static void scale_image( cli_image_t *output, cli_image_t *img )
 
         for( int j = 0; j < height; j++ )
         {
-            for( int k = 0; k < width; k++ )
+            int k = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            for( ; k <= width-16; k += 16 )
+            {
+                __m128i s = _mm_loadu_si128( (__m128i*)(src+k) );
+                _mm_storeu_si128( (__m128i*)(dst+k),   _mm_slli_epi16( _mm_unpacklo_epi8( s, zero ), shift ) );
+                _mm_storeu_si128( (__m128i*)(dst+k+8), _mm_slli_epi16( _mm_unpackhi_epi8( s, zero ), shift ) );
+            }
+#endif
+            for( ; k < width; k++ )
                 dst[k] = src[k] << shift;
 
             src += img->stride[i];
@@ -164,7 +317,7 @@ static int get_frame( hnd_t handle, cli_pic_t *output, int frame )
 
     if( h->bit_depth < 16 && output->img.csp & X264_CSP_HIGH_DEPTH )
     {
-        dither_image( &h->buffer.img, &output->img, h->error_buf );
+        dither_image( h, &h->buffer.img, &output->img );
         output->img = h->buffer.img;
     }
     else if( h->bit_depth > 8 && !(output->img.csp & X264_CSP_HIGH_DEPTH) )
@@ -185,6 +338,10 @@ static void free_filter( hnd_t handle )
 {
     depth_hnd_t *h = handle;
     h->prev_filter.free( h->prev_hnd );
+    if( h->pool )
+        x264_threadpool_delete( h->pool );
+    for( int i = 0; i < 4; i++ )
+        free( h->threshold[i] );
     x264_cli_pic_clean( &h->buffer );
     x264_free( h );
 }
@@ -196,20 +353,28 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info,
     int change_fmt = (info->csp ^ param->i_csp) & X264_CSP_HIGH_DEPTH;
     int csp = ~(~info->csp ^ change_fmt);
     int bit_depth = 8*x264_cli_csp_depth_factor( csp );
+    int dither = DITHER_SIERRA;
+    int stripes = 1;
 
     if( opt_string )
     {
-        static const char *optlist[] = { "bit_depth", NULL };
+        static const char *optlist[] = { "bit_depth", "dither", "stripes", NULL };
         char **opts = x264_split_options( opt_string, optlist );
 
         if( opts )
         {
             char *str_bit_depth = x264_get_option( "bit_depth", opts );
-            bit_depth = x264_otoi( str_bit_depth, -1 );
+            bit_depth = x264_otoi( str_bit_depth, BIT_DEPTH );
 
             ret = bit_depth < 8 || bit_depth > 16;
             csp = bit_depth > 8 ? csp | X264_CSP_HIGH_DEPTH : csp & ~X264_CSP_HIGH_DEPTH;
             change_fmt = (info->csp ^ csp) & X264_CSP_HIGH_DEPTH;
+
+            char *str_dither = x264_otos( x264_get_option( "dither", opts ), (char*)dither_names[DITHER_SIERRA] );
+            for( dither = 0; dither_names[dither] && strcasecmp( dither_names[dither], str_dither ); dither++ );
+            FAIL_IF_ERROR( !dither_names[dither], "invalid dither method `%s'\n", str_dither )
+            stripes = x264_otoi( x264_get_option( "stripes", opts ), 1 );
+            FAIL_IF_ERROR( stripes < 1 || stripes > MAX_STRIPES, "stripes must be between 1 and %d\n", MAX_STRIPES )
             x264_free_string_array( opts );
         }
         else
@@ -223,14 +388,17 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info,
     if( change_fmt || bit_depth != 8 * x264_cli_csp_depth_factor( csp ) )
     {
         FAIL_IF_ERROR( !depth_filter_csp_is_supported(csp), "unsupported colorspace.\n" )
-        depth_hnd_t *h = x264_malloc( sizeof(depth_hnd_t) + (info->width+1)*sizeof(int16_t) );
+        depth_hnd_t *h = x264_malloc( sizeof(depth_hnd_t) + stripes*(info->width+1)*sizeof(int16_t) );
 
         if( !h )
             return -1;
 
+        memset( h, 0, sizeof(depth_hnd_t) );
         h->error_buf = (int16_t*)(h + 1);
         h->dst_csp = csp;
         h->bit_depth = bit_depth;
+        h->dither = dither;
+        h->stripes = stripes;
         h->prev_hnd = *handle;
         h->prev_filter = *filter;
 
@@ -239,13 +407,26 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info,
             x264_free( h );
             return -1;
         }
+        if( h->dither == DITHER_ORDERED && init_thresholds( h, info->width ) )
+            return -1;
+
+        for( int i = 0; i < h->stripes; i++ )
+        {
+            h->job[i].h = h;
+            h->job[i].stripe = i;
+            h->job[i].error_buf = h->error_buf + i*(info->width+1);
+        }
+        /* without thread support the stripes are simply processed in sequence */
+        if( h->stripes > 1 && x264_threadpool_init( &h->pool, h->stripes-1, NULL, NULL ) )
+            h->pool = NULL;
 
         *handle = h;
         *filter = depth_filter;
         info->csp = h->dst_csp;
+        info->frame_refs = 1;
     }
 
     return 0;
 }
 
-cli_vid_filter_t depth_filter = { NAME, NULL, init, get_frame, release_frame, free_filter, NULL };
+cli_vid_filter_t depth_filter = { NAME, help, init, get_frame, release_frame, free_filter, NULL };
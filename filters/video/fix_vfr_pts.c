@@ -58,6 +58,7 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
         return -1;
 
     h->holder_frame = -1;
+    info->frame_refs = 1;
     h->prev_hnd = *handle;
     h->prev_filter = *filter;
     *handle = h;
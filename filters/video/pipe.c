@@ -0,0 +1,282 @@
+/*****************************************************************************
+ * pipe.c: threaded pipeline video filter
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+
+#include "video.h"
+#include "internal.h"
+#define NAME "pipe"
+#define FAIL_IF_ERROR( cond, ... ) FAIL_IF_ERR( cond, NAME, __VA_ARGS__ )
+
+/* This filter runs the filter chain before it on a worker thread and buffers its output in a
+ * bounded queue, so that consecutive filter stages run concurrently on different frames.
+ * Frames must be requested in increasing order. Up to depth frames can be held at once and
+ * released in any order; queued frames before a requested one that were never fetched are dropped.
+ * When the previous filter keeps enough frames alive, the queue holds its frames directly instead
+ * of copies. All calls into the previous filter, releases included, are made by the worker. */
+
+enum
+{
+    SLOT_READY,    /* read, not yet handed out */
+    SLOT_HELD,     /* handed out, not yet released */
+    SLOT_RELEASED  /* released or skipped, free once it reaches the head */
+};
+
+typedef struct
+{
+    cli_pic_t pic;
+    int status;
+    int state;
+    int ref;    /* frame of the previous filter held in pic, -1 if none */
+} pipe_slot_t;
+
+typedef struct
+{
+    hnd_t prev_hnd;
+    cli_vid_filter_t prev_filter;
+
+    /* frames [head, head+filled) are in slot[frame % depth], next_read = head+filled */
+    pipe_slot_t *slot;
+    int depth;
+    int head;
+    int filled;
+    int next_read;
+    int num_frames;
+    int b_reading;
+    int b_eof;
+    int b_exit;
+    int b_reference; /* queue the previous filter's frames without copying */
+
+    x264_pthread_t thread;
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t cv_fill;
+    x264_pthread_cond_t cv_space;
+
+    int stalls;
+} pipe_hnd_t;
+
+cli_vid_filter_t pipe_filter;
+
+static int reader_done( pipe_hnd_t *h )
+{
+    return h->next_read < 0 || h->b_eof || (h->num_frames && h->next_read >= h->num_frames);
+}
+
+/* must be called by the worker, or once it has stopped */
+static void release_slot( pipe_hnd_t *h, pipe_slot_t *slot )
+{
+    if( slot->ref >= 0 )
+        h->prev_filter.release_frame( h->prev_hnd, &slot->pic, slot->ref );
+    slot->ref = -1;
+}
+
+static void *pipe_thread( pipe_hnd_t *h )
+{
+    x264_pthread_mutex_lock( &h->mutex );
+    while( 1 )
+    {
+        while( !h->b_exit && (reader_done( h ) || h->filled == h->depth) )
+            x264_pthread_cond_wait( &h->cv_space, &h->mutex );
+        if( h->b_exit )
+            break;
+        int frame = h->next_read;
+        pipe_slot_t *slot = &h->slot[frame % h->depth];
+        int head = h->head;
+        int filled = h->filled;
+        h->b_reading = 1;
+        x264_pthread_mutex_unlock( &h->mutex );
+
+        /* slots outside the queue are not in use downstream, give their frames back before reading */
+        for( int i = 0; i < h->depth; i++ )
+            if( (i - head % h->depth + h->depth) % h->depth >= filled )
+                release_slot( h, &h->slot[i] );
+        cli_pic_t temp;
+        int status = h->prev_filter.get_frame( h->prev_hnd, &temp, frame );
+        if( !status && h->b_reference )
+        {
+            slot->pic = temp;
+            slot->ref = frame;
+        }
+        else if( !status )
+            status = x264_cli_pic_copy( &slot->pic, &temp ) | h->prev_filter.release_frame( h->prev_hnd, &temp, frame );
+
+        x264_pthread_mutex_lock( &h->mutex );
+        h->b_reading = 0;
+        slot->status = status;
+        slot->state = SLOT_READY;
+        h->next_read++;
+        h->filled++;
+        h->b_eof = !!status;
+        x264_pthread_cond_broadcast( &h->cv_fill );
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+    return NULL;
+}
+
+static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x264_param_t *param, char *opt_string )
+{
+    intptr_t depth = (intptr_t)opt_string;
+    /* upon a <= 0 queue size request, do nothing */
+    if( depth <= 0 )
+        return 0;
+    pipe_hnd_t *h = calloc( 1, sizeof(pipe_hnd_t) );
+    if( !h )
+        return -1;
+
+    h->depth = depth;
+    h->num_frames = info->num_frames;
+    h->head = h->next_read = -1; /* wait for the first request before reading */
+    h->slot = calloc( h->depth, sizeof(pipe_slot_t) );
+    if( !h->slot )
+        return -1;
+    /* while the worker reads a frame, at most depth-1 earlier ones are still queued */
+    h->b_reference = info->frame_refs >= h->depth;
+    for( int i = 0; i < h->depth; i++ )
+    {
+        h->slot[i].ref = -1;
+        if( !h->b_reference && x264_cli_pic_alloc_aligned( &h->slot[i].pic, info->csp, info->width, info->height ) )
+            return -1;
+    }
+
+    h->prev_filter = *filter;
+    h->prev_hnd = *handle;
+
+    FAIL_IF_ERROR( x264_pthread_mutex_init( &h->mutex, NULL ) ||
+                   x264_pthread_cond_init( &h->cv_fill, NULL ) ||
+                   x264_pthread_cond_init( &h->cv_space, NULL ) ||
+                   x264_pthread_create( &h->thread, NULL, (void*)pipe_thread, h ), "failed to create thread\n" )
+
+    *handle = h;
+    *filter = pipe_filter;
+    info->frame_refs = h->depth;
+
+    return 0;
+}
+
+/* must be called with the mutex held */
+static void advance_head( pipe_hnd_t *h )
+{
+    while( h->filled && h->slot[h->head % h->depth].state == SLOT_RELEASED )
+    {
+        h->head++;
+        h->filled--;
+        x264_pthread_cond_broadcast( &h->cv_space );
+    }
+}
+
+static int get_frame( hnd_t handle, cli_pic_t *output, int frame )
+{
+    pipe_hnd_t *h = handle;
+    int ret = -1;
+
+    x264_pthread_mutex_lock( &h->mutex );
+    if( frame < h->head )
+    {
+        x264_pthread_mutex_unlock( &h->mutex );
+        x264_cli_log( NAME, X264_LOG_ERROR, "frame %d is before first queued frame %d\n", frame, h->head );
+        return -1;
+    }
+    int b_stalled = 0;
+    while( 1 )
+    {
+        /* skip over queued frames that are not wanted */
+        for( int i = h->head; i < X264_MIN( frame, h->head + h->filled ); i++ )
+            if( h->slot[i % h->depth].state == SLOT_READY )
+                h->slot[i % h->depth].state = SLOT_RELEASED;
+        advance_head( h );
+        if( frame < h->head + h->filled )
+        {
+            pipe_slot_t *slot = &h->slot[frame % h->depth];
+            slot->state = SLOT_HELD;
+            *output = slot->pic;
+            ret = slot->status;
+            break;
+        }
+        if( !h->filled && frame > h->next_read )
+        {
+            /* the request is beyond anything read so far: let a read in progress finish and
+             * look at the queue again, then restart the worker at the requested frame */
+            if( h->b_reading )
+            {
+                x264_pthread_cond_wait( &h->cv_fill, &h->mutex );
+                continue;
+            }
+            h->head = h->next_read = frame;
+            h->b_eof = 0;
+            x264_pthread_cond_broadcast( &h->cv_space );
+        }
+        if( !h->b_reading && (reader_done( h ) || h->filled == h->depth) )
+        {
+            if( h->filled == h->depth )
+                x264_cli_log( NAME, X264_LOG_ERROR, "frame %d requested with %d earlier frames held\n", frame, h->depth );
+            break;
+        }
+        if( !b_stalled )
+        {
+            h->stalls++;
+            b_stalled = 1;
+        }
+        x264_pthread_cond_wait( &h->cv_fill, &h->mutex );
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+
+    return ret;
+}
+
+static int release_frame( hnd_t handle, cli_pic_t *pic, int frame )
+{
+    pipe_hnd_t *h = handle;
+    x264_pthread_mutex_lock( &h->mutex );
+    if( frame >= h->head && frame < h->head + h->filled )
+    {
+        h->slot[frame % h->depth].state = SLOT_RELEASED;
+        advance_head( h );
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+    return 0;
+}
+
+static void free_filter( hnd_t handle )
+{
+    pipe_hnd_t *h = handle;
+    x264_pthread_mutex_lock( &h->mutex );
+    h->b_exit = 1;
+    x264_pthread_cond_broadcast( &h->cv_space );
+    x264_pthread_mutex_unlock( &h->mutex );
+    x264_pthread_join( h->thread, NULL );
+    x264_cli_log( NAME, X264_LOG_DEBUG, "%s stage: %d stalls waiting on the previous stage%s\n", h->prev_filter.name,
+                  h->stalls, h->b_reference ? ", frames passed through" : "" );
+
+    for( int i = 0; i < h->depth; i++ )
+        if( h->b_reference )
+            release_slot( h, &h->slot[i] );
+        else
+            x264_cli_pic_clean( &h->slot[i].pic );
+    h->prev_filter.free( h->prev_hnd );
+    x264_pthread_cond_destroy( &h->cv_space );
+    x264_pthread_cond_destroy( &h->cv_fill );
+    x264_pthread_mutex_destroy( &h->mutex );
+    free( h->slot );
+    free( h );
+}
+
+cli_vid_filter_t pipe_filter = { NAME, NULL, init, get_frame, release_frame, free_filter, NULL };
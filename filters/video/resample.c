@@ -0,0 +1,442 @@
+/*****************************************************************************
+ * resample.c: native resize and chroma resampling video filter
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+
+#include "video.h"
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#define NAME "resample"
+#define FAIL_IF_ERROR( cond, ... ) FAIL_IF_ERR( cond, NAME, __VA_ARGS__ )
+
+/* Separable polyphase resampler for planar YUV that does not depend on libswscale.
+ * Samples are filtered horizontally into a 14-bit intermediate and then vertically.
+ * Chroma follows MPEG-2 siting: co-sited with the left luma sample horizontally, and
+ * for 4:2:0 vertically halfway between luma lines, or at 1/4 and 3/4 between the lines
+ * of each field when filtering fields separately. */
+
+#define COEF_BITS 14
+#define MID_BITS  14
+
+cli_vid_filter_t resample_filter;
+
+enum
+{
+    METHOD_BILINEAR,
+    METHOD_BICUBIC,
+    METHOD_LANCZOS
+};
+
+static const char * const method_names[] = { "bilinear", "bicubic", "lanczos", 0 };
+static const float method_support[] = { 1, 2, 3 };
+
+typedef struct
+{
+    int dst_size;
+    int taps;      /* coefficients per output sample, padded for simd */
+    int pad_left;  /* samples read before the first input sample */
+    int pad_right; /* samples read after the last input sample */
+    int *start;
+    int16_t *coef;
+} resample_kernel_t;
+
+typedef struct
+{
+    hnd_t prev_hnd;
+    cli_vid_filter_t prev_filter;
+
+    cli_pic_t buffer;
+    int high_depth;
+    int fields;
+    int swap_src_chroma;
+    int src_width[3], src_height[3]; /* per field */
+    resample_kernel_t hkernel[3];
+    resample_kernel_t vkernel[3][2];
+    int16_t *row;
+    int16_t *mid;
+    int16_t **mid_rows;
+} resample_hnd_t;
+
+static void help( int longhelp )
+{
+    printf( "      "NAME":[width,height][,csp][,method][,interlaced]\n" );
+    if( !longhelp )
+        return;
+    printf( "            resizes and resamples chroma of planar yuv frames without libswscale\n"
+            "            - width, height: output resolution [keep current]\n"
+            "            - csp: output chroma format: i420, i422, i444 [keep current]\n"
+            "            - method: bilinear, bicubic, lanczos [\"bicubic\"]\n"
+            "            - interlaced: filter each field separately [auto]\n" );
+}
+
+static double kernel_func( int method, double x )
+{
+    x = fabs( x );
+    switch( method )
+    {
+        case METHOD_BILINEAR:
+            return x < 1 ? 1 - x : 0;
+        case METHOD_BICUBIC:
+            /* Catmull-Rom */
+            if( x < 1 )
+                return 1.5*x*x*x - 2.5*x*x + 1;
+            if( x < 2 )
+                return -0.5*x*x*x + 2.5*x*x - 4*x + 2;
+            return 0;
+        default:
+            if( x < 1e-8 )
+                return 1;
+            if( x >= 3 )
+                return 0;
+            return 3 * sin( M_PI*x ) * sin( M_PI*x/3 ) / (M_PI*M_PI*x*x);
+    }
+}
+
+/* position of a sample in luma units, given the chroma subsampling and siting offset of its plane */
+typedef struct
+{
+    int sub;
+    double offset;
+} siting_t;
+
+static int init_kernel( resample_kernel_t *k, int method, int src_size, int dst_size,
+                        double luma_scale, siting_t src, siting_t dst, int align )
+{
+    double scale = X264_MAX( (double)src_size / dst_size, 1 );
+    double support = method_support[method] * scale;
+    int taps = ((int)ceil( 2*support ) + 1 + align - 1) & ~(align - 1);
+    double *weight = malloc( taps * sizeof(double) );
+    k->dst_size = dst_size;
+    k->taps = taps;
+    k->pad_left = k->pad_right = 0;
+    k->start = malloc( dst_size * sizeof(int) );
+    k->coef = malloc( dst_size * taps * sizeof(int16_t) );
+    if( !weight || !k->start || !k->coef )
+        return -1;
+
+    for( int i = 0; i < dst_size; i++ )
+    {
+        double luma_pos = (dst.sub * i + dst.offset + 0.5) * luma_scale - 0.5;
+        double center = (luma_pos - src.offset) / src.sub;
+        int start = (int)floor( center - support ) + 1;
+        double sum = 0;
+        for( int j = 0; j < taps; j++ )
+        {
+            weight[j] = kernel_func( method, (start + j - center) / scale );
+            sum += weight[j];
+        }
+        int16_t *coef = k->coef + i * taps;
+        int isum = 0, max = 0;
+        for( int j = 0; j < taps; j++ )
+        {
+            coef[j] = lrint( weight[j] / sum * (1 << COEF_BITS) );
+            isum += coef[j];
+            if( coef[j] > coef[max] )
+                max = j;
+        }
+        /* make the coefficients sum to unity exactly */
+        coef[max] += (1 << COEF_BITS) - isum;
+        k->start[i] = start;
+        k->pad_left = X264_MAX( k->pad_left, -start );
+        k->pad_right = X264_MAX( k->pad_right, start + taps - src_size );
+    }
+    free( weight );
+    return 0;
+}
+
+static void free_kernel( resample_kernel_t *k )
+{
+    free( k->start );
+    free( k->coef );
+}
+
+static void filter_row_h( int16_t *dst, int16_t *src, resample_kernel_t *k )
+{
+    for( int i = 0; i < k->dst_size; i++ )
+    {
+        int16_t *s = src + k->start[i];
+        int16_t *c = k->coef + i * k->taps;
+        int sum = 0;
+        int j = 0;
+#if defined(__SSE2__)
+        __m128i acc = _mm_setzero_si128();
+        for( ; j < k->taps; j += 8 )
+            acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_loadu_si128( (__m128i*)(s+j) ), _mm_loadu_si128( (__m128i*)(c+j) ) ) );
+        acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        sum = _mm_cvtsi128_si32( acc );
+#endif
+        for( ; j < k->taps; j++ )
+            sum += s[j] * c[j];
+        dst[i] = x264_clip3( (sum + (1 << (COEF_BITS-1))) >> COEF_BITS, INT16_MIN, INT16_MAX );
+    }
+}
+
+static void filter_row_v( uint8_t *dst, int16_t **src, int16_t *coef, int taps, int width, int high_depth )
+{
+    const int shift = COEF_BITS + MID_BITS - (high_depth ? 16 : 8);
+    const int round = 1 << (shift - 1);
+    const int max = high_depth ? 65535 : 255;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i vshift = _mm_cvtsi32_si128( shift );
+    const __m128i vround = _mm_set1_epi32( round );
+    for( ; x <= width-8; x += 8 )
+    {
+        __m128i lo = vround, hi = vround;
+        for( int j = 0; j < taps; j += 2 )
+        {
+            __m128i a = _mm_loadu_si128( (__m128i*)(src[j]+x) );
+            __m128i b = _mm_loadu_si128( (__m128i*)(src[j+1]+x) );
+            __m128i c = _mm_set1_epi32( (uint16_t)coef[j] | (coef[j+1] << 16) );
+            lo = _mm_add_epi32( lo, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), c ) );
+            hi = _mm_add_epi32( hi, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), c ) );
+        }
+        lo = _mm_sra_epi32( lo, vshift );
+        hi = _mm_sra_epi32( hi, vshift );
+        if( high_depth )
+        {
+            /* unsigned saturation to 16 bits using the signed pack */
+            const __m128i bias32 = _mm_set1_epi32( 0x8000 );
+            const __m128i bias16 = _mm_set1_epi16( (int16_t)0x8000 );
+            __m128i v = _mm_packs_epi32( _mm_sub_epi32( lo, bias32 ), _mm_sub_epi32( hi, bias32 ) );
+            _mm_storeu_si128( (__m128i*)(dst+2*x), _mm_xor_si128( v, bias16 ) );
+        }
+        else
+        {
+            __m128i v = _mm_packs_epi32( lo, hi );
+            _mm_storel_epi64( (__m128i*)(dst+x), _mm_packus_epi16( v, v ) );
+        }
+    }
+#endif
+    for( ; x < width; x++ )
+    {
+        int sum = round;
+        for( int j = 0; j < taps; j++ )
+            sum += src[j][x] * coef[j];
+        int v = x264_clip3( sum >> shift, 0, max );
+        if( high_depth )
+            ((uint16_t*)dst)[x] = v;
+        else
+            dst[x] = v;
+    }
+}
+
+static void load_row( int16_t *dst, uint8_t *src, int width, int pad_left, int pad_right, int high_depth )
+{
+    if( high_depth )
+        for( int x = 0; x < width; x++ )
+            dst[x] = ((uint16_t*)src)[x] >> (16 - MID_BITS);
+    else
+        for( int x = 0; x < width; x++ )
+            dst[x] = src[x] << (MID_BITS - 8);
+    for( int x = 1; x <= pad_left; x++ )
+        dst[-x] = dst[0];
+    for( int x = 0; x < pad_right; x++ )
+        dst[width+x] = dst[width-1];
+}
+
+static void resample_plane( resample_hnd_t *h, cli_image_t *out, cli_image_t *img, int plane )
+{
+    int src_plane = h->swap_src_chroma && plane ? 3 - plane : plane;
+    resample_kernel_t *hk = &h->hkernel[plane];
+    int16_t *row = h->row + hk->pad_left;
+    for( int field = 0; field < h->fields; field++ )
+    {
+        resample_kernel_t *vk = &h->vkernel[plane][field];
+        int src_stride = img->stride[src_plane] * h->fields;
+        int dst_stride = out->stride[plane] * h->fields;
+        uint8_t *src = img->plane[src_plane] + field * img->stride[src_plane];
+        uint8_t *dst = out->plane[plane] + field * out->stride[plane];
+        int src_height = h->src_height[plane];
+
+        for( int y = 0; y < src_height; y++ )
+        {
+            load_row( row, src + y * src_stride, h->src_width[plane], hk->pad_left, hk->pad_right, h->high_depth );
+            filter_row_h( h->mid + y * hk->dst_size, row, hk );
+        }
+        for( int y = 0; y < vk->dst_size; y++ )
+        {
+            for( int j = 0; j < vk->taps; j++ )
+                h->mid_rows[j] = h->mid + x264_clip3( vk->start[y] + j, 0, src_height - 1 ) * hk->dst_size;
+            filter_row_v( dst + y * dst_stride, h->mid_rows, vk->coef + y * vk->taps, vk->taps, hk->dst_size, h->high_depth );
+        }
+    }
+}
+
+static int get_frame( hnd_t handle, cli_pic_t *output, int frame )
+{
+    resample_hnd_t *h = handle;
+    if( h->prev_filter.get_frame( h->prev_hnd, output, frame ) )
+        return -1;
+    for( int i = 0; i < 3; i++ )
+        resample_plane( h, &h->buffer.img, &output->img, i );
+    output->img = h->buffer.img;
+    return 0;
+}
+
+static int release_frame( hnd_t handle, cli_pic_t *pic, int frame )
+{
+    resample_hnd_t *h = handle;
+    return h->prev_filter.release_frame( h->prev_hnd, pic, frame );
+}
+
+static void free_filter( hnd_t handle )
+{
+    resample_hnd_t *h = handle;
+    h->prev_filter.free( h->prev_hnd );
+    for( int i = 0; i < 3; i++ )
+    {
+        free_kernel( &h->hkernel[i] );
+        free_kernel( &h->vkernel[i][0] );
+        free_kernel( &h->vkernel[i][1] );
+    }
+    free( h->row );
+    free( h->mid );
+    free( h->mid_rows );
+    x264_cli_pic_clean( &h->buffer );
+    free( h );
+}
+
+static int csp_to_planar( int csp )
+{
+    switch( csp & X264_CSP_MASK )
+    {
+        case X264_CSP_I420: case X264_CSP_YV12: return X264_CSP_I420;
+        case X264_CSP_I422: case X264_CSP_YV16: return X264_CSP_I422;
+        case X264_CSP_I444: case X264_CSP_YV24: return X264_CSP_I444;
+        default: return X264_CSP_NONE;
+    }
+}
+
+static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x264_param_t *param, char *opt_string )
+{
+    static const char *optlist[] = { "width", "height", "csp", "method", "interlaced", NULL };
+    char **opts = x264_split_options( opt_string, optlist );
+    if( !opts )
+        return -1;
+
+    int src_csp = csp_to_planar( info->csp );
+    FAIL_IF_ERROR( src_csp == X264_CSP_NONE || info->csp & X264_CSP_OTHER,
+                   "only planar yuv input is supported\n" )
+
+    int width  = x264_otoi( x264_get_option( "width", opts ), info->width );
+    int height = x264_otoi( x264_get_option( "height", opts ), info->height );
+    int dst_csp = src_csp;
+    char *str_csp = x264_get_option( "csp", opts );
+    if( str_csp )
+    {
+        dst_csp = !strcasecmp( str_csp, "i420" ) ? X264_CSP_I420 :
+                  !strcasecmp( str_csp, "i422" ) ? X264_CSP_I422 :
+                  !strcasecmp( str_csp, "i444" ) ? X264_CSP_I444 : X264_CSP_NONE;
+        FAIL_IF_ERROR( dst_csp == X264_CSP_NONE, "invalid csp `%s'\n", str_csp )
+    }
+    char *str_method = x264_otos( x264_get_option( "method", opts ), (char*)method_names[METHOD_BICUBIC] );
+    int method;
+    for( method = 0; method_names[method] && strcasecmp( method_names[method], str_method ); method++ );
+    FAIL_IF_ERROR( !method_names[method], "invalid method `%s'\n", str_method )
+    int interlaced = x264_otob( x264_get_option( "interlaced", opts ), info->interlaced );
+    x264_free_string_array( opts );
+
+    const x264_cli_csp_t *src_desc = x264_cli_get_csp( src_csp );
+    const x264_cli_csp_t *dst_desc = x264_cli_get_csp( dst_csp );
+    FAIL_IF_ERROR( width <= 0 || height <= 0, "invalid resolution %dx%d\n", width, height )
+    FAIL_IF_ERROR( width % dst_desc->mod_width || height % (dst_desc->mod_height << interlaced),
+                   "resolution %dx%d is not a multiple of %dx%d\n", width, height,
+                   dst_desc->mod_width, dst_desc->mod_height << interlaced )
+    FAIL_IF_ERROR( info->height % (src_desc->mod_height << interlaced),
+                   "input height %d is not a multiple of %d\n", info->height, src_desc->mod_height << interlaced )
+
+    /* nothing to do */
+    if( width == info->width && height == info->height && dst_csp == (info->csp & X264_CSP_MASK) )
+        return 0;
+
+    resample_hnd_t *h = calloc( 1, sizeof(resample_hnd_t) );
+    if( !h )
+        return -1;
+    h->high_depth = !!(info->csp & X264_CSP_HIGH_DEPTH);
+    h->fields = interlaced ? 2 : 1;
+    int src_mask = info->csp & X264_CSP_MASK;
+    h->swap_src_chroma = src_mask == X264_CSP_YV12 || src_mask == X264_CSP_YV16 || src_mask == X264_CSP_YV24;
+
+    int max_row = 0, max_taps = 0;
+    for( int i = 0; i < 3; i++ )
+    {
+        siting_t src_h = { src_desc->width[i] < 1 ? 2 : 1, 0 };
+        siting_t dst_h = { dst_desc->width[i] < 1 ? 2 : 1, 0 };
+        h->src_width[i]  = info->width * src_desc->width[i];
+        h->src_height[i] = info->height * src_desc->height[i] / h->fields;
+        if( init_kernel( &h->hkernel[i], method, h->src_width[i], width * dst_desc->width[i],
+                         (double)info->width / width, src_h, dst_h, 8 ) )
+            return -1;
+        max_row = X264_MAX( max_row, h->hkernel[i].pad_left + h->src_width[i] + h->hkernel[i].pad_right );
+
+        for( int field = 0; field < h->fields; field++ )
+        {
+            /* 4:2:0 chroma sits between luma lines, or at 1/4 and 3/4 between the lines of each field */
+            double offset_420 = interlaced ? 0.25 + 0.5 * field : 0.5;
+            siting_t src_v = { src_desc->height[i] < 1 ? 2 : 1, src_desc->height[i] < 1 ? offset_420 : 0 };
+            siting_t dst_v = { dst_desc->height[i] < 1 ? 2 : 1, dst_desc->height[i] < 1 ? offset_420 : 0 };
+            if( init_kernel( &h->vkernel[i][field], method, h->src_height[i], height * dst_desc->height[i] / h->fields,
+                             (double)info->height / height, src_v, dst_v, 2 ) )
+                return -1;
+            max_taps = X264_MAX( max_taps, h->vkernel[i][field].taps );
+        }
+    }
+
+    h->row = malloc( (max_row + 8) * sizeof(int16_t) );
+    h->mid = malloc( (int64_t)h->src_height[0] * width * sizeof(int16_t) );
+    h->mid_rows = malloc( max_taps * sizeof(int16_t*) );
+    if( !h->row || !h->mid || !h->mid_rows )
+        return -1;
+    dst_csp |= info->csp & X264_CSP_HIGH_DEPTH;
+    if( x264_cli_pic_alloc_aligned( &h->buffer, dst_csp, width, height ) )
+        return -1;
+
+    x264_cli_log( NAME, X264_LOG_INFO, "resampling %dx%d %s to %dx%d %s (%s%s)\n", info->width, info->height,
+                  src_desc->name, width, height, dst_desc->name, method_names[method], interlaced ? ", per field" : "" );
+
+    /* keep the display aspect ratio */
+    if( info->sar_width && info->sar_height && (width != info->width || height != info->height) )
+    {
+        uint64_t sar_width  = (uint64_t)info->sar_width * info->width * height;
+        uint64_t sar_height = (uint64_t)info->sar_height * info->height * width;
+        uint64_t g = gcd( sar_width, sar_height );
+        info->sar_width  = sar_width / g;
+        info->sar_height = sar_height / g;
+    }
+    info->width  = width;
+    info->height = height;
+    info->csp    = dst_csp;
+    info->frame_refs = 1;
+
+    h->prev_filter = *filter;
+    h->prev_hnd = *handle;
+    *handle = h;
+    *filter = resample_filter;
+
+    return 0;
+}
+
+cli_vid_filter_t resample_filter = { NAME, help, init, get_frame, release_frame, free_filter, NULL };
@@ -506,6 +506,7 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
     info->width     = h->dst.width;
     info->height    = h->dst.height;
     info->fullrange = h->dst.range;
+    info->frame_refs = 1;
 
     h->prev_filter = *filter;
     h->prev_hnd = *handle;
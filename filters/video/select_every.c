@@ -97,6 +97,10 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
     }
     if( x264_init_vid_filter( "cache", handle, filter, info, param, (void*)max_rewind ) )
         return -1;
+    /* frames held downstream span step_size/pattern_len times as many upstream frames,
+     * which only frames that stay valid until released can afford */
+    if( info->frame_refs != INT_MAX )
+        info->frame_refs = 1;
 
     /* done initing, overwrite properties */
     if( h->step_size != h->pattern_len )
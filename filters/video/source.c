@@ -26,11 +26,23 @@
 #include "video.h"
 
 /* This filter converts the demuxer API into the filtering API for video frames.
- * Backseeking is prohibited here as not all demuxers are capable of doing so. */
+ * Backseeking is prohibited here as not all demuxers are capable of doing so.
+ * Demuxers that are safe for threaded input keep their pictures independent of each other,
+ * so frames are read into pictures from a pool that grows on demand and stay valid until
+ * they are released. Other demuxers reuse a single picture. */
 
 typedef struct
 {
     cli_pic_t pic;
+    int frame; /* frame held downstream, -1 when free */
+} source_pic_t;
+
+typedef struct
+{
+    source_pic_t *pic;
+    int num_pics;
+    int b_pool;
+    int csp, width, height;
     hnd_t hin;
     int cur_frame;
 } source_hnd_t;
@@ -43,32 +55,74 @@ static int init( hnd_t *handle, cli_vid_filter_t *filter, video_info_t *info, x2
     if( !h )
         return -1;
     h->cur_frame = -1;
+    h->b_pool = info->thread_safe;
+    h->csp = info->csp;
+    h->width = info->width;
+    h->height = info->height;
 
-    if( cli_input.picture_alloc( &h->pic, info->csp, info->width, info->height ) )
+    h->pic = calloc( 1, sizeof(source_pic_t) );
+    if( !h->pic || cli_input.picture_alloc( &h->pic[0].pic, info->csp, info->width, info->height ) )
         return -1;
+    h->pic[0].frame = -1;
+    h->num_pics = 1;
 
     h->hin = *handle;
     *handle = h;
     *filter = source_filter;
+    if( h->b_pool )
+        info->frame_refs = INT_MAX;
 
     return 0;
 }
 
+static source_pic_t *get_pic( source_hnd_t *h )
+{
+    if( !h->b_pool )
+        return &h->pic[0];
+    for( int i = 0; i < h->num_pics; i++ )
+        if( h->pic[i].frame < 0 )
+            return &h->pic[i];
+    source_pic_t *pic = realloc( h->pic, (h->num_pics+1) * sizeof(source_pic_t) );
+    if( !pic )
+        return NULL;
+    h->pic = pic;
+    pic += h->num_pics;
+    memset( pic, 0, sizeof(source_pic_t) );
+    if( cli_input.picture_alloc( &pic->pic, h->csp, h->width, h->height ) )
+        return NULL;
+    pic->frame = -1;
+    h->num_pics++;
+    return pic;
+}
+
 static int get_frame( hnd_t handle, cli_pic_t *output, int frame )
 {
     source_hnd_t *h = handle;
     /* do not allow requesting of frames from before the current position */
-    if( frame <= h->cur_frame || cli_input.read_frame( &h->pic, h->hin, frame ) )
+    if( frame <= h->cur_frame )
+        return -1;
+    source_pic_t *pic = get_pic( h );
+    if( !pic || cli_input.read_frame( &pic->pic, h->hin, frame ) )
         return -1;
     h->cur_frame = frame;
-    *output = h->pic;
+    if( h->b_pool )
+        pic->frame = frame;
+    *output = pic->pic;
     return 0;
 }
 
 static int release_frame( hnd_t handle, cli_pic_t *pic, int frame )
 {
     source_hnd_t *h = handle;
-    if( cli_input.release_frame && cli_input.release_frame( &h->pic, h->hin ) )
+    source_pic_t *src = &h->pic[0];
+    if( h->b_pool )
+    {
+        for( src = h->pic; src < h->pic + h->num_pics && src->frame != frame; src++ );
+        if( src == h->pic + h->num_pics )
+            return 0;
+        src->frame = -1;
+    }
+    if( cli_input.release_frame && cli_input.release_frame( &src->pic, h->hin ) )
         return -1;
     return 0;
 }
@@ -76,7 +130,13 @@ static int release_frame( hnd_t handle, cli_pic_t *pic, int frame )
 static void free_filter( hnd_t handle )
 {
     source_hnd_t *h = handle;
-    cli_input.picture_clean( &h->pic );
+    for( int i = 0; i < h->num_pics; i++ )
+    {
+        if( h->pic[i].frame >= 0 && cli_input.release_frame )
+            cli_input.release_frame( &h->pic[i].pic, h->hin );
+        cli_input.picture_clean( &h->pic[i].pic );
+    }
+    free( h->pic );
     cli_input.close_file( h->hin );
     free( h );
 }
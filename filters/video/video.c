@@ -50,8 +50,12 @@ void x264_register_vid_filters( void )
     REGISTER_VFILTER( crop );
     REGISTER_VFILTER( fix_vfr_pts );
     REGISTER_VFILTER( resize );
+    REGISTER_VFILTER( resample );
     REGISTER_VFILTER( select_every );
     REGISTER_VFILTER( depth );
+#if HAVE_THREAD
+    REGISTER_VFILTER( pipe );
+#endif
 #if HAVE_GPL
 #endif
 }
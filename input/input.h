@@ -44,6 +44,7 @@ typedef struct
     int output_csp; /* convert to this csp, if applicable */
     int output_range; /* user desired output range */
     int input_range; /* user override input range */
+    int readahead; /* number of frames buffered by threaded input */
 } cli_input_opt_t;
 
 /* properties of the source given by the demuxer */
@@ -64,6 +65,10 @@ typedef struct
     uint32_t timebase_num;
     uint32_t timebase_den;
     int vfr;
+    int frame_refs;  /* frames fetched from the filter chain stay valid until released, as long as no frame
+                      * frame_refs or more after the oldest unreleased one is requested. releases may happen
+                      * in any order. 0 and 1 mean a frame is only valid until the next request,
+                      * INT_MAX that it stays valid until released */
 } video_info_t;
 
 /* image data type used by x264cli */
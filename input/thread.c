@@ -26,52 +26,121 @@
 
 #include "input.h"
 
+#define DEFAULT_READAHEAD 4
+#define MAX_READAHEAD 64
+
+typedef struct
+{
+    cli_pic_t pic;
+    int status;
+} thread_slot_t;
+
 typedef struct
 {
     cli_input_t input;
     hnd_t p_handle;
-    cli_pic_t pic;
-    x264_threadpool_t *pool;
-    int next_frame;
     int frame_total;
-    struct thread_input_arg_t *next_args;
+
+    /* ring of frames read ahead of the consumer: frames [head, head+filled)
+     * are ready in slot[frame % depth], the reader thread fetches next_read = head+filled */
+    thread_slot_t *slot;
+    int depth;
+    int head;
+    int filled;
+    int next_read;
+    int b_reading;
+    int b_eof;
+    int b_exit;
+
+    x264_pthread_t thread;
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t cv_fill;  /* signalled by the reader when a frame is ready */
+    x264_pthread_cond_t cv_space; /* signalled by the consumer when a slot is free */
+
+    /* statistics */
+    int64_t requests;
+    int64_t fill_sum;
+    int fill_max;
+    int consumer_stalls;
+    int64_t consumer_stall_time;
+    int reader_stalls;
 } thread_hnd_t;
 
-typedef struct thread_input_arg_t
+static void *read_frame_thread( thread_hnd_t *h )
 {
-    thread_hnd_t *h;
-    cli_pic_t *pic;
-    int i_frame;
-    int status;
-} thread_input_arg_t;
+    x264_pthread_mutex_lock( &h->mutex );
+    while( 1 )
+    {
+        int b_stalled = 0;
+        while( !h->b_exit && (h->b_eof || h->filled == h->depth || (h->frame_total && h->next_read >= h->frame_total)) )
+        {
+            /* backpressure: only count waits caused by a full ring */
+            if( !b_stalled && h->filled == h->depth && !h->b_eof )
+            {
+                h->reader_stalls++;
+                b_stalled = 1;
+            }
+            x264_pthread_cond_wait( &h->cv_space, &h->mutex );
+        }
+        if( h->b_exit )
+            break;
+        int frame = h->next_read;
+        thread_slot_t *slot = &h->slot[frame % h->depth];
+        h->b_reading = 1;
+        x264_pthread_mutex_unlock( &h->mutex );
+
+        int status = h->input.read_frame( &slot->pic, h->p_handle, frame );
+
+        x264_pthread_mutex_lock( &h->mutex );
+        h->b_reading = 0;
+        slot->status = status;
+        h->next_read++;
+        h->filled++;
+        /* stop reading ahead past the first failure, which normally is the end of the stream */
+        h->b_eof = !!status;
+        x264_pthread_cond_broadcast( &h->cv_fill );
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+    return NULL;
+}
 
 static int open_file( char *psz_filename, hnd_t *p_handle, video_info_t *info, cli_input_opt_t *opt )
 {
-    thread_hnd_t *h = malloc( sizeof(thread_hnd_t) );
-    FAIL_IF_ERR( !h || cli_input.picture_alloc( &h->pic, info->csp, info->width, info->height ),
-                 "x264", "malloc failed\n" )
+    thread_hnd_t *h = calloc( 1, sizeof(thread_hnd_t) );
+    FAIL_IF_ERR( !h, "x264", "malloc failed\n" )
     h->input = cli_input;
     h->p_handle = *p_handle;
-    h->next_frame = -1;
-    h->next_args = malloc( sizeof(thread_input_arg_t) );
-    if( !h->next_args )
-        return -1;
-    h->next_args->h = h;
-    h->next_args->status = 0;
     h->frame_total = info->num_frames;
+    h->depth = opt && opt->readahead > 0 ? X264_MIN( opt->readahead, MAX_READAHEAD ) : DEFAULT_READAHEAD;
+    if( h->frame_total )
+        h->depth = X264_MIN( h->depth, h->frame_total );
     thread_input.picture_alloc = h->input.picture_alloc;
     thread_input.picture_clean = h->input.picture_clean;
 
-    if( x264_threadpool_init( &h->pool, 1, NULL, NULL ) )
+    h->slot = calloc( h->depth, sizeof(thread_slot_t) );
+    FAIL_IF_ERR( !h->slot, "x264", "malloc failed\n" )
+    for( int i = 0; i < h->depth; i++ )
+        FAIL_IF_ERR( h->input.picture_alloc( &h->slot[i].pic, info->csp, info->width, info->height ),
+                     "x264", "malloc failed\n" )
+
+    if( x264_pthread_mutex_init( &h->mutex, NULL ) ||
+        x264_pthread_cond_init( &h->cv_fill, NULL ) ||
+        x264_pthread_cond_init( &h->cv_space, NULL ) ||
+        x264_pthread_create( &h->thread, NULL, (void*)read_frame_thread, h ) )
         return -1;
 
     *p_handle = h;
     return 0;
 }
 
-static void read_frame_thread_int( thread_input_arg_t *i )
+/* must be called with the mutex held and the reader idle */
+static void drop_head( thread_hnd_t *h )
 {
-    i->status = i->h->input.read_frame( i->pic, i->h->p_handle, i->i_frame );
+    thread_slot_t *slot = &h->slot[h->head % h->depth];
+    if( !slot->status && h->input.release_frame )
+        h->input.release_frame( &slot->pic, h->p_handle );
+    h->head++;
+    h->filled--;
 }
 
 static int read_frame( cli_pic_t *p_pic, hnd_t handle, int i_frame )
@@ -79,26 +148,49 @@ static int read_frame( cli_pic_t *p_pic, hnd_t handle, int i_frame )
     thread_hnd_t *h = handle;
     int ret = 0;
 
-    if( h->next_frame >= 0 )
+    x264_pthread_mutex_lock( &h->mutex );
+    if( i_frame != h->head )
     {
-        x264_threadpool_wait( h->pool, h->next_args );
-        ret |= h->next_args->status;
+        /* the request does not match the read-ahead position; discard what we have
+         * and restart the reader at the requested frame */
+        while( h->b_reading )
+            x264_pthread_cond_wait( &h->cv_fill, &h->mutex );
+        while( h->filled && h->head < i_frame )
+            drop_head( h );
+        if( h->head != i_frame )
+        {
+            while( h->filled )
+                drop_head( h );
+            h->head = h->next_read = i_frame;
+            h->b_eof = 0;
+            x264_pthread_cond_broadcast( &h->cv_space );
+        }
     }
 
-    if( h->next_frame == i_frame )
-        XCHG( cli_pic_t, *p_pic, h->pic );
-    else
-        ret |= h->input.read_frame( p_pic, h->p_handle, i_frame );
+    h->requests++;
+    h->fill_sum += h->filled;
+    h->fill_max = X264_MAX( h->fill_max, h->filled );
+    if( !h->filled )
+    {
+        int64_t start = x264_mdate();
+        h->consumer_stalls++;
+        while( !h->filled && (h->b_reading || !(h->b_eof || (h->frame_total && h->next_read >= h->frame_total))) )
+            x264_pthread_cond_wait( &h->cv_fill, &h->mutex );
+        h->consumer_stall_time += x264_mdate() - start;
+    }
 
-    if( !h->frame_total || i_frame+1 < h->frame_total )
+    if( h->filled )
     {
-        h->next_frame =
-        h->next_args->i_frame = i_frame+1;
-        h->next_args->pic = &h->pic;
-        x264_threadpool_run( h->pool, (void*)read_frame_thread_int, h->next_args );
+        thread_slot_t *slot = &h->slot[h->head % h->depth];
+        XCHG( cli_pic_t, *p_pic, slot->pic );
+        ret = slot->status;
+        h->head++;
+        h->filled--;
+        x264_pthread_cond_broadcast( &h->cv_space );
     }
     else
-        h->next_frame = -1;
+        ret = -1;
+    x264_pthread_mutex_unlock( &h->mutex );
 
     return ret;
 }
@@ -114,10 +206,26 @@ static int release_frame( cli_pic_t *pic, hnd_t handle )
 static int close_file( hnd_t handle )
 {
     thread_hnd_t *h = handle;
-    x264_threadpool_delete( h->pool );
+    x264_pthread_mutex_lock( &h->mutex );
+    h->b_exit = 1;
+    x264_pthread_cond_broadcast( &h->cv_space );
+    x264_pthread_mutex_unlock( &h->mutex );
+    x264_pthread_join( h->thread, NULL );
+
+    if( h->requests )
+        x264_cli_log( "x264", X264_LOG_DEBUG, "threaded input: read-ahead %d, avg fill %.1f, max fill %d, "
+                      "%d input stalls (%.3fs), %d reader stalls\n", h->depth, (double)h->fill_sum / h->requests,
+                      h->fill_max, h->consumer_stalls, h->consumer_stall_time / 1000000.0, h->reader_stalls );
+
+    while( h->filled )
+        drop_head( h );
     h->input.close_file( h->p_handle );
-    h->input.picture_clean( &h->pic );
-    free( h->next_args );
+    for( int i = 0; i < h->depth; i++ )
+        h->input.picture_clean( &h->slot[i].pic );
+    x264_pthread_cond_destroy( &h->cv_space );
+    x264_pthread_cond_destroy( &h->cv_fill );
+    x264_pthread_mutex_destroy( &h->mutex );
+    free( h->slot );
     free( h );
     return 0;
 }
@@ -32,6 +32,8 @@
 typedef struct
 {
     int use_dts_compress;
+    int mux_rate;
+    int output_buffer; /* KiB buffered by threaded output */
 } cli_output_opt_t;
 
 typedef struct
@@ -47,5 +49,9 @@ extern const cli_output_t raw_output;
 extern const cli_output_t mkv_output;
 extern const cli_output_t mp4_output;
 extern const cli_output_t flv_output;
+extern const cli_output_t ts_output;
+extern const cli_output_t thread_output;
+
+extern cli_output_t cli_output;
 
 #endif
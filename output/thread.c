@@ -0,0 +1,250 @@
+/*****************************************************************************
+ * thread.c: threaded output
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+#include "output.h"
+
+#define DEFAULT_BUFFER_SIZE (8*1024) /* KiB */
+#define MAX_QUEUED_FRAMES 1024
+
+typedef struct
+{
+    x264_picture_t pic;
+    int64_t pos;
+    int size;
+} thread_frame_t;
+
+typedef struct
+{
+    cli_output_t output;
+    hnd_t p_handle;
+    int b_raw;
+
+    /* frames [head, tail) are queued in frame[i % MAX_QUEUED_FRAMES], their data in the ring
+     * buffer at byte positions [read_pos, write_pos) modulo buffer_size.  A frame never wraps
+     * around the end of the buffer, the space it skips is freed with the frame. */
+    thread_frame_t *frame;
+    int64_t head;
+    int64_t tail;
+    uint8_t *buffer;
+    int64_t buffer_size;
+    int64_t read_pos;
+    int64_t write_pos;
+    int b_writing;
+    int b_error;
+    int b_exit;
+
+    x264_pthread_t thread;
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t cv_fill;  /* signalled by the encoder when a frame is queued */
+    x264_pthread_cond_t cv_space; /* signalled by the writer when frames are written */
+
+    /* statistics */
+    int64_t frames;
+    int64_t writes;
+    int64_t fill_max;
+    int encoder_stalls;
+    int64_t encoder_stall_time;
+} thread_hnd_t;
+
+static void *write_frame_thread( thread_hnd_t *h )
+{
+    x264_pthread_mutex_lock( &h->mutex );
+    while( 1 )
+    {
+        while( !h->b_exit && h->head == h->tail )
+            x264_pthread_cond_wait( &h->cv_fill, &h->mutex );
+        if( h->head == h->tail )
+            break;
+        int64_t tail = h->tail;
+        h->b_writing = 1;
+        x264_pthread_mutex_unlock( &h->mutex );
+
+        /* Write everything queued so far.  Raw output has no framing of its own, so frames that are
+         * contiguous in the buffer go out in a single write. */
+        int b_error = 0;
+        int writes = 0;
+        for( int64_t i = h->head; i < tail && !b_error; )
+        {
+            thread_frame_t *f = &h->frame[i++ % MAX_QUEUED_FRAMES];
+            int64_t size = f->size;
+            while( h->b_raw && i < tail && h->frame[i % MAX_QUEUED_FRAMES].pos == f->pos + size &&
+                   size + h->frame[i % MAX_QUEUED_FRAMES].size <= INT_MAX )
+                size += h->frame[i++ % MAX_QUEUED_FRAMES].size;
+            b_error = h->output.write_frame( h->p_handle, h->buffer + f->pos % h->buffer_size, size,
+                                             &h->frame[(i-1) % MAX_QUEUED_FRAMES].pic ) < 0;
+            writes++;
+        }
+
+        x264_pthread_mutex_lock( &h->mutex );
+        h->b_writing = 0;
+        h->b_error |= b_error;
+        h->writes += writes;
+        h->read_pos = h->frame[(tail-1) % MAX_QUEUED_FRAMES].pos + h->frame[(tail-1) % MAX_QUEUED_FRAMES].size;
+        h->head = tail;
+        x264_pthread_cond_broadcast( &h->cv_space );
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+    return NULL;
+}
+
+/* must be called with the mutex held */
+static int has_space( thread_hnd_t *h, int64_t pos, int size )
+{
+    /* with an empty queue, the space skipped to avoid wrapping is free as well */
+    return h->head == h->tail || (pos + size - h->read_pos <= h->buffer_size && h->tail - h->head < MAX_QUEUED_FRAMES);
+}
+
+/* must be called with the mutex held */
+static void wait_idle( thread_hnd_t *h )
+{
+    while( h->head != h->tail || h->b_writing )
+        x264_pthread_cond_wait( &h->cv_space, &h->mutex );
+}
+
+static int open_file( char *psz_filename, hnd_t *p_handle, cli_output_opt_t *opt )
+{
+    thread_hnd_t *h = calloc( 1, sizeof(thread_hnd_t) );
+    FAIL_IF_ERR( !h, "x264", "malloc failed\n" )
+    h->output = cli_output;
+    h->p_handle = *p_handle;
+    h->b_raw = !memcmp( &h->output, &raw_output, sizeof(cli_output_t) );
+    h->buffer_size = (int64_t)(opt && opt->output_buffer > 0 ? opt->output_buffer : DEFAULT_BUFFER_SIZE) * 1024;
+
+    h->frame = calloc( MAX_QUEUED_FRAMES, sizeof(thread_frame_t) );
+    h->buffer = malloc( h->buffer_size );
+    FAIL_IF_ERR( !h->frame || !h->buffer, "x264", "malloc failed\n" )
+
+    if( x264_pthread_mutex_init( &h->mutex, NULL ) ||
+        x264_pthread_cond_init( &h->cv_fill, NULL ) ||
+        x264_pthread_cond_init( &h->cv_space, NULL ) ||
+        x264_pthread_create( &h->thread, NULL, (void*)write_frame_thread, h ) )
+        return -1;
+
+    *p_handle = h;
+    return 0;
+}
+
+/* Parameters and headers are written before the first frame, but wait for the queue
+ * anyway so that the muxer is never called from two threads at once. */
+static int set_param( hnd_t handle, x264_param_t *p_param )
+{
+    thread_hnd_t *h = handle;
+    x264_pthread_mutex_lock( &h->mutex );
+    wait_idle( h );
+    x264_pthread_mutex_unlock( &h->mutex );
+    return h->output.set_param( h->p_handle, p_param );
+}
+
+static int write_headers( hnd_t handle, x264_nal_t *p_nal )
+{
+    thread_hnd_t *h = handle;
+    x264_pthread_mutex_lock( &h->mutex );
+    wait_idle( h );
+    x264_pthread_mutex_unlock( &h->mutex );
+    return h->output.write_headers( h->p_handle, p_nal );
+}
+
+static int write_frame( hnd_t handle, uint8_t *p_nalu, int i_size, x264_picture_t *p_picture )
+{
+    thread_hnd_t *h = handle;
+
+    x264_pthread_mutex_lock( &h->mutex );
+    if( i_size > h->buffer_size )
+    {
+        /* doesn't fit the buffer at all, write it from here once the queue is empty */
+        wait_idle( h );
+        int b_error = h->b_error;
+        x264_pthread_mutex_unlock( &h->mutex );
+        if( b_error || h->output.write_frame( h->p_handle, p_nalu, i_size, p_picture ) < 0 )
+            return -1;
+        h->frames++;
+        h->writes++;
+        return i_size;
+    }
+
+    int64_t pos = h->write_pos;
+    if( pos % h->buffer_size + i_size > h->buffer_size )
+        pos += h->buffer_size - pos % h->buffer_size;
+    /* backpressure: the encoder only waits once the buffer is full */
+    if( !h->b_error && !has_space( h, pos, i_size ) )
+    {
+        int64_t start = x264_mdate();
+        h->encoder_stalls++;
+        while( !h->b_error && !has_space( h, pos, i_size ) )
+            x264_pthread_cond_wait( &h->cv_space, &h->mutex );
+        h->encoder_stall_time += x264_mdate() - start;
+    }
+    if( h->b_error )
+    {
+        x264_pthread_mutex_unlock( &h->mutex );
+        return -1;
+    }
+    x264_pthread_mutex_unlock( &h->mutex );
+
+    /* the writer doesn't touch the space past read_pos + buffer_size */
+    memcpy( h->buffer + pos % h->buffer_size, p_nalu, i_size );
+
+    x264_pthread_mutex_lock( &h->mutex );
+    h->fill_max = X264_MAX( h->fill_max, h->head == h->tail ? i_size : pos + i_size - h->read_pos );
+    thread_frame_t *f = &h->frame[h->tail % MAX_QUEUED_FRAMES];
+    f->pic = *p_picture;
+    f->pos = pos;
+    f->size = i_size;
+    h->write_pos = pos + i_size;
+    h->tail++;
+    h->frames++;
+    x264_pthread_cond_broadcast( &h->cv_fill );
+    x264_pthread_mutex_unlock( &h->mutex );
+
+    return i_size;
+}
+
+static int close_file( hnd_t handle, int64_t largest_pts, int64_t second_largest_pts )
+{
+    thread_hnd_t *h = handle;
+    x264_pthread_mutex_lock( &h->mutex );
+    h->b_exit = 1;
+    x264_pthread_cond_broadcast( &h->cv_fill );
+    x264_pthread_mutex_unlock( &h->mutex );
+    x264_pthread_join( h->thread, NULL );
+
+    if( h->frames )
+        x264_cli_log( "x264", X264_LOG_DEBUG, "threaded output: buffer %"PRId64" KiB, max fill %"PRId64" KiB, "
+                      "%"PRId64" writes for %"PRId64" frames, %d encoder stalls (%.3fs)\n", h->buffer_size / 1024,
+                      h->fill_max / 1024, h->writes, h->frames, h->encoder_stalls, h->encoder_stall_time / 1000000.0 );
+    if( h->b_error )
+        x264_cli_log( "x264", X264_LOG_ERROR, "error writing frames to the output file\n" );
+
+    int ret = h->output.close_file( h->p_handle, largest_pts, second_largest_pts );
+    if( h->b_error )
+        ret = -1;
+    x264_pthread_cond_destroy( &h->cv_space );
+    x264_pthread_cond_destroy( &h->cv_fill );
+    x264_pthread_mutex_destroy( &h->mutex );
+    free( h->buffer );
+    free( h->frame );
+    free( h );
+    return ret;
+}
+
+const cli_output_t thread_output = { open_file, set_param, write_headers, write_frame, close_file };
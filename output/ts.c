@@ -0,0 +1,388 @@
+/*****************************************************************************
+ * ts.c: MPEG-2 transport stream muxer
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+#include "output.h"
+
+#define TS_PACKET_SIZE    188
+/* Packets are written in chunks of 47 pages of 4 KiB, which is also 1024 packets,
+ * so that every write of a regular file starts and ends on a page boundary. */
+#define TS_BUFFER_PACKETS 1024
+
+#define TS_PID_PAT        0x0000
+#define TS_PID_PMT        0x1000
+#define TS_PID_VIDEO      0x0100
+#define TS_PID_NULL       0x1fff
+
+#define TS_STREAM_MPEG2   0x02
+#define TS_STREAM_H264    0x1b
+
+/* PCR is in units of 27 MHz, PTS and DTS in units of 90 kHz (27 MHz / 300) */
+#define TS_CLOCK          INT64_C(27000000)
+#define TS_PCR_INTERVAL   (TS_CLOCK / 30)
+#define TS_PSI_INTERVAL   (TS_CLOCK / 10)
+#define TS_DEFAULT_DELAY  (TS_CLOCK / 2)
+
+enum
+{
+    CC_PAT,
+    CC_PMT,
+    CC_VIDEO,
+    CC_MAX
+};
+
+typedef struct
+{
+    FILE *fp;
+    uint8_t *buffer;
+    int i_buffered;           /* packets in buffer */
+    int b_error;
+
+    int i_stream_type;
+    int64_t i_mux_rate;       /* bit/s, 0 if the stream has a variable rate */
+    double d_timebase;
+    int64_t i_delay;          /* the earliest a frame is sent before its DTS */
+    int64_t i_init_dts;
+
+    int64_t i_frames;
+    int64_t i_packets;
+    int64_t i_null_packets;
+    int64_t i_late_frames;
+    int64_t i_time;           /* time of the current packet, if the rate is variable */
+    int64_t i_last_pcr;
+    int64_t i_last_psi;
+    uint8_t cc[CC_MAX];
+} ts_hnd_t;
+
+static uint32_t crc32_mpeg( const uint8_t *data, int size )
+{
+    uint32_t crc = 0xffffffff;
+    for( int i = 0; i < size; i++ )
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for( int j = 0; j < 8; j++ )
+            crc = (crc << 1) ^ (crc & 0x80000000 ? 0x04c11db7 : 0);
+    }
+    return crc;
+}
+
+/* Time at which the first byte of the next packet enters the decoder */
+static int64_t ts_time( ts_hnd_t *p_ts )
+{
+    if( !p_ts->i_mux_rate )
+        return p_ts->i_time;
+    return (double)p_ts->i_packets * TS_PACKET_SIZE * 8 * TS_CLOCK / p_ts->i_mux_rate;
+}
+
+static int flush_packets( ts_hnd_t *p_ts )
+{
+    if( p_ts->i_buffered && !p_ts->b_error &&
+        fwrite( p_ts->buffer, TS_PACKET_SIZE * p_ts->i_buffered, 1, p_ts->fp ) != 1 )
+        p_ts->b_error = 1;
+    p_ts->i_buffered = 0;
+    return p_ts->b_error ? -1 : 0;
+}
+
+/* Returns the next packet with its header written; the rest is left to the caller. */
+static uint8_t *next_packet( ts_hnd_t *p_ts, int pid, int b_start, int b_payload, int cc_idx )
+{
+    if( p_ts->i_buffered == TS_BUFFER_PACKETS )
+        flush_packets( p_ts );
+    uint8_t *p = p_ts->buffer + TS_PACKET_SIZE * p_ts->i_buffered++;
+    p_ts->i_packets++;
+
+    int cc = 0;
+    if( cc_idx >= 0 )
+    {
+        /* The counter only advances with packets that carry a payload */
+        cc = b_payload ? p_ts->cc[cc_idx]++ : p_ts->cc[cc_idx] - 1;
+        cc &= 15;
+    }
+    p[0] = 0x47;
+    p[1] = (b_start << 6) | (pid >> 8);
+    p[2] = pid;
+    p[3] = (b_payload ? 0x10 : 0x00) | cc; /* adaptation field flag is or'ed in by the caller */
+    return p;
+}
+
+static void write_pcr( uint8_t *p, int64_t pcr )
+{
+    uint64_t base = (pcr / 300) & ((INT64_C(1) << 33) - 1);
+    int ext = pcr % 300;
+    p[0] = base >> 25;
+    p[1] = base >> 17;
+    p[2] = base >> 9;
+    p[3] = base >> 1;
+    p[4] = (base << 7) | 0x7e | (ext >> 8);
+    p[5] = ext;
+}
+
+static void write_timestamp( uint8_t *p, int prefix, int64_t ts )
+{
+    ts &= (INT64_C(1) << 33) - 1;
+    p[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+    p[1] = ts >> 22;
+    p[2] = (ts >> 14) | 1;
+    p[3] = ts >> 7;
+    p[4] = (ts << 1) | 1;
+}
+
+/* PCR of a packet: the time of the byte holding the last bit of the PCR base */
+static int64_t packet_pcr( ts_hnd_t *p_ts )
+{
+    int64_t pcr = ts_time( p_ts );
+    if( p_ts->i_mux_rate )
+        pcr += (double)10 * 8 * TS_CLOCK / p_ts->i_mux_rate;
+    return pcr;
+}
+
+static void write_psi_packet( ts_hnd_t *p_ts, int pid, int cc_idx, uint8_t *section, int size )
+{
+    uint32_t crc = crc32_mpeg( section, size - 4 );
+    section[size-4] = crc >> 24;
+    section[size-3] = crc >> 16;
+    section[size-2] = crc >> 8;
+    section[size-1] = crc;
+
+    uint8_t *p = next_packet( p_ts, pid, 1, 1, cc_idx );
+    p[4] = 0; /* pointer_field */
+    memcpy( p + 5, section, size );
+    memset( p + 5 + size, 0xff, TS_PACKET_SIZE - 5 - size );
+}
+
+static void write_psi( ts_hnd_t *p_ts )
+{
+    uint8_t pat[16] =
+    {
+        0x00, 0xb0, sizeof(pat) - 3,        /* table_id, section_length */
+        0x00, 0x01, 0xc1, 0x00, 0x00,       /* transport_stream_id, version 0, current */
+        0x00, 0x01, 0xe0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xff,
+    };
+    write_psi_packet( p_ts, TS_PID_PAT, CC_PAT, pat, sizeof(pat) );
+
+    uint8_t pmt[21] =
+    {
+        0x02, 0xb0, sizeof(pmt) - 3,
+        0x00, 0x01, 0xc1, 0x00, 0x00,       /* program_number, version 0, current */
+        0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, /* PCR_PID */
+        0xf0, 0x00,                         /* no program descriptors */
+        p_ts->i_stream_type, 0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, 0xf0, 0x00,
+    };
+    write_psi_packet( p_ts, TS_PID_PMT, CC_PMT, pmt, sizeof(pmt) );
+
+    p_ts->i_last_psi = ts_time( p_ts );
+}
+
+/* Fill the mux rate with a PCR-only packet when a PCR is due, otherwise with a null packet */
+static void write_padding( ts_hnd_t *p_ts )
+{
+    if( ts_time( p_ts ) - p_ts->i_last_psi >= TS_PSI_INTERVAL )
+    {
+        write_psi( p_ts );
+        return;
+    }
+
+    uint8_t *p;
+    int64_t pcr = packet_pcr( p_ts );
+    if( pcr - p_ts->i_last_pcr >= TS_PCR_INTERVAL )
+    {
+        p = next_packet( p_ts, TS_PID_VIDEO, 0, 0, CC_VIDEO );
+        p[3] |= 0x20;
+        p[4] = TS_PACKET_SIZE - 5;
+        p[5] = 0x10;
+        write_pcr( p + 6, pcr );
+        memset( p + 12, 0xff, TS_PACKET_SIZE - 12 );
+        p_ts->i_last_pcr = pcr;
+    }
+    else
+    {
+        p = next_packet( p_ts, TS_PID_NULL, 0, 1, -1 );
+        memset( p + 4, 0xff, TS_PACKET_SIZE - 4 );
+        p_ts->i_null_packets++;
+    }
+}
+
+static void write_pes( ts_hnd_t *p_ts, uint8_t *data, int size, int64_t pts, int64_t dts, int b_keyframe )
+{
+    uint8_t header[19] = { 0x00, 0x00, 0x01, 0xe0 };
+    int header_size = pts != dts ? 19 : 14;
+    int pes_size = header_size - 6 + size;
+    if( pes_size > 0xffff )
+        pes_size = 0; /* unbounded, allowed for video */
+    header[4] = pes_size >> 8;
+    header[5] = pes_size;
+    header[6] = 0x84; /* data_alignment_indicator */
+    header[7] = pts != dts ? 0xc0 : 0x80;
+    header[8] = header_size - 9;
+    write_timestamp( header + 9, pts != dts ? 3 : 2, pts / 300 );
+    if( pts != dts )
+        write_timestamp( header + 14, 1, dts / 300 );
+
+    int b_start = 1;
+    int left = header_size + size;
+    while( left > 0 )
+    {
+        int64_t pcr = packet_pcr( p_ts );
+        int b_pcr = b_start ? !p_ts->i_mux_rate || pcr - p_ts->i_last_pcr >= TS_PCR_INTERVAL / 2
+                            : p_ts->i_mux_rate && pcr - p_ts->i_last_pcr >= TS_PCR_INTERVAL;
+        int b_rai = b_start && b_keyframe;
+        int af_size = b_pcr || b_rai ? 2 + (b_pcr ? 6 : 0) : 0;
+        int payload = X264_MIN( left, TS_PACKET_SIZE - 4 - af_size );
+        af_size = TS_PACKET_SIZE - 4 - payload;
+
+        uint8_t *p = next_packet( p_ts, TS_PID_VIDEO, b_start, 1, CC_VIDEO );
+        uint8_t *payload_start = p + 4 + af_size;
+        if( af_size )
+        {
+            p[3] |= 0x20;
+            p[4] = af_size - 1;
+            if( af_size > 1 )
+            {
+                uint8_t *af = p + 6;
+                p[5] = (b_rai ? 0x40 : 0) | (b_pcr ? 0x10 : 0);
+                if( b_pcr )
+                {
+                    write_pcr( af, pcr );
+                    p_ts->i_last_pcr = pcr;
+                    af += 6;
+                }
+                memset( af, 0xff, payload_start - af );
+            }
+        }
+
+        /* The PES header goes in the first packet: a TS payload is at least 176 bytes */
+        int done = header_size + size - left;
+        if( done < header_size )
+        {
+            memcpy( payload_start, header, header_size );
+            memcpy( payload_start + header_size, data, payload - header_size );
+        }
+        else
+            memcpy( payload_start, data + done - header_size, payload );
+        left -= payload;
+        b_start = 0;
+    }
+}
+
+static int open_file( char *psz_filename, hnd_t *p_handle, cli_output_opt_t *opt )
+{
+    *p_handle = NULL;
+    ts_hnd_t *p_ts = calloc( 1, sizeof(ts_hnd_t) );
+    if( !p_ts )
+        return -1;
+
+    p_ts->buffer = malloc( TS_PACKET_SIZE * TS_BUFFER_PACKETS );
+    if( !p_ts->buffer )
+        goto fail;
+    if( !strcmp( psz_filename, "-" ) )
+        p_ts->fp = stdout;
+    else if( !(p_ts->fp = x264_fopen( psz_filename, "w+b" )) )
+        goto fail;
+    /* Packets are already buffered in large chunks, write them without a copy */
+    setvbuf( p_ts->fp, NULL, _IONBF, 0 );
+
+    p_ts->i_mux_rate = (int64_t)opt->mux_rate * 1000;
+    p_ts->i_last_pcr = p_ts->i_last_psi = INT64_MIN / 2;
+    *p_handle = p_ts;
+    return 0;
+
+fail:
+    free( p_ts->buffer );
+    free( p_ts );
+    return -1;
+}
+
+static int set_param( hnd_t handle, x264_param_t *p_param )
+{
+    ts_hnd_t *p_ts = handle;
+
+    p_ts->i_stream_type = p_param->b_mpeg2 ? TS_STREAM_MPEG2 : TS_STREAM_H264;
+    p_ts->d_timebase = (double)p_param->i_timebase_num / p_param->i_timebase_den;
+
+    /* Send frames as early as the VBV would have them arrive */
+    p_ts->i_delay = TS_DEFAULT_DELAY;
+    if( p_param->rc.i_vbv_max_bitrate && p_param->rc.i_vbv_buffer_size )
+    {
+        double fill = p_param->rc.f_vbv_buffer_init;
+        if( fill > 1. )
+            fill /= p_param->rc.i_vbv_buffer_size;
+        p_ts->i_delay = fill * p_param->rc.i_vbv_buffer_size / p_param->rc.i_vbv_max_bitrate * TS_CLOCK;
+        if( p_ts->i_mux_rate && p_ts->i_mux_rate < p_param->rc.i_vbv_max_bitrate * 1000 )
+            x264_cli_log( "ts", X264_LOG_WARNING, "mux rate is lower than the VBV maxrate, frames will arrive late\n" );
+    }
+    else if( p_ts->i_mux_rate )
+        x264_cli_log( "ts", X264_LOG_WARNING, "constant mux rate without VBV, frames may arrive late\n" );
+
+    return 0;
+}
+
+static int write_headers( hnd_t handle, x264_nal_t *p_nal )
+{
+    /* Headers are repeated in the stream, as a receiver can tune in at any keyframe */
+    return 0;
+}
+
+static int write_frame( hnd_t handle, uint8_t *p_nalu, int i_size, x264_picture_t *p_picture )
+{
+    ts_hnd_t *p_ts = handle;
+
+    if( !p_ts->i_frames )
+        p_ts->i_init_dts = p_picture->i_dts;
+    int64_t dts = (p_picture->i_dts - p_ts->i_init_dts) * p_ts->d_timebase * TS_CLOCK + p_ts->i_delay;
+    int64_t pts = (p_picture->i_pts - p_ts->i_init_dts) * p_ts->d_timebase * TS_CLOCK + p_ts->i_delay;
+
+    if( p_ts->i_mux_rate )
+        while( ts_time( p_ts ) < dts - p_ts->i_delay )
+            write_padding( p_ts );
+    else
+        p_ts->i_time = dts - p_ts->i_delay;
+
+    if( p_picture->b_keyframe || ts_time( p_ts ) - p_ts->i_last_psi >= TS_PSI_INTERVAL )
+        write_psi( p_ts );
+    write_pes( p_ts, p_nalu, i_size, pts, dts, p_picture->b_keyframe );
+
+    if( p_ts->i_mux_rate && ts_time( p_ts ) > dts && !p_ts->i_late_frames++ )
+        x264_cli_log( "ts", X264_LOG_WARNING, "frame %"PRId64" arrives after its DTS, the mux rate is too low\n",
+                      p_ts->i_frames );
+    p_ts->i_frames++;
+
+    return p_ts->b_error ? -1 : i_size;
+}
+
+static int close_file( hnd_t handle, int64_t largest_pts, int64_t second_largest_pts )
+{
+    ts_hnd_t *p_ts = handle;
+    if( !p_ts )
+        return 0;
+
+    int ret = flush_packets( p_ts );
+    if( p_ts->i_mux_rate && p_ts->i_packets )
+        x264_cli_log( "ts", X264_LOG_INFO, "%"PRId64" packets, %.1f%% padding, %"PRId64" late frames\n",
+                      p_ts->i_packets, 100. * p_ts->i_null_packets / p_ts->i_packets, p_ts->i_late_frames );
+    if( p_ts->fp != stdout && fclose( p_ts->fp ) )
+        ret = -1;
+    free( p_ts->buffer );
+    free( p_ts );
+    return ret;
+}
+
+const cli_output_t ts_output = { open_file, set_param, write_headers, write_frame, close_file };
@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+"""
+End-to-end encoder throughput benchmark.
+
+Generates deterministic synthetic sequences, encodes each one over a matrix of
+presets x codecs x thread counts, and writes fps, per-stage time (from
+--profile-stages) and peak RSS to a JSON file.  Given a baseline produced by an
+earlier run, the results are compared against it and the exit status is
+non-zero if any configuration regressed by more than the tolerance.
+
+    tools/bench.py --x264 ./x264 -o bench.json
+    tools/bench.py --x264 ./x264 --baseline bench-base.json
+    tools/bench.py --compare bench-base.json bench.json
+
+"make bench" runs it on the freshly built binary; pass extra options with
+BENCHFLAGS="...".
+"""
+
+import argparse
+import json
+import math
+import os
+import platform
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+SEQUENCES = ("noise", "pan", "cuts", "interlaced", "422")
+PRESETS = ("ultrafast", "veryfast", "medium")
+CODECS = ("h264", "mpeg2")
+THREADS = (1, 4)
+
+# sequence generation
+
+class Plane(object):
+    """A textured plane larger than the frame, so that crops of it can pan."""
+
+    def __init__(self, rng, width, height, scale):
+        self.width = width
+        self.height = height
+        fx = rng.uniform(0.02, 0.09) / scale
+        fy = rng.uniform(0.02, 0.09) / scale
+        fxy = rng.uniform(0.002, 0.01) / scale
+        phase = rng.uniform(0, 2 * math.pi)
+        noise = rng.getrandbits(8 * width * height).to_bytes(width * height, "little")
+        rows = []
+        for y in range(height):
+            sy = 50 * math.sin(y * fy + phase)
+            base = y * width
+            rows.append(bytes(max(0, min(255, int(128 + 60 * math.sin(x * fx) + sy
+                                                  + 30 * math.sin((x + y) * (x - y) * fxy)
+                                                  + (noise[base + x] >> 4) - 8)))
+                              for x in range(width)))
+        self.data = b"".join(rows)
+
+    def crop(self, x, y, width, height, rows=None):
+        x %= self.width - width
+        y %= self.height - height
+        if rows is None:
+            rows = range(height)
+        return b"".join(self.data[(y + r) * self.width + x:(y + r) * self.width + x + width] for r in rows)
+
+
+class Sequence(object):
+    def __init__(self, name, width, height, frames, seed):
+        self.name = name
+        self.width = width
+        self.height = height
+        self.frames = frames
+        self.rng = random.Random(seed)
+        self.csp = "422" if name == "422" else "420"
+        self.interlaced = name == "interlaced"
+        # chroma subsampling shifts
+        self.cw = width >> 1
+        self.ch = height if self.csp == "422" else height >> 1
+
+    def options(self):
+        opts = []
+        if self.interlaced:
+            opts.append("--tff")
+        if self.csp == "422":
+            opts += ["--output-csp", "i422"]
+        return opts
+
+    def header(self):
+        return "YUV4MPEG2 W%d H%d F25:1 I%s A1:1 C%s\n" % (
+            self.width, self.height, "t" if self.interlaced else "p", "422" if self.csp == "422" else "420jpeg")
+
+    def textures(self, count):
+        margin = 256
+        planes = []
+        for i in range(count):
+            y = Plane(self.rng, self.width + margin, self.height + margin, 1.0)
+            u = Plane(self.rng, self.cw + margin // 2, self.ch + margin // 2, 0.5)
+            v = Plane(self.rng, self.cw + margin // 2, self.ch + margin // 2, 0.5)
+            planes.append((y, u, v))
+        return planes
+
+    def crop(self, planes, x, y, rows=None):
+        """Crop all three planes at luma position (x, y)."""
+        yp, up, vp = planes
+        cy = y if self.csp == "422" else y >> 1
+        crows = None
+        if rows is not None:
+            crows = rows if self.csp == "422" else [r for r in rows[::2] if r < self.ch]
+        return (yp.crop(x, y, self.width, self.height, rows) +
+                up.crop(x >> 1, cy, self.cw, self.ch, crows) +
+                vp.crop(x >> 1, cy, self.cw, self.ch, crows))
+
+    def frame(self, i):
+        if self.name == "noise":
+            size = self.width * self.height + 2 * self.cw * self.ch
+            return self.rng.getrandbits(8 * size).to_bytes(size, "little")
+        if self.name == "cuts":
+            scene = i // 12
+            return self.crop(self.scenes[scene % len(self.scenes)], 2 * (i % 12), i % 12)
+        if self.name == "interlaced":
+            # top and bottom fields are sampled half a frame apart, moving in opposite directions
+            top = self.crop(self.scenes[0], 4 * i, 2 * i)
+            bot = self.crop(self.scenes[0], 4 * i + 2, 2 * i + 1)
+            out = bytearray(top)
+            for plane, (w, h, off) in enumerate(((self.width, self.height, 0),
+                                                 (self.cw, self.ch, self.width * self.height),
+                                                 (self.cw, self.ch, self.width * self.height + self.cw * self.ch))):
+                for r in range(1, h, 2):
+                    out[off + r * w:off + (r + 1) * w] = bot[off + r * w:off + (r + 1) * w]
+            return bytes(out)
+        # pan, 422
+        return self.crop(self.scenes[0], 3 * i, i)
+
+    def write(self, path):
+        self.scenes = self.textures(4 if self.name == "cuts" else 1) if self.name != "noise" else None
+        tmp = path + ".tmp"
+        with open(tmp, "wb") as f:
+            f.write(self.header().encode("ascii"))
+            for i in range(self.frames):
+                f.write(b"FRAME\n")
+                f.write(self.frame(i))
+        os.rename(tmp, path)
+
+
+def sequence_path(args, name):
+    return os.path.join(args.data, "%s_%dx%d_%d.y4m" % (name, args.width, args.height, args.frames))
+
+
+def generate(args, name):
+    path = sequence_path(args, name)
+    if not os.path.exists(path):
+        if not os.path.isdir(args.data):
+            os.makedirs(args.data)
+        sys.stderr.write("bench: generating %s\n" % path)
+        Sequence(name, args.width, args.height, args.frames, SEQUENCES.index(name) + 1).write(path)
+    return path
+
+# encoding
+
+ENCODED_RE = re.compile(r"encoded (\d+) frames, ([\d.]+) fps, ([\d.]+) kb/s")
+STAGE_RE = re.compile(r"\[info\]:\s+(\w+)\s+(\d+)\s+([\d.]+)\s+[\d.]+%")
+
+
+def run_encoder(args, cmd):
+    """Run one encode; returns (stderr text, peak RSS in KiB, elapsed seconds)."""
+    with tempfile.TemporaryFile() as log:
+        start = time.time()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=log)
+        # wait4 rather than Popen.wait, to get the child's own resource usage
+        _, status, usage = os.wait4(proc.pid, 0)
+        proc.returncode = status
+        elapsed = time.time() - start
+        log.seek(0)
+        text = log.read().decode("utf-8", "replace")
+    if status:
+        raise RuntimeError("%s failed:\n%s" % (" ".join(cmd), text))
+    rss = usage.ru_maxrss
+    if sys.platform == "darwin":
+        rss //= 1024
+    return text, rss, elapsed
+
+
+def encode(args, seq, preset, codec, threads):
+    source = Sequence(seq, args.width, args.height, args.frames, 0)
+    cmd = [args.x264, "--preset", preset, "--threads", str(threads), "--profile-stages",
+           "--no-progress", "--muxer", "raw", "-o", os.devnull]
+    if codec == "mpeg2":
+        cmd.append("--mpeg2")
+    cmd += source.options() + args.extra + [generate(args, seq)]
+
+    best = None
+    for _ in range(args.runs):
+        text, rss, elapsed = run_encoder(args, cmd)
+        m = ENCODED_RE.search(text)
+        if not m:
+            raise RuntimeError("%s: no summary line in output:\n%s" % (" ".join(cmd), text))
+        stages = {}
+        in_profile = False
+        for line in text.splitlines():
+            if "stage profile" in line:
+                in_profile = True
+            elif in_profile:
+                s = STAGE_RE.search(line)
+                if s:
+                    stages[s.group(1)] = float(s.group(3))
+                elif "stage" not in line:
+                    in_profile = False
+        result = {"fps": float(m.group(2)), "kbps": float(m.group(3)), "frames": int(m.group(1)),
+                  "stages": stages, "max_rss_kb": rss, "elapsed": round(elapsed, 3)}
+        # keep the fastest run; peak memory is the largest seen
+        if best is None or result["fps"] > best["fps"]:
+            if best:
+                result["max_rss_kb"] = max(result["max_rss_kb"], best["max_rss_kb"])
+            best = result
+        else:
+            best["max_rss_kb"] = max(best["max_rss_kb"], rss)
+    return best
+
+
+def version(x264):
+    try:
+        out = subprocess.check_output([x264, "--version"], stderr=subprocess.STDOUT)
+        return out.decode("utf-8", "replace").splitlines()[0]
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def bench(args):
+    results = {}
+    for seq in args.sequences:
+        for preset in args.presets:
+            for codec in args.codecs:
+                for threads in args.threads:
+                    key = "%s/%s/%s/t%d" % (seq, preset, codec, threads)
+                    generate(args, seq)
+                    sys.stderr.write("bench: %-40s" % key)
+                    sys.stderr.flush()
+                    r = encode(args, seq, preset, codec, threads)
+                    sys.stderr.write(" %8.2f fps %8d KiB\n" % (r["fps"], r["max_rss_kb"]))
+                    r.update({"sequence": seq, "preset": preset, "codec": codec, "threads": threads})
+                    results[key] = r
+    return {
+        "format": "x264-bench",
+        "version": 1,
+        "x264": version(args.x264),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "host": {"system": platform.system(), "machine": platform.machine(), "cpus": os.cpu_count()},
+        "config": {"width": args.width, "height": args.height, "frames": args.frames,
+                   "runs": args.runs, "extra": args.extra},
+        "results": results,
+    }
+
+# comparison
+
+def compare(base, cur, fps_tol, rss_tol):
+    """Print a per-configuration comparison; returns the number of regressions."""
+    if base.get("config", {}).get("frames") != cur.get("config", {}).get("frames") or \
+       base.get("config", {}).get("width") != cur.get("config", {}).get("width"):
+        sys.stderr.write("bench: warning: baseline was run with a different sequence configuration\n")
+    regressions = 0
+    print("%-40s %10s %10s %8s %10s %8s" % ("configuration", "base fps", "fps", "change", "rss KiB", "change"))
+    for key in sorted(cur["results"]):
+        c = cur["results"][key]
+        b = base["results"].get(key)
+        if not b:
+            print("%-40s %10s %10.2f %8s %10d %8s" % (key, "-", c["fps"], "new", c["max_rss_kb"], ""))
+            continue
+        dfps = 100.0 * (c["fps"] - b["fps"]) / b["fps"] if b["fps"] else 0.0
+        drss = 100.0 * (c["max_rss_kb"] - b["max_rss_kb"]) / b["max_rss_kb"] if b["max_rss_kb"] else 0.0
+        flags = []
+        if dfps < -fps_tol:
+            flags.append("SLOWER")
+        if drss > rss_tol:
+            flags.append("MEMORY")
+        regressions += bool(flags)
+        print("%-40s %10.2f %10.2f %+7.1f%% %10d %+7.1f%% %s" % (
+            key, b["fps"], c["fps"], dfps, c["max_rss_kb"], drss, " ".join(flags)))
+        if flags and "stages" in b:
+            for stage in sorted(c["stages"]):
+                if stage in b["stages"] and b["stages"][stage] > 0:
+                    print("    %-12s %8.3fs -> %8.3fs (%+.1f%%)" % (
+                        stage, b["stages"][stage], c["stages"][stage],
+                        100.0 * (c["stages"][stage] - b["stages"][stage]) / b["stages"][stage]))
+    for key in sorted(set(base["results"]) - set(cur["results"])):
+        print("%-40s %10.2f %10s %8s" % (key, base["results"][key]["fps"], "-", "missing"))
+    print("%d regression%s (fps tolerance %.1f%%, rss tolerance %.1f%%)" % (
+        regressions, "" if regressions == 1 else "s", fps_tol, rss_tol))
+    return regressions
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    if data.get("format") != "x264-bench":
+        raise SystemExit("bench: %s is not a benchmark result file" % path)
+    return data
+
+
+def csv(kind):
+    def parse(s):
+        return [kind(x) for x in s.split(",") if x]
+    return parse
+
+
+def main():
+    parser = argparse.ArgumentParser(description="x264 end-to-end throughput benchmark")
+    parser.add_argument("--x264", default="./x264", help="encoder binary [%(default)s]")
+    parser.add_argument("-o", "--output", default="bench.json", help="result file [%(default)s]")
+    parser.add_argument("--baseline", help="compare the results against this result file")
+    parser.add_argument("--compare", nargs=2, metavar=("BASE", "CURRENT"),
+                        help="only compare two existing result files")
+    parser.add_argument("--sequences", type=csv(str), default=list(SEQUENCES),
+                        help="comma-separated subset of %s" % ",".join(SEQUENCES))
+    parser.add_argument("--presets", type=csv(str), default=list(PRESETS), help="[%s]" % ",".join(PRESETS))
+    parser.add_argument("--codecs", type=csv(str), default=list(CODECS), help="[%s]" % ",".join(CODECS))
+    parser.add_argument("--threads", type=csv(int), default=list(THREADS),
+                        help="[%s]" % ",".join(str(t) for t in THREADS))
+    parser.add_argument("--width", type=int, default=640)
+    parser.add_argument("--height", type=int, default=352)
+    parser.add_argument("--frames", type=int, default=60)
+    parser.add_argument("--runs", type=int, default=3, help="encodes per configuration; the fastest is kept [%(default)s]")
+    parser.add_argument("--data", default="bench-data", help="directory for generated sequences [%(default)s]")
+    parser.add_argument("--tolerance", type=float, default=5.0, help="allowed fps drop in percent [%(default)s]")
+    parser.add_argument("--rss-tolerance", type=float, default=10.0, help="allowed peak RSS growth in percent [%(default)s]")
+    parser.add_argument("extra", nargs="*", help="extra encoder options, after --")
+    args = parser.parse_args()
+
+    if args.compare:
+        return 1 if compare(load(args.compare[0]), load(args.compare[1]), args.tolerance, args.rss_tolerance) else 0
+
+    for s in args.sequences:
+        if s not in SEQUENCES:
+            parser.error("unknown sequence %s" % s)
+    for c in args.codecs:
+        if c not in CODECS:
+            parser.error("unknown codec %s" % c)
+    if args.width & 1 or args.height & 3:
+        parser.error("width must be even and height a multiple of 4")
+
+    base = load(args.baseline) if args.baseline else None
+    cur = bench(args)
+    with open(args.output, "w") as f:
+        json.dump(cur, f, indent=1, sort_keys=True)
+        f.write("\n")
+    sys.stderr.write("bench: results written to %s\n" % args.output)
+    if base:
+        return 1 if compare(base, cur, args.tolerance, args.rss_tolerance) else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,174 @@
+/*****************************************************************************
+ * depthbench.c: depth filter benchmark
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+
+#include <math.h>
+#include "filters/video/video.h"
+#include "filters/video/internal.h"
+
+/* Times each dithering mode of the depth filter on a synthetic high bit depth
+ * frame and compares its output with the default Sierra error diffusion. */
+
+#define WIDTH  1920
+#define HEIGHT 1080
+#define FRAMES 20
+
+static cli_pic_t src_pic;
+
+void x264_cli_log( const char *name, int i_level, const char *fmt, ... )
+{
+    va_list arg;
+    va_start( arg, fmt );
+    fprintf( stderr, "%s: ", name );
+    vfprintf( stderr, fmt, arg );
+    va_end( arg );
+}
+
+static int src_get_frame( hnd_t handle, cli_pic_t *output, int frame )
+{
+    *output = src_pic;
+    return 0;
+}
+
+static int src_release_frame( hnd_t handle, cli_pic_t *pic, int frame )
+{
+    return 0;
+}
+
+static void src_free( hnd_t handle )
+{
+}
+
+static cli_vid_filter_t src_filter = { "bench", NULL, NULL, src_get_frame, src_release_frame, src_free, NULL };
+
+static void fill_source( void )
+{
+    uint32_t seed = 12345;
+    for( int i = 0; i < src_pic.img.planes; i++ )
+    {
+        int w = WIDTH  * x264_cli_csps[src_pic.img.csp & X264_CSP_MASK].width[i];
+        int h = HEIGHT * x264_cli_csps[src_pic.img.csp & X264_CSP_MASK].height[i];
+        for( int y = 0; y < h; y++ )
+        {
+            uint16_t *p = (uint16_t*)(src_pic.img.plane[i] + y * src_pic.img.stride[i]);
+            for( int x = 0; x < w; x++ )
+            {
+                /* smooth gradient plus a little noise, which is where dithering matters */
+                seed = seed * 1664525 + 1013904223;
+                int v = (x * 65535 / w + y * 16) + (int)(seed >> 28) - 8;
+                p[x] = x264_clip3( v, 0, 65535 );
+            }
+        }
+    }
+}
+
+static double psnr_vs_source( cli_image_t *img )
+{
+    const double scale = 1 << (16 - BIT_DEPTH);
+    const double peak = (1 << BIT_DEPTH) - 1;
+    double sse = 0;
+    int64_t count = 0;
+    for( int i = 0; i < img->planes; i++ )
+    {
+        int w = WIDTH  * x264_cli_csps[img->csp & X264_CSP_MASK].width[i];
+        int h = HEIGHT * x264_cli_csps[img->csp & X264_CSP_MASK].height[i];
+        for( int y = 0; y < h; y++ )
+        {
+            pixel *d = (pixel*)(img->plane[i] + y * img->stride[i]);
+            uint16_t *s = (uint16_t*)(src_pic.img.plane[i] + y * src_pic.img.stride[i]);
+            for( int x = 0; x < w; x++ )
+            {
+                double diff = d[x] - s[x] / scale;
+                sse += diff * diff;
+            }
+        }
+        count += (int64_t)w * h;
+    }
+    return 10 * log10( peak * peak * count / X264_MAX( sse, 1e-9 ) );
+}
+
+static double identical_ratio( cli_image_t *a, cli_image_t *b )
+{
+    int64_t same = 0, count = 0;
+    for( int i = 0; i < a->planes; i++ )
+    {
+        int w = WIDTH  * x264_cli_csps[a->csp & X264_CSP_MASK].width[i];
+        int h = HEIGHT * x264_cli_csps[a->csp & X264_CSP_MASK].height[i];
+        for( int y = 0; y < h; y++ )
+        {
+            pixel *pa = (pixel*)(a->plane[i] + y * a->stride[i]);
+            pixel *pb = (pixel*)(b->plane[i] + y * b->stride[i]);
+            for( int x = 0; x < w; x++ )
+                same += pa[x] == pb[x];
+        }
+        count += (int64_t)w * h;
+    }
+    return 100.0 * same / count;
+}
+
+int main( int argc, char **argv )
+{
+    static const char * const modes[] = { "sierra", "sierra,4", "ordered", "ordered,4", NULL };
+    extern cli_vid_filter_t depth_filter;
+    x264_param_t param;
+    cli_pic_t ref;
+
+    x264_param_default( &param );
+    param.i_csp = BIT_DEPTH > 8 ? X264_CSP_I420 | X264_CSP_HIGH_DEPTH : X264_CSP_I420;
+    if( x264_cli_pic_alloc( &src_pic, X264_CSP_I420 | X264_CSP_HIGH_DEPTH, WIDTH, HEIGHT ) ||
+        x264_cli_pic_alloc( &ref, param.i_csp, WIDTH, HEIGHT ) )
+        return 1;
+    fill_source();
+
+    printf( "%dx%d 16-bit to %d-bit, %d frames\n", WIDTH, HEIGHT, BIT_DEPTH, FRAMES );
+    printf( "%-12s %10s %10s %14s\n", "mode", "ms/frame", "psnr", "same as sierra" );
+    for( int m = 0; modes[m]; m++ )
+    {
+        char opts[64];
+        hnd_t handle = NULL;
+        cli_vid_filter_t filter = src_filter;
+        video_info_t info = { .csp = X264_CSP_I420 | X264_CSP_HIGH_DEPTH, .width = WIDTH, .height = HEIGHT };
+        cli_pic_t out;
+
+        /* force the filter even in high bit depth builds by not matching the source depth */
+        sprintf( opts, "%d,%s", BIT_DEPTH, modes[m] );
+        if( depth_filter.init( &handle, &filter, &info, &param, opts ) || !handle )
+            return 1;
+
+        int64_t start = x264_mdate();
+        for( int i = 0; i < FRAMES; i++ )
+            if( filter.get_frame( handle, &out, i ) || filter.release_frame( handle, &out, i ) )
+                return 1;
+        int64_t elapsed = x264_mdate() - start;
+
+        if( !m )
+            x264_cli_pic_copy( &ref, &out );
+        printf( "%-12s %10.2f %10.2f %13.2f%%\n", modes[m], elapsed / 1000.0 / FRAMES,
+                psnr_vs_source( &out.img ), identical_ratio( &ref.img, &out.img ) );
+        filter.free( handle );
+    }
+
+    x264_cli_pic_clean( &ref );
+    x264_cli_pic_clean( &src_pic );
+    return 0;
+}
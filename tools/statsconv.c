@@ -0,0 +1,278 @@
+/*****************************************************************************
+ * statsconv.c: convert 2pass stats between text and binary formats
+ *****************************************************************************
+ * Copyright (C) 2014 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "encoder/stats.h"
+
+/* Reads a first pass stats file in either format and writes it in the other
+ * (or the one given with -f), e.g. to inspect binary stats or to speed up
+ * repeated 2nd passes from existing text stats.  The 2nd pass reads MB-tree
+ * data from <stats>.mbtree, so an input .mbtree file is copied unchanged next
+ * to the output; its format is detected separately in the 2nd pass. */
+
+#define FAIL( ... ) do { fprintf( stderr, "statsconv: " __VA_ARGS__ ); goto fail; } while( 0 )
+
+static char *read_file( const char *name, size_t *size )
+{
+    FILE *f = fopen( name, "rb" );
+    char *buf = NULL;
+    long len;
+    if( !f )
+        return NULL;
+    if( !fseek( f, 0, SEEK_END ) && (len = ftell( f )) > 0 && !fseek( f, 0, SEEK_SET ) &&
+        (buf = malloc( len + 1 )) && fread( buf, 1, len, f ) == len )
+    {
+        buf[len] = 0;
+        *size = len;
+    }
+    else
+    {
+        free( buf );
+        buf = NULL;
+    }
+    fclose( f );
+    return buf;
+}
+
+/* Same syntax as the parser in ratecontrol.c. */
+static int parse_text( char *buf, char **opts, x264_stats_record_t **records, int *num_frames )
+{
+    char *p = strchr( buf, '\n' );
+    int n = 0;
+    if( strncmp( buf, "#options:", 9 ) || !p )
+        return -1;
+    *p++ = 0;
+    *opts = buf;
+    for( char *q = p; (q = strchr( q, ';' )); q++ )
+        n++;
+    if( !n || !(*records = calloc( n, sizeof(x264_stats_record_t) )) )
+        return -1;
+
+    for( int i = 0; i < n; i++ )
+    {
+        x264_stats_record_t *r = &(*records)[i];
+        char *next = strchr( p, ';' );
+        *next++ = 0;
+        if( sscanf( p, " in:%d out:%d type:%c dur:%"SCNd64" cpbdur:%"SCNd64" q:%f aq:%f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c",
+                    &r->i_frame_in, &r->i_frame_out, &r->type, &r->i_duration, &r->i_cpb_duration, &r->f_qp_rc, &r->f_qp_aq,
+                    &r->i_tex_bits, &r->i_mv_bits, &r->i_misc_bits, &r->i_mb_count_i, &r->i_mb_count_p,
+                    &r->i_mb_count_skip, &r->direct ) != 14 || !(p = strstr( p, "ref:" )) )
+        {
+            fprintf( stderr, "statsconv: statistics are damaged at line %d\n", i );
+            return -1;
+        }
+        p += 4;
+        while( r->refs < 16 && sscanf( p, " %d", &r->refcount[r->refs] ) == 1 )
+        {
+            r->refs++;
+            if( !(p = strchr( p+1, ' ' )) )
+                return -1;
+        }
+        char *w = strchr( p, 'w' );
+        if( w )
+        {
+            int count = sscanf( w, "w:%hd,%hd,%hd,%hd,%hd,%hd,%hd,%hd",
+                                &r->weight_denom[0], &r->weight[0][0], &r->weight[0][1],
+                                &r->weight_denom[1], &r->weight[1][0], &r->weight[1][1],
+                                &r->weight[2][0], &r->weight[2][1] );
+            r->weights = count == 3 || count == 8 ? count : 0;
+        }
+        p = next;
+    }
+    *num_frames = n;
+    return 0;
+}
+
+static int write_text( FILE *f, const char *opts, const uint8_t *records, int num_frames, int record_size )
+{
+    if( fprintf( f, "%s\n", opts ) < 0 )
+        return -1;
+    for( int i = 0; i < num_frames; i++ )
+    {
+        const x264_stats_record_t *r = (const x264_stats_record_t*)(records + (size_t)i * record_size);
+        if( fprintf( f, "in:%d out:%d type:%c dur:%"PRId64" cpbdur:%"PRId64" q:%.2f aq:%.2f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c ref:",
+                     r->i_frame_in, r->i_frame_out, r->type, r->i_duration, r->i_cpb_duration, r->f_qp_rc, r->f_qp_aq,
+                     r->i_tex_bits, r->i_mv_bits, r->i_misc_bits, r->i_mb_count_i, r->i_mb_count_p,
+                     r->i_mb_count_skip, r->direct ) < 0 )
+            return -1;
+        for( int j = 0; j < r->refs && j < 16; j++ )
+            if( fprintf( f, "%d ", r->refcount[j] ) < 0 )
+                return -1;
+        if( r->weights == 3 && fprintf( f, "w:%d,%d,%d ", r->weight_denom[0], r->weight[0][0], r->weight[0][1] ) < 0 )
+            return -1;
+        if( r->weights == 8 && fprintf( f, "w:%d,%d,%d,%d,%d,%d,%d,%d ", r->weight_denom[0], r->weight[0][0], r->weight[0][1],
+                                        r->weight_denom[1], r->weight[1][0], r->weight[1][1], r->weight[2][0], r->weight[2][1] ) < 0 )
+            return -1;
+        if( fprintf( f, ";\n" ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 if there was nothing to copy. */
+static int copy_mbtree( const char *in, const char *out )
+{
+    char *in_name = malloc( strlen( in ) + 8 );
+    char *out_name = malloc( strlen( out ) + 8 );
+    FILE *fin = NULL, *fout = NULL;
+    char buf[1<<16];
+    size_t len;
+    int ret = -1;
+    if( !in_name || !out_name )
+        goto fail;
+    sprintf( in_name, "%s.mbtree", in );
+    sprintf( out_name, "%s.mbtree", out );
+    if( !(fin = fopen( in_name, "rb" )) )
+    {
+        ret = 1;
+        goto fail;
+    }
+    if( !(fout = fopen( out_name, "wb" )) )
+        FAIL( "can't open %s\n", out_name );
+    while( (len = fread( buf, 1, sizeof(buf), fin )) )
+        if( fwrite( buf, 1, len, fout ) != len )
+            FAIL( "write failed\n" );
+    if( ferror( fin ) )
+        FAIL( "can't read %s\n", in_name );
+    ret = 0;
+fail:
+    if( fin )
+        fclose( fin );
+    if( fout && fclose( fout ) )
+        ret = -1;
+    free( in_name );
+    free( out_name );
+    return ret;
+}
+
+static int write_binary( FILE *f, const char *opts, const x264_stats_record_t *records, int num_frames )
+{
+    static const uint8_t zero[8];
+    x264_stats_header_t hdr = {{0}};
+    size_t len = strlen( opts );
+    int32_t *index = malloc( num_frames * sizeof(int32_t) );
+    int ret = -1;
+    if( !index )
+        return -1;
+    for( int i = 0; i < num_frames; i++ )
+        index[i] = -1;
+    for( int i = 0; i < num_frames; i++ )
+    {
+        if( records[i].i_frame_in < 0 || records[i].i_frame_in >= num_frames || index[records[i].i_frame_in] >= 0 )
+            FAIL( "bad frame number (%d) at record %d\n", records[i].i_frame_in, i );
+        index[records[i].i_frame_in] = i;
+    }
+
+    memcpy( hdr.magic, X264_STATS_MAGIC, 8 );
+    hdr.version = X264_STATS_VERSION;
+    hdr.byte_order = X264_STATS_BYTE_ORDER;
+    hdr.header_size = sizeof(hdr);
+    hdr.record_size = sizeof(x264_stats_record_t);
+    hdr.num_frames = num_frames;
+    hdr.options_size = (len + 8) & ~7;
+    hdr.records_offset = hdr.header_size + hdr.options_size;
+    hdr.index_offset = hdr.records_offset + (uint64_t)num_frames * hdr.record_size;
+    if( fwrite( &hdr, sizeof(hdr), 1, f ) != 1 ||
+        fwrite( opts, 1, len, f ) != len ||
+        fwrite( zero, 1, hdr.options_size - len, f ) != hdr.options_size - len ||
+        fwrite( records, sizeof(x264_stats_record_t), num_frames, f ) != num_frames ||
+        fwrite( index, sizeof(int32_t), num_frames, f ) != num_frames )
+        FAIL( "write failed\n" );
+    ret = 0;
+fail:
+    free( index );
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    const char *format = NULL;
+    char *buf = NULL, *opts;
+    x264_stats_record_t *records = NULL;
+    int num_frames, ret = 1;
+    size_t size;
+    FILE *out = NULL;
+
+    if( argc == 5 && !strcmp( argv[1], "-f" ) )
+    {
+        format = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if( argc != 3 || (format && strcmp( format, "text" ) && strcmp( format, "binary" )) )
+    {
+        printf( "usage: statsconv [-f text|binary] <input stats> <output stats>\n"
+                "Converts 2pass stats to the other format, or to the given one.\n"
+                "<input stats>.mbtree, if present, is copied to <output stats>.mbtree.\n" );
+        return 1;
+    }
+    if( !(buf = read_file( argv[1], &size )) )
+        FAIL( "can't read %s\n", argv[1] );
+
+    if( size >= sizeof(x264_stats_header_t) && !memcmp( buf, X264_STATS_MAGIC, 8 ) )
+    {
+        const x264_stats_header_t *hdr = (x264_stats_header_t*)buf;
+        if( hdr->version != X264_STATS_VERSION || hdr->byte_order != X264_STATS_BYTE_ORDER || !hdr->num_frames ||
+            hdr->record_size < sizeof(x264_stats_record_t) || (uint64_t)hdr->header_size + hdr->options_size > size ||
+            hdr->records_offset + (uint64_t)hdr->num_frames * hdr->record_size > size )
+            FAIL( "%s: unsupported or damaged binary stats\n", argv[1] );
+        opts = buf + hdr->header_size;
+        num_frames = hdr->num_frames;
+        if( !(out = fopen( argv[2], "wb" )) )
+            FAIL( "can't open %s\n", argv[2] );
+        if( format && !strcmp( format, "binary" ) )
+        {
+            if( fwrite( buf, 1, size, out ) != size )
+                FAIL( "write failed\n" );
+        }
+        else if( write_text( out, opts, (uint8_t*)buf + hdr->records_offset, num_frames, hdr->record_size ) < 0 )
+            FAIL( "write failed\n" );
+    }
+    else
+    {
+        if( parse_text( buf, &opts, &records, &num_frames ) < 0 )
+            FAIL( "%s: not a valid stats file\n", argv[1] );
+        if( !(out = fopen( argv[2], "wb" )) )
+            FAIL( "can't open %s\n", argv[2] );
+        if( format && !strcmp( format, "text" ) ? write_text( out, opts, (uint8_t*)records, num_frames, sizeof(*records) ) < 0
+                                                : write_binary( out, opts, records, num_frames ) < 0 )
+            FAIL( "write failed\n" );
+    }
+    fprintf( stderr, "statsconv: converted %d frames\n", num_frames );
+    int mbtree = copy_mbtree( argv[1], argv[2] );
+    if( mbtree < 0 )
+        goto fail;
+    if( !mbtree )
+        fprintf( stderr, "statsconv: copied %s.mbtree\n", argv[1] );
+    ret = 0;
+fail:
+    if( out && fclose( out ) )
+        ret = 1;
+    free( records );
+    free( buf );
+    return ret;
+}
@@ -161,7 +161,7 @@ typedef struct {
 
 /* file i/o operation structs */
 cli_input_t cli_input;
-static cli_output_t cli_output;
+cli_output_t cli_output;
 
 /* video filter operation struct */
 static cli_vid_filter_t filter;
@@ -189,6 +189,7 @@ static const char * const muxer_names[] =
     "raw",
     "mkv",
     "flv",
+    "ts",
 #if HAVE_GPAC || HAVE_LSMASH
     "mp4",
 #endif
@@ -663,7 +664,9 @@ static void help( x264_param_t *defaults, int longhelp )
     H2( "  -i, --min-keyint <integer>  Minimum GOP size [auto]\n" );
     H2( "      --no-scenecut           Disable adaptive I-frame decision\n" );
     H2( "      --scenecut <integer>    How aggressively to insert extra I-frames [%d]\n", defaults->i_scenecut_threshold );
-    H2( "      --intra-refresh         Use Periodic Intra Refresh instead of IDR frames\n" );
+    H2( "      --intra-refresh         Use Periodic Intra Refresh instead of IDR frames\n"
+        "                                  With --mpeg2, a refresh starts with a repeated\n"
+        "                                  sequence header instead of a GOP\n" );
     H1( "  -b, --bframes <integer>     Number of B-frames between I and P [%d]\n", defaults->i_bframe );
     H1( "      --b-adapt <integer>     Adaptive B-frame decision method [%d]\n"
         "                                  Higher values may lower threading efficiency.\n"
@@ -716,9 +719,14 @@ static void help( x264_param_t *defaults, int longhelp )
     H0( "  -B, --bitrate <integer>     Set bitrate (kbit/s)\n" );
     H0( "      --crf <float>           Quality-based VBR (%d-51) [%.1f]\n", 51 - QP_MAX_SPEC_H264, defaults->rc.f_rf_constant );
     H1( "      --rc-lookahead <integer> Number of frames for frametype lookahead [%d]\n", defaults->rc.i_lookahead );
+    H2( "      --lookahead-downscale <integer> Lookahead analysis resolution divisor: 2, 4, 8 or auto [%d]\n"
+        "                                  Coarser analysis speeds up the lookahead of large sources.\n", defaults->rc.i_lookahead_downscale );
     H0( "      --vbv-maxrate <integer> Max local bitrate (kbit/s) [%d]\n", defaults->rc.i_vbv_max_bitrate );
     H0( "      --vbv-bufsize <integer> Set size of the VBV buffer (kbit) [%d]\n", defaults->rc.i_vbv_buffer_size );
     H2( "      --vbv-init <float>      Initial VBV buffer occupancy [%.1f]\n", defaults->rc.f_vbv_buffer_init );
+    H2( "      --vbv-rows              Keep every row of macroblocks within the VBV, re-encoding\n"
+        "                                  rows that would underflow it.  For sending rows as soon\n"
+        "                                  as they are encoded.  Not with frame threads.\n" );
     H2( "      --crf-max <float>       With CRF+VBV, limit RF to this value\n"
         "                                  May cause VBV underflows!\n" );
     H2( "      --qpmin <integer>       Set min QP [%d]\n", defaults->rc.i_qp_min );
@@ -740,6 +748,10 @@ static void help( x264_param_t *defaults, int longhelp )
         "                                  - 2: Last pass, does not overwrite stats file\n" );
     H2( "                                  - 3: Nth pass, overwrites stats file\n" );
     H1( "      --stats <string>        Filename for 2 pass stats [\"%s\"]\n", defaults->rc.psz_stat_out );
+    H2( "      --stats-format <string> Format of the written stats file [\"%s\"]\n"
+        "                                  - %s\n"
+        "                              The format of stats being read is detected\n",
+        x264_stats_format_names[defaults->rc.i_stat_format], stringify_names( buf, x264_stats_format_names ) );
     H2( "      --no-mbtree             Disable mb-tree ratecontrol.\n");
     H2( "      --qcomp <float>         QP curve compression [%.2f]\n", defaults->rc.f_qcompress );
     H2( "      --cplxblur <float>      Reduce fluctuations in QP (before curve compression) [%.1f]\n", defaults->rc.f_complexity_blur );
@@ -779,6 +791,8 @@ static void help( x264_param_t *defaults, int longhelp )
         "                                  - tesa: hadamard exhaustive search (slow)\n" );
     else H1( "                                  - dia, hex, umh\n" );
     H2( "      --merange <integer>     Maximum motion vector search range [%d]\n", defaults->analyse.i_me_range );
+    H2( "      --me-guide <integer>    Seed motion search with the lookahead's motion vectors,\n"
+        "                                  and search only <integer> around them when available [0 (off)]\n" );
     H2( "      --mvrange <integer>     Maximum motion vector length [-1 (auto)]\n" );
     H2( "      --mvrange-thread <int>  Minimum buffer between threads [-1 (auto)]\n" );
     H1( "  -m, --subme <integer>       Subpixel motion estimation and mode decision [%d]\n", defaults->analyse.i_subpel_refine );
@@ -913,6 +927,9 @@ static void help( x264_param_t *defaults, int longhelp )
     H2( "      --lookahead-threads <integer> Force a specific number of lookahead threads\n" );
     H2( "      --sliced-threads        Low-latency but lower-efficiency threading\n" );
     H2( "      --thread-input          Run Avisynth in its own thread\n" );
+    H2( "      --input-readahead <integer> Number of frames read ahead by threaded input [4]\n" );
+    H2( "      --thread-output         Write the output in its own thread\n" );
+    H2( "      --output-buffer <integer> Size of the threaded output buffer (KiB) [8192]\n" );
     H2( "      --sync-lookahead <integer> Number of buffer frames for threaded lookahead\n" );
     H2( "      --non-deterministic     Slightly improve quality of SMP, at the cost of repeatability\n" );
     H2( "      --cpu-independent       Ensure exact reproducibility across different cpus,\n"
@@ -923,6 +940,7 @@ static void help( x264_param_t *defaults, int longhelp )
     H2( "      --opencl-clbin <string> Specify path of compiled OpenCL kernel cache\n" );
     H2( "      --opencl-device <integer> Specify OpenCL device ordinal\n" );
     H2( "      --dump-yuv <string>     Save reconstructed frames\n" );
+    H2( "      --profile-stages        Time the major encoding stages and print a summary\n" );
     H2( "      --sps-id <integer>      Set SPS and PPS id numbers [%d]\n", defaults->i_sps_id );
     H2( "      --aud                   Use access unit delimiters\n" );
     H2( "      --force-cfr             Force constant framerate timestamp generation\n" );
@@ -932,10 +950,16 @@ static void help( x264_param_t *defaults, int longhelp )
         "                 <integer>    Specify timebase numerator for input timecode file\n"
         "                              or specify timebase denominator for other input\n" );
     H2( "      --dts-compress          Eliminate initial delay with container DTS hack\n" );
+    H2( "      --mux-rate <integer>    TS: pad the stream to a constant rate (kbit/s)\n"
+        "                                  with null packets [0 = variable rate]\n" );
     H0( "\n" );
     H0( "Filtering:\n" );
     H0( "\n" );
     H0( "      --vf, --video-filter <filter0>/<filter1>/... Apply video filtering to the input file\n" );
+#if HAVE_THREAD
+    H1( "      --vf-pipeline <integer> Run each filter in its own thread, buffering\n"
+        "                              this many frames between filters [0]\n" );
+#endif
     H0( "\n" );
     H0( "      Filter options may be specified in <filter>:<option>=<value> format.\n" );
     H0( "\n" );
@@ -951,6 +975,9 @@ typedef enum
     OPT_SEEK,
     OPT_QPFILE,
     OPT_THREAD_INPUT,
+    OPT_INPUT_READAHEAD,
+    OPT_THREAD_OUTPUT,
+    OPT_OUTPUT_BUFFER,
     OPT_QUIET,
     OPT_NOPROGRESS,
     OPT_LONGHELP,
@@ -972,11 +999,13 @@ typedef enum
     OPT_PULLDOWN,
     OPT_LOG_LEVEL,
     OPT_VIDEO_FILTER,
+    OPT_VF_PIPELINE,
     OPT_INPUT_FMT,
     OPT_INPUT_RES,
     OPT_INPUT_CSP,
     OPT_INPUT_DEPTH,
     OPT_DTS_COMPRESSION,
+    OPT_MUX_RATE,
     OPT_OUTPUT_CSP,
     OPT_INPUT_RANGE,
     OPT_RANGE
@@ -1024,6 +1053,7 @@ static struct option long_options[] =
     { "qpstep",      required_argument, NULL, 0 },
     { "crf",         required_argument, NULL, 0 },
     { "rc-lookahead",required_argument, NULL, 0 },
+    { "lookahead-downscale", required_argument, NULL, 0 },
     { "ref",         required_argument, NULL, 'r' },
     { "asm",         required_argument, NULL, 0 },
     { "no-asm",            no_argument, NULL, 0 },
@@ -1048,6 +1078,7 @@ static struct option long_options[] =
     { "weightp",     required_argument, NULL, 0 },
     { "me",          required_argument, NULL, 0 },
     { "merange",     required_argument, NULL, 0 },
+    { "me-guide",    required_argument, NULL, 0 },
     { "mvrange",     required_argument, NULL, 0 },
     { "mvrange-thread", required_argument, NULL, 0 },
     { "subme",       required_argument, NULL, 'm' },
@@ -1083,12 +1114,14 @@ static struct option long_options[] =
     { "vbv-maxrate", required_argument, NULL, 0 },
     { "vbv-bufsize", required_argument, NULL, 0 },
     { "vbv-init",    required_argument, NULL, 0 },
+    { "vbv-rows",          no_argument, NULL, 0 },
     { "crf-max",     required_argument, NULL, 0 },
     { "ipratio",     required_argument, NULL, 0 },
     { "pbratio",     required_argument, NULL, 0 },
     { "chroma-qp-offset", required_argument, NULL, 0 },
     { "pass",        required_argument, NULL, 'p' },
     { "stats",       required_argument, NULL, 0 },
+    { "stats-format", required_argument, NULL, 0 },
     { "qcomp",       required_argument, NULL, 0 },
     { "mbtree",            no_argument, NULL, 0 },
     { "no-mbtree",         no_argument, NULL, 0 },
@@ -1106,6 +1139,9 @@ static struct option long_options[] =
     { "slices",            required_argument, NULL, 0 },
     { "slices-max",        required_argument, NULL, 0 },
     { "thread-input",      no_argument, NULL, OPT_THREAD_INPUT },
+    { "input-readahead",   required_argument, NULL, OPT_INPUT_READAHEAD },
+    { "thread-output",     no_argument, NULL, OPT_THREAD_OUTPUT },
+    { "output-buffer",     required_argument, NULL, OPT_OUTPUT_BUFFER },
     { "sync-lookahead",    required_argument, NULL, 0 },
     { "non-deterministic", no_argument, NULL, 0 },
     { "cpu-independent",   no_argument, NULL, 0 },
@@ -1116,6 +1152,7 @@ static struct option long_options[] =
     { "log-level",   required_argument, NULL, OPT_LOG_LEVEL },
     { "no-progress",       no_argument, NULL, OPT_NOPROGRESS },
     { "dump-yuv",    required_argument, NULL, 0 },
+    { "profile-stages",    no_argument, NULL, 0 },
     { "sps-id",      required_argument, NULL, 0 },
     { "aud",               no_argument, NULL, 0 },
     { "nr",          required_argument, NULL, 0 },
@@ -1150,11 +1187,15 @@ static struct option long_options[] =
     { "frame-packing",     required_argument, NULL, 0 },
     { "vf",          required_argument, NULL, OPT_VIDEO_FILTER },
     { "video-filter", required_argument, NULL, OPT_VIDEO_FILTER },
+#if HAVE_THREAD
+    { "vf-pipeline", required_argument, NULL, OPT_VF_PIPELINE },
+#endif
     { "input-fmt",   required_argument, NULL, OPT_INPUT_FMT },
     { "input-res",   required_argument, NULL, OPT_INPUT_RES },
     { "input-csp",   required_argument, NULL, OPT_INPUT_CSP },
     { "input-depth", required_argument, NULL, OPT_INPUT_DEPTH },
     { "dts-compress",      no_argument, NULL, OPT_DTS_COMPRESSION },
+    { "mux-rate",    required_argument, NULL, OPT_MUX_RATE },
     { "output-csp",  required_argument, NULL, OPT_OUTPUT_CSP },
     { "input-range", required_argument, NULL, OPT_INPUT_RANGE },
     { "stitchable",        no_argument, NULL, 0 },
@@ -1196,6 +1237,15 @@ static int select_output( const char *muxer, char *filename, x264_param_t *param
         param->b_annexb = 0;
         param->b_repeat_headers = 0;
     }
+    else if( !strcasecmp( ext, "ts" ) )
+    {
+        cli_output = ts_output;
+        param->b_annexb = 1;
+        param->b_repeat_headers = 1;
+        /* H.264 in a transport stream requires access unit delimiters */
+        if( !param->b_mpeg2 )
+            param->b_aud = 1;
+    }
     else
         cli_output = raw_output;
     return 0;
@@ -1278,14 +1328,29 @@ static int select_input( const char *demuxer, char *used_demuxer, char *filename
     return 0;
 }
 
-static int init_vid_filters( char *sequence, hnd_t *handle, video_info_t *info, x264_param_t *param, int output_csp )
+/* init a filter and, if it was inserted into the chain, run it in its own pipeline stage */
+static int init_vid_filter_stage( const char *name, hnd_t *handle, video_info_t *info, x264_param_t *param,
+                                  char *opt_string, int pipe_depth )
+{
+    hnd_t prev_hnd = *handle;
+    if( x264_init_vid_filter( name, handle, &filter, info, param, opt_string ) )
+        return -1;
+#if HAVE_THREAD
+    if( pipe_depth > 0 && *handle != prev_hnd &&
+        x264_init_vid_filter( "pipe", handle, &filter, info, param, (void*)(intptr_t)pipe_depth ) )
+        return -1;
+#endif
+    return 0;
+}
+
+static int init_vid_filters( char *sequence, hnd_t *handle, video_info_t *info, x264_param_t *param, int output_csp, int pipe_depth )
 {
     x264_register_vid_filters();
 
     /* intialize baseline filters */
     if( x264_init_vid_filter( "source", handle, &filter, info, param, NULL ) ) /* wrap demuxer into a filter */
         return -1;
-    if( x264_init_vid_filter( "resize", handle, &filter, info, param, "normcsp" ) ) /* normalize csps to be of a known/supported format */
+    if( init_vid_filter_stage( "resize", handle, info, param, "normcsp", pipe_depth ) ) /* normalize csps to be of a known/supported format */
         return -1;
     if( x264_init_vid_filter( "fix_vfr_pts", handle, &filter, info, param, NULL ) ) /* fix vfr pts */
         return -1;
@@ -1299,7 +1364,7 @@ static int init_vid_filters( char *sequence, hnd_t *handle, video_info_t *info,
         int name_len = strcspn( p, ":" );
         p[name_len] = 0;
         name_len += name_len != tok_len;
-        if( x264_init_vid_filter( p, handle, &filter, info, param, p + name_len ) )
+        if( init_vid_filter_stage( p, handle, info, param, p + name_len, pipe_depth ) )
             return -1;
         p += X264_MIN( tok_len+1, p_len );
     }
@@ -1326,13 +1391,13 @@ static int init_vid_filters( char *sequence, hnd_t *handle, video_info_t *info,
     if( param->vui.b_fullrange == RANGE_AUTO )
         param->vui.b_fullrange = info->fullrange;
 
-    if( x264_init_vid_filter( "resize", handle, &filter, info, param, NULL ) )
+    if( init_vid_filter_stage( "resize", handle, info, param, NULL, pipe_depth ) )
         return -1;
 
     char args[20];
     sprintf( args, "bit_depth=%d", x264_bit_depth );
 
-    if( x264_init_vid_filter( "depth", handle, &filter, info, param, args ) )
+    if( init_vid_filter_stage( "depth", handle, info, param, args, pipe_depth ) )
         return -1;
 
     return 0;
@@ -1372,7 +1437,9 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
     x264_param_t defaults;
     char *profile = NULL;
     char *vid_filters = NULL;
+    int vf_pipeline = 0;
     int b_thread_input = 0;
+    int b_thread_output = 0;
     int b_turbo = 1;
     int b_user_ref = 0;
     int b_user_fps = 0;
@@ -1503,6 +1570,17 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
             case OPT_THREAD_INPUT:
                 b_thread_input = 1;
                 break;
+            case OPT_INPUT_READAHEAD:
+                input_opt.readahead = X264_MAX( atoi( optarg ), 1 );
+                b_thread_input = 1;
+                break;
+            case OPT_THREAD_OUTPUT:
+                b_thread_output = 1;
+                break;
+            case OPT_OUTPUT_BUFFER:
+                output_opt.output_buffer = X264_MAX( atoi( optarg ), 1 );
+                b_thread_output = 1;
+                break;
             case OPT_QUIET:
                 cli_log_level = param->i_log_level = X264_LOG_NONE;
                 break;
@@ -1554,6 +1632,9 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
             case OPT_VIDEO_FILTER:
                 vid_filters = optarg;
                 break;
+            case OPT_VF_PIPELINE:
+                vf_pipeline = X264_MAX( atoi( optarg ), 0 );
+                break;
             case OPT_INPUT_FMT:
                 input_opt.format = optarg;
                 break;
@@ -1569,6 +1650,10 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
             case OPT_DTS_COMPRESSION:
                 output_opt.use_dts_compress = 1;
                 break;
+            case OPT_MUX_RATE:
+                output_opt.mux_rate = atoi( optarg );
+                FAIL_IF_ERROR( output_opt.mux_rate < 0, "invalid mux rate %d\n", output_opt.mux_rate );
+                break;
             case OPT_OUTPUT_CSP:
                 FAIL_IF_ERROR( parse_enum_value( optarg, output_csp_names, &output_csp ), "Unknown output csp `%s'\n", optarg )
                 // correct the parsed value to the libx264 csp value
@@ -1632,6 +1717,14 @@ generic_option:
     if( select_output( muxer, output_filename, param ) )
         return -1;
     FAIL_IF_ERROR( cli_output.open_file( output_filename, &opt->hout, &output_opt ), "could not open output file `%s'\n", output_filename )
+#if HAVE_THREAD
+    /* keep slow storage from stalling the encoder */
+    if( b_thread_output )
+    {
+        FAIL_IF_ERROR( thread_output.open_file( NULL, &opt->hout, &output_opt ), "threaded output failed\n" )
+        cli_output = thread_output;
+    }
+#endif
 
     input_filename = argv[optind++];
     video_info_t info = {0};
@@ -1680,7 +1773,7 @@ generic_option:
     if( info.thread_safe && (b_thread_input || param->i_threads > 1
         || (param->i_threads == X264_THREADS_AUTO && x264_cpu_num_processors() > 1)) )
     {
-        if( thread_input.open_file( NULL, &opt->hin, &info, NULL ) )
+        if( thread_input.open_file( NULL, &opt->hin, &info, &input_opt ) )
         {
             fprintf( stderr, "x264 [error]: threaded input failed\n" );
             return -1;
@@ -1734,7 +1827,7 @@ generic_option:
     if( input_opt.input_range != RANGE_AUTO )
         info.fullrange = input_opt.input_range;
 
-    if( init_vid_filters( vid_filters, &opt->hin, &info, param, output_csp ) )
+    if( init_vid_filters( vid_filters, &opt->hin, &info, param, output_csp, vf_pipeline ) )
         return -1;
 
     /* set param flags from the post-filtered video */
@@ -1878,6 +1971,46 @@ static int64_t print_status( int64_t i_start, int64_t i_previous, int i_frame, i
     return i_time;
 }
 
+/* Upper bound of the histogram bin containing the given fraction of calls, in microseconds. */
+static double stage_percentile( x264_stage_stats_t *s, double fraction )
+{
+    int64_t count = 0;
+    for( int i = 0; i < X264_STAGE_HIST_BINS; i++ )
+        if( (count += s->i_hist[i]) >= fraction * s->i_calls )
+            return (1 << (i+8)) / 1000.;
+    return (1 << (X264_STAGE_HIST_BINS+7)) / 1000.;
+}
+
+static void print_stage_profile( x264_t *h )
+{
+    x264_encoder_stats_t total, thread;
+    int64_t sum = 0;
+    if( x264_encoder_stats( h, -1, &total ) < 0 )
+        return;
+    for( int i = 0; i < X264_STAGE_MAX; i++ )
+        sum += total.stage[i].i_time;
+    x264_cli_log( "x264", X264_LOG_INFO, "stage profile over %d thread context%s:\n", total.i_threads, total.i_threads > 1 ? "s" : "" );
+    x264_cli_log( "x264", X264_LOG_INFO, "  stage          calls    time (s)  share   avg (us)  p50 (us)  p99 (us)\n" );
+    for( int i = 0; i < X264_STAGE_MAX; i++ )
+    {
+        x264_stage_stats_t *s = &total.stage[i];
+        if( !s->i_calls )
+            continue;
+        x264_cli_log( "x264", X264_LOG_INFO, "  %-12s %9"PRId64" %10.3f %5.1f%% %10.2f %9.1f %9.1f\n",
+                      x264_stage_names[i], s->i_calls, s->i_time / 1e9, sum ? 100. * s->i_time / sum : 0,
+                      s->i_time / 1e3 / s->i_calls, stage_percentile( s, 0.5 ), stage_percentile( s, 0.99 ) );
+    }
+    for( int t = 0; t < total.i_threads && total.i_threads > 1; t++ )
+    {
+        char buf[200], *p = buf;
+        x264_encoder_stats( h, t, &thread );
+        for( int i = 0; i < X264_STAGE_MAX; i++ )
+            if( thread.stage[i].i_calls )
+                p += sprintf( p, " %s:%.3fs", x264_stage_names[i], thread.stage[i].i_time / 1e9 );
+        x264_cli_log( "x264", X264_LOG_DEBUG, "  thread %d:%s\n", t, p > buf ? buf : " idle" );
+    }
+}
+
 static void convert_cli_to_lib_pic( x264_picture_t *lib, cli_pic_t *cli )
 {
     memcpy( lib->img.i_stride, cli->img.stride, sizeof(cli->img.stride) );
@@ -2161,6 +2294,8 @@ fail:
     /* Erase progress indicator before printing encoding stats. */
     if( opt->b_progress )
         fprintf( stderr, "                                                                               \r" );
+    if( h && param->b_profile_stages )
+        print_stage_profile( h );
     if( h )
         x264_encoder_close( h );
     fprintf( stderr, "\n" );
@@ -41,7 +41,7 @@
 
 #include "x264_config.h"
 
-#define X264_BUILD 142
+#define X264_BUILD 153
 
 /* Application developers planning to link against a shared library version of
  * libx264 from a Microsoft Visual Studio or similar development environment
@@ -202,6 +202,24 @@ typedef struct
 #define X264_B_PYRAMID_NORMAL        2
 #define X264_KEYINT_MIN_AUTO         0
 #define X264_KEYINT_MAX_INFINITE     (1<<30)
+#define X264_STATS_FORMAT_TEXT       0
+#define X264_STATS_FORMAT_BINARY     1
+#define X264_STAGE_LOOKAHEAD         0 /* slicetype decision and analysis */
+#define X264_STAGE_ANALYSE           1 /* macroblock analysis */
+#define X264_STAGE_ENCODE            2 /* macroblock transform, quant and reconstruction */
+#define X264_STAGE_ENTROPY           3 /* macroblock bitstream writing */
+#define X264_STAGE_FILTER            4 /* deblocking, hpel interpolation, and psnr/ssim of rows */
+#define X264_STAGE_RATECONTROL       5
+#define X264_STAGE_MAX               6
+#define X264_STAGE_HIST_BINS         24
+#define X264_WAIT_REFERENCE          0 /* frame thread waiting for rows of a reference frame */
+#define X264_WAIT_SLICE              1 /* slice thread waiting for the slice above it */
+#define X264_WAIT_FRAME              2 /* calling thread waiting for frame or slice threads to finish */
+#define X264_WAIT_LOOKAHEAD          3 /* calling thread waiting for lookahead decisions */
+#define X264_WAIT_LOOKAHEAD_INPUT    4 /* lookahead thread waiting for input frames */
+#define X264_WAIT_LOOKAHEAD_OUTPUT   5 /* lookahead thread waiting for the encoder to take decided frames */
+#define X264_WAIT_INPUT              6 /* waiting for lines of a picture passed with b_row_input */
+#define X264_WAIT_MAX                7
 
 static const char * const x264_direct_pred_names[] = { "none", "spatial", "temporal", "auto", 0 };
 static const char * const x264_motion_est_names[] = { "dia", "hex", "umh", "esa", "tesa", 0 };
@@ -214,6 +232,9 @@ static const char * const x264_transfer_names[] = { "", "bt709", "undef", "", "b
                                                     "iec61966-2-4", "bt1361e", "iec61966-2-1", "bt2020-10", "bt2020-12", 0 };
 static const char * const x264_colmatrix_names[] = { "GBR", "bt709", "undef", "", "fcc", "bt470bg", "smpte170m", "smpte240m", "YCgCo", "bt2020nc", "bt2020c", 0 };
 static const char * const x264_nal_hrd_names[] = { "none", "vbr", "cbr", 0 };
+static const char * const x264_stats_format_names[] = { "text", "binary", 0 };
+static const char * const x264_stage_names[] = { "lookahead", "analyse", "encode", "entropy", "filter", "ratecontrol", 0 };
+static const char * const x264_wait_names[] = { "reference", "slice", "frame", "lookahead", "lookahead-input", "lookahead-output", "input", 0 };
 
 /* Colorspace type */
 #define X264_CSP_MASK           0x00ff  /* */
@@ -296,6 +317,45 @@ typedef struct
     struct x264_param_t *param;
 } x264_zone_t;
 
+/* Statistics of one encoded frame, passed to x264_param_t.frame_stats. */
+typedef struct x264_frame_stats_t
+{
+    int     i_frame;            /* frame number in coded order */
+    int     i_frame_in;         /* frame number in input order */
+    int     i_type;             /* X264_TYPE_* */
+    int     b_keyframe;
+    int64_t i_pts;
+    int64_t i_dts;
+    int     i_size;             /* bytes, including NAL headers and filler */
+    /* bits by category */
+    int     i_tex_bits;
+    int     i_mv_bits;
+    int     i_misc_bits;
+    /* macroblocks by category */
+    int     i_mb_count_i;
+    int     i_mb_count_p;
+    int     i_mb_count_skip;
+    float   f_qp_avg_rc;        /* QP chosen by ratecontrol */
+    float   f_qp_avg_aq;        /* average QP after adaptive quantization */
+    float   f_crf_avg;
+    float   f_vbv_fullness;     /* VBV buffer fullness after this frame, 0..1; -1 without VBV */
+    int     i_lookahead_cost;   /* lowres SATD cost estimated by the lookahead for the chosen frame type;
+                                 * 0 if ratecontrol didn't need it (e.g. CQP) */
+    float   f_planned_bits;     /* frame size in bits predicted by ratecontrol; 0 if it made no prediction (e.g. CQP) */
+    float   f_psnr[3];          /* Y, U, V; only with analyse.b_psnr */
+    float   f_ssim;             /* only with analyse.b_ssim */
+    float   f_ssim_chroma[2];   /* U, V; only with analyse.b_ssim */
+    /* Per-MB luma PSNR and SSIM in raster order, i_map_width by i_map_height macroblocks; only with
+     * analyse.b_metric_maps and b_psnr or b_ssim respectively, otherwise NULL.  Only valid during the
+     * callback.  Macroblocks with no complete 8x8 window inside the picture have an SSIM of 1. */
+    float  *f_psnr_map;
+    float  *f_ssim_map;
+    int     i_map_width;
+    int     i_map_height;
+    int64_t i_latency;          /* nanoseconds from the x264_encoder_encode call that took the frame
+                                 * to the frame being finished */
+} x264_frame_stats_t;
+
 typedef struct x264_param_t
 {
     /* CPU flags */
@@ -306,6 +366,7 @@ typedef struct x264_param_t
     int         b_deterministic; /* whether to allow non-deterministic optimizations when threaded */
     int         b_cpu_independent; /* force canonical behavior rather than cpu-dependent optimal algorithms */
     int         i_sync_lookahead; /* threaded lookahead buffer */
+    int         b_row_input;      /* pictures may be passed before they are complete, see x264_encoder_input_rows */
 
     /* Video Properties */
     int         i_width;
@@ -394,6 +455,7 @@ typedef struct x264_param_t
     void        *p_log_private;
     int         i_log_level;
     int         b_full_recon;   /* fully reconstruct frames, even when not necessary for encoding.  Implied by psz_dump_yuv */
+    int         b_profile_stages; /* time the major encoding stages, see x264_encoder_stats */
     char        *psz_dump_yuv;  /* filename (in UTF-8) for reconstructed frames */
 
     /* Encoder analyser parameters */
@@ -410,6 +472,9 @@ typedef struct x264_param_t
 
         int          i_me_method; /* motion estimation algorithm to use (X264_ME_*) */
         int          i_me_range; /* integer pixel motion estimation search range (from predicted mv) */
+        int          i_me_guide_range; /* if nonzero, seed the search of every reference with the lookahead's
+                                        * lowres mvs and, when the lookahead has mvs for the nearest references,
+                                        * search only this far around the best predictor */
         int          i_mv_range; /* maximum length of a mv (in pixels). -1 = auto, based on level */
         int          i_mv_range_thread; /* minimum space between threads. -1 = auto, based on number of threads. */
         int          i_subpel_refine; /* subpixel motion estimation quality */
@@ -431,6 +496,7 @@ typedef struct x264_param_t
 
         int          b_psnr;    /* compute and print PSNR stats */
         int          b_ssim;    /* compute and print SSIM stats */
+        int          b_metric_maps; /* per-MB PSNR/SSIM maps in x264_frame_stats_t */
     } analyse;
 
     /* Rate control parameters */
@@ -450,6 +516,8 @@ typedef struct x264_param_t
         int         i_vbv_max_bitrate;
         int         i_vbv_buffer_size;
         float       f_vbv_buffer_init; /* <=1: fraction of buffer_size. >1: kbit */
+        int         b_vbv_rows;     /* Also hold each row of macroblocks to the VBV, as if rows were sent
+                                     * as soon as they are encoded.  Not with frame threads. */
         float       f_ip_factor;
         float       f_pb_factor;
 
@@ -461,12 +529,14 @@ typedef struct x264_param_t
         float       f_aq_strength;
         int         b_mb_tree;      /* Macroblock-tree ratecontrol. */
         int         i_lookahead;
+        int         i_lookahead_downscale; /* lookahead analysis resolution as a fraction of the input: 2, 4 or 8; 0 = auto */
 
         /* 2pass */
         int         b_stat_write;   /* Enable stat writing in psz_stat_out */
         char        *psz_stat_out;  /* output filename (in UTF-8) of the 2pass stats file */
         int         b_stat_read;    /* Read stat from psz_stat_in and use it */
         char        *psz_stat_in;   /* input filename (in UTF-8) of the 2pass stats file */
+        int         i_stat_format;  /* format of psz_stat_out (X264_STATS_FORMAT_*); psz_stat_in is autodetected */
 
         /* 2pass params (same as ffmpeg ones) */
         float       f_qcompress;    /* 0.0 => cbr, 1.0 => constant qp */
@@ -496,6 +566,9 @@ typedef struct x264_param_t
     int b_repeat_headers;       /* put SPS/PPS before each keyframe */
     int b_annexb;               /* if set, place start codes (4 bytes) before NAL units,
                                  * otherwise place size (4 bytes) before NAL units. */
+    int b_single_nal;           /* return each frame, and the headers, as a single x264_nal_t spanning the
+                                 * whole access unit, with the type and priority of its first NAL unit.
+                                 * Ignored with nalu_process. */
     int i_sps_id;               /* SPS and PPS id number */
     int b_vfr_input;            /* VFR input.  If 1, use timebase and timestamps for ratecontrol purposes.
                                  * If 0, use fps only. */
@@ -588,6 +661,12 @@ typedef struct x264_param_t
      * e.g. if doing multiple encodes in one process.
      */
     void (*nalu_process) ( x264_t *h, x264_nal_t *nal, void *opaque );
+
+    /* Optional callback for monitoring.  Called once for each encoded frame, from
+     * x264_encoder_encode on the calling thread, just before the frame is returned.
+     * stats is only valid during the call.  The opaque pointer is the opaque pointer
+     * from the input frame, as with nalu_process. */
+    void (*frame_stats) ( x264_t *h, const x264_frame_stats_t *stats, void *opaque );
 } x264_param_t;
 
 void x264_nal_encode( x264_t *h, uint8_t *dst, x264_nal_t *nal );
@@ -846,6 +925,8 @@ typedef struct
 
     /* Out: SSIM of the the frame luma (if x264_param_t.b_ssim is set) */
     double f_ssim;
+    /* Out: SSIM of U and V (if x264_param_t.b_ssim is set) */
+    double f_ssim_chroma[2];
     /* Out: Average PSNR of the frame (if x264_param_t.b_psnr is set) */
     double f_psnr_avg;
     /* Out: PSNR of Y, U, and V (if x264_param_t.b_psnr is set) */
@@ -976,6 +1057,20 @@ int     x264_encoder_encode( x264_t *, x264_nal_t **pp_nal, int *pi_nal, x264_pi
 /* x264_encoder_close:
  *      close an encoder handler */
 void    x264_encoder_close  ( x264_t * );
+/* x264_encoder_reset:
+ *      start a new stream with the same encoder handler, as if it had been closed and opened again,
+ *      but keeping its threads, frame pools and tables.
+ *      the encoder must be flushed first (x264_encoder_delayed_frames() == 0).
+ *      the statistics of the previous stream are printed, and the next frame is an IDR-frame;
+ *      call x264_encoder_headers again if the stream needs them.
+ *      if param is not NULL, it is applied as with x264_encoder_reconfig, so the same parameters can
+ *      be changed: the resolution, colorspace and threading can't, open a new encoder for those.
+ *      headers keep describing the limits chosen at open, e.g. with a lower i_frame_reference the SPS
+ *      still signals the original num_ref_frames, so such a stream is valid but not identical to the
+ *      one a newly opened encoder would produce.
+ *      returns 0 on success, negative on error.  if the parameters are invalid the encoder is left
+ *      unchanged, other errors leave it in a state where it can only be closed. */
+int     x264_encoder_reset( x264_t *, x264_param_t *param );
 /* x264_encoder_delayed_frames:
  *      return the number of currently delayed (buffered) frames
  *      this should be used at the end of the stream, to know when you have all the encoded frames. */
@@ -998,6 +1093,44 @@ int     x264_encoder_maximum_delayed_frames( x264_t *h );
  *
  *      Should not be called during an x264_encoder_encode. */
 void    x264_encoder_intra_refresh( x264_t * );
+typedef struct x264_stage_stats_t
+{
+    int64_t i_calls;
+    int64_t i_time;                         /* nanoseconds */
+    int64_t i_hist[X264_STAGE_HIST_BINS];   /* calls by duration: bin i counts calls that took
+                                             * [2^(i+7), 2^(i+8)) ns; the first and last bins are open-ended */
+} x264_stage_stats_t;
+
+typedef struct x264_wait_stats_t
+{
+    int64_t i_waits;                        /* number of times a thread actually blocked */
+    int64_t i_time;                         /* nanoseconds */
+} x264_wait_stats_t;
+
+typedef struct x264_encoder_stats_t
+{
+    int     i_threads;                      /* number of thread contexts that can be queried */
+    x264_stage_stats_t stage[X264_STAGE_MAX];
+    x264_wait_stats_t  wait[X264_WAIT_MAX];
+    int64_t i_busy_time;                    /* nanoseconds spent encoding frames or running the lookahead
+                                             * thread, excluding the time blocked inside them */
+    int64_t i_wall_time;                    /* nanoseconds from the first x264_encoder_encode to the
+                                             * latest output frame */
+    float   f_parallelism;                  /* i_busy_time / i_wall_time: the average number of threads doing
+                                             * useful work.  Only set for the sum over all contexts. */
+} x264_encoder_stats_t;
+
+/* x264_encoder_stats:
+ *      fills stats with the time spent in each encoding stage (X264_STAGE_*) and the time threads
+ *      spent blocked at each synchronization point (X264_WAIT_*) so far.
+ *      i_thread < 0 gives the sum over all thread contexts, otherwise the numbers of the given
+ *      context (0 .. i_threads-1); with sync-lookahead the last context is the lookahead thread.
+ *      Waits of the calling thread are charged to the frame context it was handling.
+ *      Stage times require b_profile_stages and are zero otherwise; waits are always collected.
+ *      Should not be called during an x264_encoder_encode.
+ *      returns 0 on success, negative if i_thread is out of range. */
+int x264_encoder_stats( x264_t *, int i_thread, x264_encoder_stats_t *stats );
+
 /* x264_encoder_invalidate_reference:
  *      An interactive error resilience tool, designed for use in a low-latency one-encoder-few-clients
  *      system.  When the client has packet loss or otherwise incorrectly decodes a frame, the encoder
@@ -1022,4 +1155,25 @@ void    x264_encoder_intra_refresh( x264_t * );
  *      Returns 0 on success, negative on failure. */
 int x264_encoder_invalidate_reference( x264_t *, int64_t pts );
 
+/* x264_encoder_input_rows:
+ *      With b_row_input, x264_encoder_encode may be called as soon as a picture starts arriving, e.g.
+ *      from a capture card delivering scan lines.  The encoder then reads the picture as it is filled,
+ *      starting each row of macroblocks once the lines it covers are in place.  Call this function,
+ *      typically from the thread filling the picture, whenever more lines are ready: i_lines is the
+ *      number of luma lines, with their chroma, written so far counting from the top.
+ *      i_lines >= i_height completes the picture, and later calls count the lines of the next one, so
+ *      a picture can be signalled before x264_encoder_encode is called with it.
+ *      x264_encoder_encode returns once the whole picture has been read, so each picture passed to it
+ *      must eventually be completed.
+ *
+ *      Encoding can only start before the picture is complete if it is encoded without delay
+ *      (no B-frames, lookahead, sync-lookahead, VFR input or frame threads) and nothing analyses the
+ *      whole picture first (ABR, CRF, scenecut, weighted prediction or auto-variance AQ).  Otherwise
+ *      the picture is read in full before encoding it.  For the lowest latency use constant QP with
+ *      sliced threads and nalu_process.
+ *
+ *      Can be called from any thread, also while x264_encoder_encode is running.
+ *      Returns 0 on success, negative if b_row_input is not set. */
+int x264_encoder_input_rows( x264_t *, int i_lines );
+
 #endif